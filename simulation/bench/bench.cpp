@@ -0,0 +1,1103 @@
+#include <omp.h>
+#include <raylib.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "../include/engine/Fluid.hpp"
+#include "../include/engine/advect.hpp"
+#include "../include/engine/engine.hpp"
+#include "../include/engine/ensemble.hpp"
+#include "../include/engine/recorder.hpp"
+#include "../include/engine/voxelizer.hpp"
+
+/* Per-stage micro-benchmarks for the Fluid solver. Every stage is timed on its own over a sweep
+ * of resolutions and thread counts, results can be saved as a JSON baseline and later runs
+ * compared against it. */
+
+struct Result {
+    std::string stage;
+    std::string layout;
+    int resolution;
+    int threads;
+    int reps;
+    double mean_ns;
+    double stddev_ns;
+    double median_ns;
+    double mad_ns;  // median absolute deviation from median_ns
+    double ns_per_cell;
+    double gb_per_s;
+};
+
+struct Stage {
+    std::string name;
+    std::function<void(Fluid&)> run;
+    std::function<double(double n)> bytes;  // estimated memory traffic of one call
+    bool plume = false;                     // start from a local plume instead of random fields
+};
+
+/** has access to the private solver stages of Fluid */
+struct StageBench {
+    static void seed(Fluid& fluid) {
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> velocity(-0.01f, 0.01f);
+        std::uniform_real_distribution<float> density(0.0f, 100.0f);
+
+        for (int i = 0; i < fluid.vx.size(); i++) {
+            fluid.vx[i] = velocity(rng);
+            fluid.vy[i] = velocity(rng);
+            fluid.vz[i] = velocity(rng);
+            fluid.density[i] = density(rng);
+        }
+        fluid.vx0 = fluid.vx;
+        fluid.vy0 = fluid.vy;
+        fluid.vz0 = fluid.vz;
+        fluid.s = fluid.density;
+        fluid.tiles_tracked = false;
+    }
+
+    /** quiescent fluid with density and velocity in a cube of an eighth of the domain's width
+     * near the origin, the case sparse stepping is meant for */
+    static void seed_plume(Fluid& fluid) {
+        int n = fluid.container_size;
+        for (Field<real>* f : {&fluid.s, &fluid.density, &fluid.vx, &fluid.vy, &fluid.vz,
+                                &fluid.vx0, &fluid.vy0, &fluid.vz0})
+            f->fill(0.0f);
+        for (int z = n / 8; z < n / 4; z++) {
+            for (int y = n / 8; y < n / 4; y++) {
+                for (int x = n / 8; x < n / 4; x++) {
+                    fluid.density(x, y, z) = 100.0f;
+                    fluid.vx(x, y, z) = 0.01f;
+                }
+            }
+        }
+        fluid.tiles_tracked = false;
+    }
+
+    /** true if the cells of the obstacles and everything derived from them match */
+    static bool same_solids(const Fluid& a, const Fluid& b) {
+        return a.state.to_linear() == b.state.to_linear() &&
+               a.owner.to_linear() == b.owner.to_linear() &&
+               a.mask.to_linear() == b.mask.to_linear() && a.tile_flags == b.tile_flags &&
+               a.cut_cells == b.cut_cells;
+    }
+
+    static std::vector<Stage> stages(void) {
+        // bytes per stored value and per mask or owner cell
+        constexpr double v = sizeof(real), m = sizeof(uint8_t);
+        // 4 Gauss-Seidel sweeps, each reading f0 and f and writing f
+        auto lin_solve_bytes = [=](double n) { return 4 * 3 * v * n * n * n; };
+
+        return {
+            {"diffuse",
+             [](Fluid& f) { f.diffuse(FieldType::VX, f.vx0, f.vx, 0.0001f); },
+             lin_solve_bytes},
+            {"lin_solve",
+             [](Fluid& f) { f.lin_solve(FieldType::DENSITY, f.s, f.density, 1, 6); },
+             lin_solve_bytes},
+            {"project",
+             [](Fluid& f) { f.project(f.vx0, f.vy0, f.vz0, f.vx, f.vy); },
+             [=](double n) {
+                 // divergence: 3 velocities + mask in, div + p out. gradient: p + mask in,
+                 // 3 velocities read and written
+                 return (5 * v + m) * n * n * n + lin_solve_bytes(n) + (7 * v + m) * n * n * n;
+             }},
+            {"advect",
+             [](Fluid& f) {
+                 f.advect({{FieldType::DENSITY, f.density, f.s}}, f.vx, f.vy, f.vz);
+             },
+             [=](double n) { return 5 * v * n * n * n; }},
+            {"advect_velocity",
+             [](Fluid& f) {
+                 f.advect({{FieldType::VX, f.vx, f.vx0},
+                           {FieldType::VY, f.vy, f.vy0},
+                           {FieldType::VZ, f.vz, f.vz0}},
+                          f.vx0, f.vy0, f.vz0);
+             },
+             // velocity read once, 3 fields gathered and 3 written
+             [=](double n) { return 9 * v * n * n * n; }},
+            {"maccormack",
+             [](Fluid& f) {
+                 f.advect_scheme = AdvectScheme::MACCORMACK;
+                 f.advect({{FieldType::DENSITY, f.density, f.s}}, f.vx, f.vy, f.vz);
+                 f.advect_scheme = AdvectScheme::SEMI_LAGRANGIAN;
+             },
+             // forward and backward pass, correction and limiter
+             [=](double n) { return 17 * v * n * n * n; }},
+            {"bfecc",
+             [](Fluid& f) {
+                 f.advect_scheme = AdvectScheme::BFECC;
+                 f.advect({{FieldType::DENSITY, f.density, f.s}}, f.vx, f.vy, f.vz);
+                 f.advect_scheme = AdvectScheme::SEMI_LAGRANGIAN;
+             },
+             // three passes, correction and limiter
+             [=](double n) { return 22 * v * n * n * n; }},
+            {"set_boundaries",
+             [](Fluid& f) { f.set_boundaries(FieldType::VX, f.vx); },
+             [=](double n) { return 6 * n * n * 3 * v; }},
+            {"voxelize_all",
+             [](Fluid& f) { f.voxelize_all(); },
+             // cell state and owner written, state read and mask written by update_mask
+             [=](double n) { return 4 * m * n * n * n; }},
+            {"step",
+             [](Fluid& f) {
+                 f.sparse = false;
+                 f.step();
+             },
+             [](double) { return 0.0; },  // not estimated for a whole step
+             true},
+            {"step_sparse",
+             [](Fluid& f) {
+                 f.sparse = true;
+                 f.step();
+                 f.sparse = false;
+             },
+             [](double) { return 0.0; },  // not estimated for a whole step
+             true},
+        };
+    }
+};
+
+/** triangles of an axis aligned box from the origin to size, three corners each */
+static std::vector<v3> box_triangles(v3 size) {
+    const int faces[12][3] = {{0, 2, 1}, {0, 3, 2}, {4, 5, 6}, {4, 6, 7}, {0, 1, 5}, {0, 5, 4},
+                              {3, 6, 2}, {3, 7, 6}, {0, 4, 7}, {0, 7, 3}, {1, 2, 6}, {1, 6, 5}};
+    auto corner = [&](int c) {
+        return v3(c == 1 || c == 2 || c == 5 || c == 6 ? size.x : 0.0f,
+                  c == 2 || c == 3 || c == 6 || c == 7 ? size.y : 0.0f, c >= 4 ? size.z : 0.0f);
+    };
+
+    std::vector<v3> triangles;
+    for (int t = 0; t < 12; t++)
+        for (int c = 0; c < 3; c++) triangles.push_back(corner(faces[t][c]));
+    return triangles;
+}
+
+/** mesh of the given triangles, built on the CPU so no window is needed */
+static Model triangle_model(const std::vector<v3>& triangles) {
+    Mesh mesh = {0};
+    mesh.triangleCount = triangles.size() / 3;
+    mesh.vertexCount = triangles.size();
+    mesh.vertices = (float*)MemAlloc(triangles.size() * 3 * sizeof(float));
+    for (size_t i = 0; i < triangles.size(); i++) {
+        mesh.vertices[i * 3] = triangles[i].x;
+        mesh.vertices[i * 3 + 1] = triangles[i].y;
+        mesh.vertices[i * 3 + 2] = triangles[i].z;
+    }
+
+    return LoadModelFromMesh(mesh);
+}
+
+/** axis aligned box mesh */
+static Model box_model(float size) { return triangle_model(box_triangles(v3(size))); }
+
+/** UV sphere of radius r around the origin, every face is planar so the mesh is convex */
+static std::vector<v3> sphere_triangles(float r, int segments, int rings) {
+    auto point = [&](int ring, int segment) {
+        double theta = M_PI * ring / rings, phi = 2 * M_PI * segment / segments;
+        return v3(r * sin(theta) * cos(phi), r * sin(theta) * sin(phi), r * cos(theta));
+    };
+
+    std::vector<v3> triangles;
+    for (int ring = 0; ring < rings; ring++) {
+        for (int segment = 0; segment < segments; segment++) {
+            v3 a = point(ring, segment), b = point(ring + 1, segment);
+            v3 c = point(ring + 1, segment + 1), d = point(ring, segment + 1);
+            if (ring > 0) triangles.insert(triangles.end(), {a, b, d});
+            if (ring < rings - 1) triangles.insert(triangles.end(), {b, c, d});
+        }
+    }
+    return triangles;
+}
+
+static std::vector<int> parse_list(const char* arg) {
+    std::vector<int> values;
+    std::stringstream stream(arg);
+    std::string item;
+    while (std::getline(stream, item, ',')) values.push_back(std::stoi(item));
+    return values;
+}
+
+static void write_json(const std::string& path, const std::vector<Result>& results) {
+    std::ofstream file(path);
+    file << "{\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        file << "    {\"stage\": \"" << r.stage << "\", \"layout\": \"" << r.layout
+             << "\", \"resolution\": " << r.resolution
+             << ", \"threads\": " << r.threads << ", \"reps\": " << r.reps
+             << ", \"mean_ns\": " << r.mean_ns << ", \"stddev_ns\": " << r.stddev_ns
+             << ", \"median_ns\": " << r.median_ns << ", \"mad_ns\": " << r.mad_ns
+             << ", \"ns_per_cell\": " << r.ns_per_cell << ", \"gb_per_s\": " << r.gb_per_s << "}"
+             << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    file << "  ]\n}\n";
+}
+
+/** reads back the flat records written by write_json */
+static std::vector<Result> read_json(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Could not open baseline " + path);
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    std::vector<Result> results;
+    size_t pos = text.find('[');
+    while ((pos = text.find('{', pos)) != std::string::npos) {
+        size_t end = text.find('}', pos);
+        std::string record = text.substr(pos + 1, end - pos - 1);
+        pos = end;
+
+        // baselines from before layouts and medians existed
+        Result r = {.layout = "linear", .median_ns = -1};
+        std::stringstream fields(record);
+        std::string field;
+        while (std::getline(fields, field, ',')) {
+            size_t colon = field.find(':');
+            if (colon == std::string::npos) continue;
+
+            std::string key = field.substr(0, colon);
+            std::string value = field.substr(colon + 1);
+            key.erase(std::remove_if(key.begin(), key.end(),
+                                     [](char c) { return c == '"' || isspace(c); }),
+                      key.end());
+            value.erase(std::remove_if(value.begin(), value.end(),
+                                       [](char c) { return c == '"' || isspace(c); }),
+                        value.end());
+
+            if (key == "stage") r.stage = value;
+            else if (key == "layout") r.layout = value;
+            else if (key == "resolution") r.resolution = std::stoi(value);
+            else if (key == "threads") r.threads = std::stoi(value);
+            else if (key == "reps") r.reps = std::stoi(value);
+            else if (key == "mean_ns") r.mean_ns = std::stod(value);
+            else if (key == "stddev_ns") r.stddev_ns = std::stod(value);
+            else if (key == "median_ns") r.median_ns = std::stod(value);
+            else if (key == "mad_ns") r.mad_ns = std::stod(value);
+            else if (key == "ns_per_cell") r.ns_per_cell = std::stod(value);
+            else if (key == "gb_per_s") r.gb_per_s = std::stod(value);
+        }
+        if (r.median_ns < 0) {
+            // the mad of a normal distribution with the stored deviation
+            r.median_ns = r.mean_ns;
+            r.mad_ns = 0.6745 * r.stddev_ns;
+        }
+        results.push_back(r);
+    }
+
+    return results;
+}
+
+/** runs every supported advection kernel on random fields and compares it to the scalar one,
+ * errors are relative to the largest value of the field. Returns the number of mismatches */
+static int verify_advection(const std::vector<int>& resolutions) {
+    std::mt19937 rng(99);
+    // fast enough that back-traces near the walls leave the grid and hit the clamps
+    std::uniform_real_distribution<float> velocity(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> value(0.0f, 100.0f);
+
+    int failures = 0;
+    for (int n : resolutions) {
+        Field<real> d0(n), vx(n), vy(n), vz(n), reference(n);
+        for (int i = 0; i < d0.size(); i++) {
+            d0[i] = value(rng);
+            vx[i] = velocity(rng);
+            vy[i] = velocity(rng);
+            vz[i] = velocity(rng);
+        }
+
+        float dt0 = 0.1f * (n - 2);
+        advect_interior(AdvectKernel::SCALAR, reference, d0, vx, vy, vz, dt0);
+
+        for (AdvectKernel kernel : {AdvectKernel::AVX2, AdvectKernel::AVX512}) {
+            if (!advect_kernel_supported(kernel)) {
+                printf("advect %-7s N=%-4d not supported by this CPU or build\n",
+                       advect_kernel_name(kernel), n);
+                continue;
+            }
+
+            Field<real> d(n);
+            advect_interior(kernel, d, d0, vx, vy, vz, dt0);
+
+            double max_error = 0.0;
+            for (int i = 0; i < d.size(); i++)
+                max_error = std::max(max_error, (double)std::abs(d[i] - reference[i]));
+            max_error /= value.max();
+
+            // a contracted FMA moves a back-traced position by a few ulp, i.e. ~n * epsilon cells
+            bool ok = max_error <= 4 * n * std::numeric_limits<float>::epsilon();
+            printf("advect %-7s N=%-4d max relative error %.3g %s\n", advect_kernel_name(kernel),
+                   n, max_error, ok ? "ok" : "MISMATCH");
+            failures += !ok;
+
+            // the limiter of MacCormack and BFECC, on values reaching past the corners' range
+            Field<real> limited(n), reference_limited(n);
+            for (int i = 0; i < d.size(); i++)
+                limited[i] = reference_limited[i] = 2.0f * value(rng) - value.max();
+            AdvectedField bounds[] = {{FieldType::DENSITY, limited, d0}};
+            AdvectedField reference_bounds[] = {{FieldType::DENSITY, reference_limited, d0}};
+            limit_interior(kernel, bounds, vx, vy, vz, dt0);
+            limit_interior(AdvectKernel::SCALAR, reference_bounds, vx, vy, vz, dt0);
+
+            int differ = 0;
+            for (int i = 0; i < d.size(); i++) differ += limited[i] != reference_limited[i];
+            // where an FMA moves a back-trace across a cell face it picks other corners
+            bool limit_ok = differ <= n * n / 100;
+            printf("limit  %-7s N=%-4d %d cells differ %s\n", advect_kernel_name(kernel), n,
+                   differ, limit_ok ? "ok" : "MISMATCH");
+            failures += !limit_ok;
+        }
+
+        // the bricked layout has to give the same cells as the linear one
+        Field<real> linear(n), bricked(n, 0.0f, FieldLayout::BRICKED);
+        Field<real> bd0(n, 0.0f, FieldLayout::BRICKED), bvx(n, 0.0f, FieldLayout::BRICKED),
+            bvy(n, 0.0f, FieldLayout::BRICKED), bvz(n, 0.0f, FieldLayout::BRICKED);
+        for (int z = 0; z < n; z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    bd0(x, y, z) = d0(x, y, z);
+                    bvx(x, y, z) = vx(x, y, z);
+                    bvy(x, y, z) = vy(x, y, z);
+                    bvz(x, y, z) = vz(x, y, z);
+                }
+            }
+        }
+        advect_interior(best_advect_kernel(), linear, d0, vx, vy, vz, dt0);
+        advect_interior(best_advect_kernel(), bricked, bd0, bvx, bvy, bvz, dt0);
+        bool same_layout = bricked.to_linear() == linear.to_linear();
+        printf("advect bricked N=%-4d %s\n", n, same_layout ? "ok" : "MISMATCH");
+        failures += !same_layout;
+
+        // a fused pass has to give every field exactly what a pass of its own gives it
+        Field<real> fused[3] = {Field<real>(n), Field<real>(n), Field<real>(n)};
+        const Field<real>* sources[3] = {&d0, &vx, &vy};
+        AdvectedField fields[3] = {{FieldType::DENSITY, fused[0], d0},
+                                   {FieldType::VX, fused[1], vx},
+                                   {FieldType::VY, fused[2], vy}};
+        advect_interior(best_advect_kernel(), fields, vx, vy, vz, dt0);
+
+        bool same = true;
+        for (int f = 0; f < 3; f++) {
+            Field<real> single(n);
+            advect_interior(best_advect_kernel(), single, *sources[f], vx, vy, vz, dt0);
+            same &= std::equal(single.begin(), single.end(), fused[f].begin());
+        }
+        printf("advect fused   N=%-4d %s\n", n, same ? "ok" : "MISMATCH");
+        failures += !same;
+
+        // every tile stepped on its own has to give the cells of a whole grid pass
+        int tiles = (n + 7) / 8;
+        std::vector<TileSpan> spans;
+        for (int t = 0; t < tiles * tiles * tiles; t++) spans.push_back({t, 1});
+        for (AdvectKernel kernel :
+             {AdvectKernel::SCALAR, AdvectKernel::AVX2, AdvectKernel::AVX512}) {
+            if (!advect_kernel_supported(kernel)) continue;
+
+            Field<real> whole(n), tiled(n);
+            advect_interior(kernel, whole, d0, vx, vy, vz, dt0);
+            advect_interior(kernel, tiled, d0, vx, vy, vz, dt0, &spans);
+            bool same_tiles = std::equal(whole.begin(), whole.end(), tiled.begin());
+            printf("advect tiles   N=%-4d %-7s %s\n", n, advect_kernel_name(kernel),
+                   same_tiles ? "ok" : "MISMATCH");
+            failures += !same_tiles;
+        }
+    }
+
+    return failures;
+}
+
+/** instance k of an ensemble: its own injection point and, from the second on, a box of its own */
+static void seed_instance(int n, int k, std::vector<std::unique_ptr<Obstacle>>& obstacles,
+                          v3& position, v3& velocity) {
+    position = v3(n / 4 + k % 4, n / 2, n / 4 + k / 4 % 4);
+    velocity = v3(0.5f, 0.1f * (k % 3), 0.2f);
+    if (k > 0)
+        obstacles.push_back(std::make_unique<Obstacle>(v3(n / 2 + k % 3, n / 3, n / 3), v3(1.0f),
+                                                       box_model(n / 6 + k % 2), true, "box"));
+}
+
+/** every instance of an ensemble has to get the fields of a Fluid stepped on its own */
+static int verify_ensemble(void) {
+    const int lanes = 8, steps = 5;
+    int failures = 0;
+
+    for (int n : {24, 32}) {
+        EnsembleFluid ensemble(n, lanes, 0.0001f, 0.0001f, 0.1f);
+        std::vector<std::unique_ptr<Fluid>> fluids;
+        std::vector<v3> positions(lanes), velocities(lanes);
+
+        for (int k = 0; k < lanes; k++) {
+            std::vector<std::unique_ptr<Obstacle>> obstacles;
+            seed_instance(n, k, obstacles, positions[k], velocities[k]);
+            ensemble.voxelize(k, obstacles);
+
+            fluids.push_back(std::make_unique<Fluid>(n, 1.0f, 0.0001f, 0.0001f, 0.1f));
+            fluids[k]->advect_kernel = AdvectKernel::SCALAR;
+            for (auto& obstacle : obstacles) fluids[k]->obstacles.push_back(std::move(obstacle));
+            fluids[k]->voxelize_all();
+        }
+
+        for (int i = 0; i < steps; i++) {
+            for (int k = 0; k < lanes; k++) {
+                ensemble.add_density(k, positions[k], 100);
+                ensemble.add_velocity(k, positions[k], velocities[k]);
+                fluids[k]->add_density(positions[k], 100);
+                fluids[k]->add_velocity(positions[k], velocities[k]);
+                fluids[k]->step();
+            }
+            ensemble.step();
+        }
+
+        double max_error = 0.0;
+        for (int k = 0; k < lanes; k++) {
+            for (FieldType type :
+                 {FieldType::DENSITY, FieldType::VX, FieldType::VY, FieldType::VZ}) {
+                std::vector<real> lane = ensemble.get_field(k, type);
+                std::vector<real> reference = fluids[k]->get_field(type).to_linear();
+                for (size_t i = 0; i < lane.size(); i++)
+                    max_error = std::max(max_error, (double)std::abs(lane[i] - reference[i]));
+            }
+        }
+        max_error /= 100.0;  // relative to the injected density
+
+        // forces are summed in another order than Fluid's, so they only agree up to rounding
+        double force_error = 0.0, largest = 1e-6;
+        for (int k = 0; k < lanes; k++) {
+            for (size_t j = 0; j < fluids[k]->obstacles.size(); j++) {
+                v3 reference = fluids[k]->obstacles[j]->force;
+                v3 d = ensemble.get_force(k, j) - reference;
+                force_error = std::max({force_error, (double)std::abs(d.x),
+                                        (double)std::abs(d.y), (double)std::abs(d.z)});
+                largest = std::max({largest, (double)std::abs(reference.x),
+                                    (double)std::abs(reference.y), (double)std::abs(reference.z)});
+            }
+        }
+        force_error /= largest;
+
+        // instances past either end have no lanes of their own to write
+        bool guarded = true;
+        for (int instance : {-1, lanes}) {
+            try {
+                ensemble.add_density(instance, positions[0], 100);
+                guarded = false;
+            } catch (const std::out_of_range&) {
+            }
+        }
+
+        bool ok = max_error <= 1e-5 && force_error <= 1e-4 && guarded;
+        printf("ensemble       N=%-4d %d lanes max relative error %.3g, forces %.3g %s\n", n,
+               lanes, max_error, force_error, ok ? "ok" : "MISMATCH");
+        failures += !ok;
+    }
+
+    return failures;
+}
+
+/** A jet fed every step and moving several tiles per step, stepped sparse and dense. Sparse steps
+ * are cut into substeps of at most 4 cells, the dense run gets the same substeps through its CFL
+ * number. Pruning below sparse_threshold and the pressure solve on the active tiles leave small
+ * differences, flow escaping the active tiles shows as a far larger error. */
+static int verify_sparse(void) {
+    const int n = 48, steps = 8;
+    const float speed = 3.0f;  // dt * (n - 2) * speed is about 14 cells per step
+
+    Fluid dense(n, 1.0f, 0.0001f, 0.0001f, 0.1f), sparse(n, 1.0f, 0.0001f, 0.0001f, 0.1f);
+    dense.cfl = 4.0f;
+    sparse.sparse = true;
+
+    bool same_substeps = true;
+    for (int i = 0; i < steps; i++) {
+        for (Fluid* fluid : {&dense, &sparse}) {
+            for (int z = n / 8; z < n / 4; z++) {
+                for (int y = n / 8; y < n / 4; y++) {
+                    for (int x = n / 8; x < n / 4; x++) {
+                        fluid->add_density(v3(x, y, z), 100.0f);
+                        fluid->add_velocity(v3(x, y, z), v3(speed, 0.0f, 0.0f));
+                    }
+                }
+            }
+            fluid->step();
+        }
+        same_substeps &= dense.substeps == sparse.substeps;
+    }
+
+    double max_error = 0.0;
+    for (FieldType type : {FieldType::DENSITY, FieldType::VX, FieldType::VY, FieldType::VZ}) {
+        std::vector<real> a = dense.get_field(type).to_linear();
+        std::vector<real> b = sparse.get_field(type).to_linear();
+        double scale = type == FieldType::DENSITY ? 100.0 : speed;
+        for (size_t i = 0; i < a.size(); i++)
+            max_error = std::max(max_error, std::abs((double)a[i] - (double)b[i]) / scale);
+    }
+
+    bool ok = same_substeps && max_error <= 1e-4;
+    printf("sparse         N=%-4d %d substeps max relative error %.3g %s\n", n, sparse.substeps,
+           max_error, ok ? "ok" : "MISMATCH");
+    return !ok;
+}
+
+/** feeds density and velocity into a fluid the same way every step, for the round trip checks */
+static void feed(Fluid& fluid, int n) {
+    fluid.add_density(v3(n / 4, n / 2, n / 2), 100.0f);
+    fluid.add_velocity(v3(n / 4, n / 2, n / 2), v3(0.5f, 0.1f, 0.2f));
+}
+
+/** Saves a fluid part way through a run and resumes it in a Fluid of another size and layout,
+ * both have to step on to bit identical fields and states. */
+static int verify_checkpoint(void) {
+    const int steps = 4;
+    const std::string path = (std::filesystem::temp_directory_path() / "bench.fluid").string();
+    int failures = 0;
+
+    for (auto [n, layout, other] : {std::tuple{40, FieldLayout::LINEAR, FieldLayout::BRICKED},
+                                    std::tuple{32, FieldLayout::BRICKED, FieldLayout::LINEAR}}) {
+        Fluid saved(n, 1.0f, 0.0001f, 0.0001f, 0.1f, layout);
+        Fluid resumed(24, 1.0f, 0.0001f, 0.0001f, 0.1f, other);
+        saved.add_obstacle(std::make_unique<Obstacle>(v3(n / 2), v3(1.0f), box_model(n / 5),
+                                                      true, "box"));
+        resumed.add_obstacle(std::make_unique<Obstacle>(v3(4), v3(1.0f), box_model(n / 5), true,
+                                                        "box"));
+
+        for (int i = 0; i < steps; i++) {
+            feed(saved, n);
+            saved.step();
+        }
+        saved.save_checkpoint(path);
+        resumed.load_checkpoint(path);
+        std::filesystem::remove(path);
+
+        for (int i = 0; i < steps; i++) {
+            for (Fluid* fluid : {&saved, &resumed}) {
+                feed(*fluid, n);
+                fluid->step();
+            }
+        }
+
+        bool same = resumed.container_size == n &&
+                    saved.get_state_field().to_linear() == resumed.get_state_field().to_linear();
+        for (FieldType type : {FieldType::DENSITY, FieldType::VX, FieldType::VY, FieldType::VZ}) {
+            std::vector<real> a = saved.get_field(type).to_linear();
+            std::vector<real> b = resumed.get_field(type).to_linear();
+            same = same && !memcmp(a.data(), b.data(), a.size() * sizeof(real));
+        }
+
+        printf("checkpoint     N=%-4d %s to %s %s\n", n,
+               layout == FieldLayout::LINEAR ? "linear" : "bricked",
+               other == FieldLayout::LINEAR ? "linear" : "bricked", same ? "ok" : "MISMATCH");
+        failures += !same;
+    }
+
+    return failures;
+}
+
+/** Records a run and plays it back in order, backwards and from a copy cut short in its last
+ * frames. Every frame read has to match the run within half a quantisation step. */
+static int verify_recording(void) {
+    const int n = 24, steps = 10;
+    const auto directory = std::filesystem::temp_directory_path();
+    const std::string path = (directory / "bench.rec").string();
+    const std::string cut = (directory / "bench_cut.rec").string();
+    RecordSettings settings = {.keyframe_interval = 4};
+
+    Fluid fluid(n, 1.0f, 0.0001f, 0.0001f, 0.1f);
+    fluid.add_obstacle(std::make_unique<Obstacle>(v3(n / 2), v3(1.0f), box_model(n / 5), true,
+                                                  "box"));
+    auto widen = [&](FieldType type) {
+        std::vector<real> linear = fluid.get_field(type).to_linear();
+        return std::vector<float>(linear.begin(), linear.end());
+    };
+    std::vector<Snapshot> frames(steps);
+    {
+        Recorder recorder(path, n, settings);
+        fluid.recorder = &recorder;
+        for (int i = 0; i < steps; i++) {
+            feed(fluid, n);
+            fluid.step();
+            frames[i].density = widen(FieldType::DENSITY);
+            frames[i].vx = widen(FieldType::VX);
+            frames[i].vy = widen(FieldType::VY);
+            frames[i].vz = widen(FieldType::VZ);
+            frames[i].state = fluid.get_state_field().to_linear();
+        }
+        fluid.recorder = nullptr;
+        recorder.finish();
+    }
+
+    // the index and most of the last frames go, the frames written whole before them stay
+    std::filesystem::copy_file(path, cut, std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::resize_file(cut, std::filesystem::file_size(path) * 7 / 10);
+
+    int failures = 0;
+    for (const std::string& file : {path, cut}) {
+        Recording recording(file);
+        int count = recording.get_frames();
+        bool ok = file == path ? count == steps : count > 0 && count < steps;
+
+        // worst error in quantisation steps, reading forward and then seeking backwards
+        double worst = 0.0;
+        Snapshot snapshot;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < count; i++) {
+                int frame = pass == 0 ? i : count - 1 - i;
+                recording.read(frame, snapshot);
+                const Snapshot& expected = frames[frame];
+                ok = ok && snapshot.state == expected.state;
+
+                auto compare = [&](const std::vector<float>& a, const std::vector<float>& b,
+                                   float step) {
+                    for (size_t c = 0; c < a.size(); c++)
+                        worst = std::max(worst, std::abs((double)a[c] - b[c]) / step);
+                };
+                compare(snapshot.density, expected.density, settings.density_step);
+                compare(snapshot.vx, expected.vx, settings.velocity_step);
+                compare(snapshot.vy, expected.vy, settings.velocity_step);
+                compare(snapshot.vz, expected.vz, settings.velocity_step);
+            }
+        }
+        ok = ok && worst <= 0.5 + 1e-3;  // rounding of the decoded float on top
+
+        printf("recording      N=%-4d %-9s %2d frames max error %.3f steps %s\n", n,
+               file == path ? "finished" : "cut short", count, worst, ok ? "ok" : "MISMATCH");
+        failures += !ok;
+    }
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(cut);
+    return failures;
+}
+
+/** Checks voxelize_mesh and voxelize_placed against exact answers. A cell is solid if the mesh
+ * overlaps the unit box around its centre, touching a face of it is not enough. For a box that
+ * is every cell whose centre lies within half a cell of the bounds, strictly. For a convex mesh
+ * a cell is solid if a corner or the centre is inside it or one of its vertices inside the cell,
+ * and empty if a face plane separates them, cells in neither case are not decided. */
+static int verify_voxelizer(void) {
+    const int n = 24;
+    int failures = 0;
+
+    auto report = [&](const char* name, int wrong, const char* extra = "") {
+        printf("voxelize       N=%-4d %-20s %d wrong cells%s %s\n", n, name, wrong, extra,
+               wrong ? "MISMATCH" : "ok");
+        failures += wrong > 0;
+    };
+
+    struct BoxCase {
+        const char* name;
+        v3 position, size;
+    };
+    for (const BoxCase& box : {BoxCase{"box integer", v3(5, 6, 7), v3(8, 9, 10)},
+                               BoxCase{"box half-integer", v3(5.5f, 6.5f, 7.5f), v3(8, 7, 6)},
+                               BoxCase{"box arbitrary", v3(5.3f, 6.71f, 7.05f),
+                                       v3(8.37f, 9.12f, 6.66f)}}) {
+        std::vector<v3> triangles = box_triangles(box.size);
+        std::vector<uint8_t> cells = voxelize_mesh(triangles, box.position, n, 0, n);
+        std::vector<uint8_t> slab = voxelize_mesh(triangles, box.position, n, n / 3, n / 2);
+        Occupancy placed = voxelize_placed(triangles, box.position, n);
+
+        const float lo[3] = {box.position.x, box.position.y, box.position.z};
+        const float size[3] = {box.size.x, box.size.y, box.size.z};
+        int wrong = 0;
+        for (int z = 0; z < n; z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    const int cell[3] = {x, y, z};
+                    bool solid = true;
+                    for (int k = 0; k < 3; k++)
+                        solid &= cell[k] > lo[k] - 0.5 && cell[k] < lo[k] + size[k] + 0.5;
+
+                    size_t i = x + (size_t)n * (y + (size_t)n * z);
+                    wrong += cells[i] != solid || placed.solid(x, y, z) != solid;
+                    if (z >= n / 3 && z < n / 2)
+                        wrong += slab[i - (size_t)n * n * (n / 3)] != solid;
+                }
+            }
+        }
+        report(box.name, wrong);
+    }
+
+    // the sphere is voxelized relative to the whole cells of its centre, see voxelize_placed
+    const v3 centre(11.8f, 12.3f, 12.1f);
+    std::vector<v3> triangles = sphere_triangles(8.0f, 48, 24);
+    std::vector<uint8_t> cells = voxelize_mesh(triangles, centre, n, 0, n);
+
+    struct Plane {
+        double normal[3], offset;
+    };
+    std::vector<Plane> planes;
+    for (size_t t = 0; t < triangles.size(); t += 3) {
+        const v3 &a = triangles[t], &b = triangles[t + 1], &c = triangles[t + 2];
+        double u[3] = {b.x - a.x, b.y - a.y, b.z - a.z}, v[3] = {c.x - a.x, c.y - a.y, c.z - a.z};
+        Plane plane = {{u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2],
+                        u[0] * v[1] - u[1] * v[0]}};
+        double length = std::hypot(plane.normal[0], plane.normal[1], plane.normal[2]);
+        double side = plane.normal[0] * a.x + plane.normal[1] * a.y + plane.normal[2] * a.z;
+        for (double& component : plane.normal) component /= side < 0 ? -length : length;
+        plane.offset = std::abs(side) / length;  // normals point away from the centre
+        planes.push_back(plane);
+    }
+    auto height = [](const Plane& plane, const double p[3]) {
+        return plane.normal[0] * p[0] + plane.normal[1] * p[1] + plane.normal[2] * p[2] -
+               plane.offset;
+    };
+
+    const double margin = 1e-4;  // closer to a plane than this is left undecided
+    int wrong = 0, undecided = 0;
+    for (int z = 0; z < n; z++) {
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                const double middle[3] = {x - centre.x, y - centre.y, z - centre.z};
+                std::vector<std::array<double, 3>> points = {{middle[0], middle[1], middle[2]}};
+                for (int c = 0; c < 8; c++)
+                    points.push_back({middle[0] + (c & 1 ? 0.5 : -0.5),
+                                      middle[1] + (c & 2 ? 0.5 : -0.5),
+                                      middle[2] + (c & 4 ? 0.5 : -0.5)});
+
+                bool solid = false, empty = false;
+                for (const auto& p : points) {
+                    bool inside = true;
+                    for (const Plane& plane : planes) inside &= height(plane, p.data()) < -margin;
+                    solid |= inside;
+                }
+                for (const v3& corner : triangles) {
+                    solid |= std::abs(corner.x - middle[0]) < 0.5 - margin &&
+                             std::abs(corner.y - middle[1]) < 0.5 - margin &&
+                             std::abs(corner.z - middle[2]) < 0.5 - margin;
+                }
+                for (const Plane& plane : planes) {
+                    bool outside = true;
+                    for (size_t c = 1; c < points.size(); c++)
+                        outside &= height(plane, points[c].data()) > -margin;
+                    empty |= outside;
+                }
+
+                bool voxel = cells[x + (size_t)n * (y + (size_t)n * z)];
+                if (solid) wrong += !voxel;
+                else if (empty) wrong += voxel;
+                else undecided++;
+            }
+        }
+    }
+    std::string extra = ", " + std::to_string(undecided) + " undecided";
+    report("sphere", wrong, extra.c_str());
+
+    return failures;
+}
+
+/** Three overlapping spheres edited at random, by whole cell and fractional moves, jumps that
+ * may leave the grid and toggles. After every edit a Fluid calling voxelize_moved() has to hold
+ * the same solids as one calling voxelize_all(), and both have to step on to identical fields. */
+static int verify_voxelize_moved(void) {
+    const int n = 32, edits = 40;
+    std::mt19937 rng(7);
+    auto uniform = [&](float lo, float hi) {
+        return std::uniform_real_distribution<float>(lo, hi)(rng);
+    };
+    auto whole = [&](int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); };
+
+    Fluid moved(n, 1.0f, 0.0001f, 0.0001f, 0.1f), all(n, 1.0f, 0.0001f, 0.0001f, 0.1f);
+    const v3 start[3] = {v3(12.0f, 14.0f, 13.0f), v3(17.5f, 15.0f, 14.0f),
+                         v3(15.2f, 19.3f, 16.7f)};
+    for (int k = 0; k < 3; k++) {
+        for (Fluid* fluid : {&moved, &all}) {
+            fluid->add_obstacle(std::make_unique<Obstacle>(
+                start[k], v3(1.0f), triangle_model(sphere_triangles(4.0f + k, 24, 12)), true,
+                "sphere " + std::to_string(k)));
+        }
+    }
+
+    int differing = 0;
+    for (int i = 0; i < edits; i++) {
+        int k = whole(0, 2);
+        v3 position = moved.obstacles[k]->position;
+        bool enabled = moved.obstacles[k]->enabled;
+        switch (whole(0, 3)) {
+            case 0:
+                position += v3(whole(-3, 3), whole(-3, 3), whole(-3, 3));
+                break;
+            case 1:
+                position += v3(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
+                break;
+            case 2:
+                position = v3(uniform(0, n), uniform(0, n), uniform(0, n));
+                break;
+            default:
+                enabled = !enabled;
+        }
+        for (Fluid* fluid : {&moved, &all}) {
+            fluid->obstacles[k]->position = position;
+            fluid->obstacles[k]->enabled = enabled;
+        }
+        moved.voxelize_moved();
+        all.voxelize_all();
+
+        bool same = StageBench::same_solids(moved, all);
+        for (Fluid* fluid : {&moved, &all}) {
+            feed(*fluid, n);
+            fluid->step();
+        }
+        for (FieldType type : {FieldType::DENSITY, FieldType::VX, FieldType::VY, FieldType::VZ}) {
+            std::vector<real> a = moved.get_field(type).to_linear();
+            std::vector<real> b = all.get_field(type).to_linear();
+            same = same && !memcmp(a.data(), b.data(), a.size() * sizeof(real));
+        }
+        differing += !same;
+    }
+
+    printf("voxelize_moved N=%-4d %d edits, %d differ from voxelize_all %s\n", n, edits,
+           differing, differing ? "MISMATCH" : "ok");
+    return differing > 0;
+}
+
+/** a step of `lanes` Fluids one after another against a step of an ensemble of as many */
+static void bench_ensemble(const std::vector<int>& resolutions, int lanes, double min_time) {
+    using clock = std::chrono::steady_clock;
+
+    printf("%-15s %6s %6s %14s %14s %8s\n", "ensemble", "N", "lanes", "fluids [us]",
+           "ensemble [us]", "speedup");
+    for (int n : resolutions) {
+        EnsembleFluid ensemble(n, lanes, 0.0001f, 0.000001f, 0.1f);
+        std::vector<std::unique_ptr<Fluid>> fluids;
+        std::vector<v3> positions(lanes), velocities(lanes);
+
+        for (int k = 0; k < lanes; k++) {
+            std::vector<std::unique_ptr<Obstacle>> obstacles;
+            seed_instance(n, k, obstacles, positions[k], velocities[k]);
+            ensemble.voxelize(k, obstacles);
+
+            fluids.push_back(std::make_unique<Fluid>(n, 1.0f, 0.0001f, 0.000001f, 0.1f));
+            for (auto& obstacle : obstacles) fluids[k]->obstacles.push_back(std::move(obstacle));
+            fluids[k]->voxelize_all();
+        }
+
+        auto measure = [&](auto step) {
+            step();  // warm up caches and page in the fields
+            int reps = 0;
+            auto start = clock::now();
+            std::chrono::duration<double, std::micro> elapsed(0);
+            while (reps < 3 || elapsed.count() < 1e6 * min_time) {
+                step();
+                reps++;
+                elapsed = clock::now() - start;
+            }
+            return elapsed.count() / reps;
+        };
+
+        double separate = measure([&] {
+            for (int k = 0; k < lanes; k++) {
+                fluids[k]->add_density(positions[k], 100);
+                fluids[k]->step();
+            }
+        });
+        double together = measure([&] {
+            for (int k = 0; k < lanes; k++) ensemble.add_density(k, positions[k], 100);
+            ensemble.step();
+        });
+
+        printf("%-15s %6d %6d %14.1f %14.1f %8.2f\n", "step", n, lanes, separate, together,
+               separate / together);
+        fflush(stdout);
+    }
+}
+
+static void usage(const char* program) {
+    std::cerr << "usage: " << program << " [options]\n"
+              << "  -r 24,48,64     resolutions to sweep (default 24,48,64,128,256)\n"
+              << "  -t 1,2,4        thread counts to sweep (default 1 up to all cores)\n"
+              << "  -l linear,..    field layouts to sweep: linear, bricked (default linear)\n"
+              << "  -s lin_solve,.. only run the given stages\n"
+              << "  -m seconds      minimum measuring time per stage (default 0.2)\n"
+              << "  --save file     write results as a JSON baseline\n"
+              << "  --compare file  compare against a baseline, exit 1 on regressions\n"
+              << "  --tolerance f   allowed slowdown of the median before a result counts as "
+                 "regression, if also beyond the noise of both runs (default 0.10)\n"
+              << "  --verify        check the advection kernels, the ensemble, sparse stepping, "
+                 "checkpoints, recordings and the voxelizer against reference results\n"
+              << "  --ensemble k    time k Fluids against an ensemble of k instances\n";
+}
+
+int main(int argc, char* argv[]) {
+    SetTraceLogLevel(LOG_WARNING);
+
+    std::vector<int> resolutions = {24, 48, 64, 128, 256};
+    std::vector<int> threads;
+    for (int t = 1; t < omp_get_max_threads(); t *= 2) threads.push_back(t);
+    threads.push_back(omp_get_max_threads());
+
+    std::vector<std::string> only;
+    std::vector<std::string> layouts = {"linear"};
+    double min_time = 0.2;
+    double tolerance = 0.10;
+    bool verify = false;
+    int ensemble = 0;
+    std::string save, compare;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            resolutions = parse_list(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threads = parse_list(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            std::stringstream stream(argv[++i]);
+            std::string stage;
+            while (std::getline(stream, stage, ',')) only.push_back(stage);
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            layouts.clear();
+            std::stringstream stream(argv[++i]);
+            std::string layout;
+            while (std::getline(stream, layout, ',')) layouts.push_back(layout);
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            min_time = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--save") && i + 1 < argc) {
+            save = argv[++i];
+        } else if (!strcmp(argv[i], "--compare") && i + 1 < argc) {
+            compare = argv[++i];
+        } else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--verify")) {
+            verify = true;
+        } else if (!strcmp(argv[i], "--ensemble") && i + 1 < argc) {
+            ensemble = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (verify) {
+        int failures = verify_advection(resolutions) + verify_ensemble() + verify_sparse() +
+                       verify_checkpoint() + verify_recording() + verify_voxelizer() +
+                       verify_voxelize_moved();
+        return failures ? 1 : 0;
+    }
+    if (ensemble > 0) {
+        bench_ensemble(resolutions, ensemble, min_time);
+        return 0;
+    }
+
+    using clock = std::chrono::steady_clock;
+    std::vector<Result> results;
+
+    printf("fields stored as %s\n", real_name);
+    printf("%-15s %-7s %6s %4s %6s %14s %14s %8s %11s %9s\n", "stage", "layout", "N", "thr",
+           "reps", "mean [us]", "median [us]", "cv [%]", "ns/cell", "GB/s");
+
+    for (int n : resolutions) {
+        for (const std::string& layout : layouts) {
+            FieldLayout field_layout =
+                layout == "bricked" ? FieldLayout::BRICKED : FieldLayout::LINEAR;
+            Fluid fluid(n, 1.0f, 0.0001f, 0.000001f, 0.1f, field_layout);
+            fluid.add_obstacle(std::make_unique<Obstacle>(v3(n * 3 / 8), v3(1.0f),
+                                                          box_model(n / 4), true, "box"));
+
+            for (int t : threads) {
+                omp_set_num_threads(t);
+
+                for (const Stage& stage : StageBench::stages()) {
+                    if (!only.empty() && std::ranges::find(only, stage.name) == only.end())
+                        continue;
+
+                    if (stage.plume) StageBench::seed_plume(fluid);
+                    else StageBench::seed(fluid);
+                    stage.run(fluid);  // warm up caches and page in the fields
+
+                    std::vector<double> samples;
+                    auto start = clock::now();
+                    auto elapsed = [&] {
+                        return std::chrono::duration<double>(clock::now() - start).count();
+                    };
+                    while (samples.size() < 3 || (elapsed() < min_time && samples.size() < 1000)) {
+                        auto t0 = clock::now();
+                        stage.run(fluid);
+                        std::chrono::duration<double, std::nano> took = clock::now() - t0;
+                        samples.push_back(took.count());
+                    }
+
+                    double mean = 0, variance = 0;
+                    for (double s : samples) mean += s;
+                    mean /= samples.size();
+                    for (double s : samples) variance += (s - mean) * (s - mean);
+                    variance /= samples.size() - 1;
+
+                    // the median and its spread are not thrown off by the occasional sample
+                    // that was preempted or waited on a page fault
+                    auto median = [](std::vector<double> values) {
+                        auto middle = values.begin() + values.size() / 2;
+                        std::ranges::nth_element(values, middle);
+                        return *middle;
+                    };
+                    double mid = median(samples);
+                    std::vector<double> deviations;
+                    for (double s : samples) deviations.push_back(fabs(s - mid));
+
+                    double cells = (double)n * n * n;
+                    Result r = {
+                        .stage = stage.name,
+                        .layout = layout,
+                        .resolution = n,
+                        .threads = t,
+                        .reps = (int)samples.size(),
+                        .mean_ns = mean,
+                        .stddev_ns = sqrt(variance),
+                        .median_ns = mid,
+                        .mad_ns = median(deviations),
+                        .ns_per_cell = mean / cells,
+                        .gb_per_s = stage.bytes(n) / mean,
+                    };
+                    results.push_back(r);
+
+                    printf("%-15s %-7s %6d %4d %6d %14.1f %14.1f %8.2f %11.3f %9.2f\n",
+                           r.stage.c_str(), r.layout.c_str(), r.resolution, r.threads, r.reps,
+                           r.mean_ns / 1000, r.median_ns / 1000, 100 * r.stddev_ns / r.mean_ns,
+                           r.ns_per_cell, r.gb_per_s);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    if (!save.empty()) write_json(save, results);
+
+    int regressions = 0;
+    if (!compare.empty()) {
+        std::map<std::tuple<std::string, std::string, int, int>, Result> baseline;
+        for (const Result& r : read_json(compare))
+            baseline[{r.stage, r.layout, r.resolution, r.threads}] = r;
+
+        for (const Result& r : results) {
+            auto it = baseline.find({r.stage, r.layout, r.resolution, r.threads});
+            if (it == baseline.end()) continue;
+
+            // a slowdown has to exceed the tolerance and the spread of both runs, so that noisy
+            // stages do not report regressions against themselves
+            const Result& base = it->second;
+            double change = r.median_ns / base.median_ns - 1.0;
+            double noise = 3 * (base.mad_ns + r.mad_ns);
+            if (change > tolerance && r.median_ns - base.median_ns > noise) {
+                printf("REGRESSION %-15s %-7s N=%-4d threads=%-3d %+.1f%% (median %.1f us -> "
+                       "%.1f us, noise %.1f us)\n",
+                       r.stage.c_str(), r.layout.c_str(), r.resolution, r.threads, 100 * change,
+                       base.median_ns / 1000, r.median_ns / 1000, noise / 1000);
+                regressions++;
+            }
+        }
+
+        printf("%d regression(s) against %s\n", regressions, compare.c_str());
+    }
+
+    return regressions ? 1 : 0;
+}
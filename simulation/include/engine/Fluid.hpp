@@ -1,80 +1,363 @@
-#pragma once
-#include <math.h>
-#include <raylib.h>
-#include <raymath.h>
-#include <stdlib.h>
-
-#include <vector>
-
-#include "engine.hpp"
-
-#define IX(x, y, z)                                                    \
-    std::clamp(int(x), 0, container_size - 1) +                        \
-        (std::clamp(int(y), 0, container_size - 1) * container_size) + \
-        (std::clamp(int(z), 0, container_size - 1) * container_size * container_size)
-
-#define IXv(vec)                                                             \
-    std::clamp(int((vec).x), 0, container_size - 1) +                        \
-        (std::clamp(int((vec).y), 0, container_size - 1) * container_size) + \
-        (std::clamp(int((vec).z), 0, container_size - 1) * container_size * container_size)
-
-#define N container_size
-#define N3 (N * N * N)
-
-/** contains an vector of size N^3, with flexible size at runtime, but behaves as an array */
-template <typename T>
-using Field = std::vector<T>;
-
-enum class FieldType { VX, VY, VZ, DENSITY };
-enum class CellType { SOLID, FLUID, CUT_CELL, UNDEFINED };
-
-class Fluid {
-   private:
-    float dt;   /** simulation timestep */
-    float visc; /** viscosity constant */
-
-    /** 3D cell property fields */
-    Field<float> s, density;    /** density fields */
-    Field<float> vx, vy, vz;    /** velocity fields */
-    Field<float> vx0, vy0, vz0; /** backup velocity fields */
-
-    Field<CellType> state;  // cell state field
-    Field<float> volume;    // cell volume field
-
-    v3 get_position(int i);
-
-    void advect(FieldType b, Field<float>& d, Field<float>& d0, Field<float>& velocX,
-                Field<float>& velocY, Field<float>& velocZ);
-    void diffuse(FieldType b, Field<float>& x, Field<float>& x0, float diff);
-    void lin_solve(FieldType b, Field<float>& x, Field<float>& x0, float a, float c);
-    void project(Field<float>& velocX, Field<float>& velocY, Field<float>& velocZ, Field<float>& p,
-                 Field<float>& div);
-    void set_boundaries(FieldType b, Field<float>& x);
-
-   public:
-    int container_size;
-    float scaling;
-    float diffusion;
-
-    bool should_voxelize;
-    std::vector<std::unique_ptr<Obstacle>> obstacles;
-
-    Fluid(int container_size, float fluid_size, float diffusion, float viscosity, float dt);
-    ~Fluid(void);
-
-    void reset(void);
-    void step(void);
-    void add_obstacle(std::unique_ptr<Obstacle> obstacle);
-    void add_density(v3 position, float amount);
-    void add_velocity(v3 position, v3 amount);
-
-    float get_volume(v3 position);
-    float get_density(v3 position);
-    v3 get_velocity(v3 position);
-
-    void voxelize(Obstacle& obstacle);
-    void voxelize_all(void);
-    CellType get_state(v3 position);
-};
-
-bool point_in_box(v3 point, BoundingBox box);
+#pragma once
+#include <math.h>
+#include <raylib.h>
+#include <raymath.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "engine.hpp"
+#include "parallel.hpp"
+#include "precision.hpp"
+#include "voxelizer.hpp"
+
+#define N container_size
+
+/** storage order of a Field: x-fastest rows, or 8^3 bricks that are x-fastest inside and
+ * stored x-fastest among each other, so z neighbours stay within a few KiB */
+enum class FieldLayout { LINEAR, BRICKED };
+
+/** storage offset of a coordinate along one axis: cells of an 8 wide brick are `cell` apart,
+ * bricks `brick` apart. Linear order is the special case brick = 8 * cell */
+struct AxisStride {
+    int brick, cell;
+    int operator()(int v) const { return (v >> 3) * brick + (v & 7) * cell; }
+};
+
+/** per-axis offsets handed to Field::with_index, stencil kernels are instantiated once per
+ * layout so the linear one keeps constant neighbour offsets */
+struct LinearIndex {
+    int n, sy, sz;
+    int dim(void) const { return n; }
+    int x(int v) const { return v; }
+    int y(int v) const { return v * sy; }
+    int z(int v) const { return v * sz; }
+};
+
+/** LinearIndex of a grid size known at compile time, strides and row bounds of the stencils
+ * instantiated with it are constants */
+template <int n>
+struct FixedIndex {
+    static constexpr int dim(void) { return n; }
+    static constexpr int x(int v) { return v; }
+    static constexpr int y(int v) { return v * n; }
+    static constexpr int z(int v) { return v * n * n; }
+};
+
+struct BrickIndex {
+    int n;
+    AxisStride ay, az;
+    int dim(void) const { return n; }
+    int x(int v) const { return ((v >> 3) << 9) + (v & 7); } /** bricks of 8^3 = 512 cells */
+    int y(int v) const { return ay(v); }
+    int z(int v) const { return az(v); }
+};
+
+/** N^3 cells in one of the FieldLayouts. The outermost layer is the ghost layer that
+ * set_boundaries() fills from the interior, so stencils over the interior 1..N-2 never clamp.
+ * Bricked fields are padded to whole bricks, begin()/end() walk the storage brick by brick.
+ * A field either owns its cells or is placed in memory owned by someone else, like the Arena
+ * of a Fluid. Copies own their cells, assigning a field of the same shape copies into the
+ * cells the field already has. */
+template <typename T>
+class Field {
+   private:
+    std::vector<T> owned; /** empty for placed fields */
+    T* cells;
+    int count;
+    int n;
+    FieldLayout layout;
+    AxisStride axes[3];
+
+    void set_axes(void) {
+        if (layout == FieldLayout::BRICKED) {
+            int bricks = (n + 7) / 8;
+            axes[0] = {512, 1};
+            axes[1] = {512 * bricks, 8};
+            axes[2] = {512 * bricks * bricks, 64};
+        } else {
+            axes[0] = {8, 1};
+            axes[1] = {8 * n, n};
+            axes[2] = {8 * n * n, n * n};
+        }
+    }
+
+   public:
+    /** cells stored for an n^3 field in the given layout */
+    static int storage(int n, FieldLayout layout) {
+        int bricks = (n + 7) / 8;
+        return layout == FieldLayout::BRICKED ? 512 * bricks * bricks * bricks : n * n * n;
+    }
+
+    Field(void) : cells(nullptr), count(0), n(0), layout(FieldLayout::LINEAR), axes{} {}
+    explicit Field(int n, T value = T(), FieldLayout layout = FieldLayout::LINEAR)
+        : owned(storage(n, layout), value),
+          cells(owned.data()),
+          count(owned.size()),
+          n(n),
+          layout(layout) {
+        set_axes();
+    }
+    /** places the field in storage(n, layout) cells at `cells`, which are left as they are */
+    Field(int n, T* cells, FieldLayout layout)
+        : cells(cells), count(storage(n, layout)), n(n), layout(layout) {
+        set_axes();
+    }
+
+    Field(const Field& other)
+        : owned(other.cells, other.cells + other.count),
+          cells(owned.data()),
+          count(other.count),
+          n(other.n),
+          layout(other.layout),
+          axes{other.axes[0], other.axes[1], other.axes[2]} {}
+    Field(Field&& other) = default;  // moving a vector keeps its buffer, so cells stays valid
+    Field& operator=(const Field& other) {
+        if (this == &other) return *this;
+        if (cells && n == other.n && layout == other.layout) {
+            std::copy(other.begin(), other.end(), cells);
+            return *this;
+        }
+        return *this = Field(other);
+    }
+    Field& operator=(Field&& other) = default;
+
+    int dim(void) const { return n; }
+    int size(void) const { return count; } /** stored cells, including brick padding */
+    FieldLayout get_layout(void) const { return layout; }
+    AxisStride axis(int a) const { return axes[a]; }
+
+    T* data(void) { return cells; }
+    const T* data(void) const { return cells; }
+    T* begin(void) { return cells; }
+    T* end(void) { return cells + count; }
+    const T* begin(void) const { return cells; }
+    const T* end(void) const { return cells + count; }
+
+    T& operator[](int i) { return cells[i]; }
+    const T& operator[](int i) const { return cells[i]; }
+
+    /** unchecked, (x, y, z) has to lie inside the grid including the ghost layer */
+    int index(int x, int y, int z) const { return axes[0](x) + axes[1](y) + axes[2](z); }
+    T& operator()(int x, int y, int z) { return cells[index(x, y, z)]; }
+    const T& operator()(int x, int y, int z) const { return cells[index(x, y, z)]; }
+
+    /** clamps positions outside the grid onto the nearest cell, for queries from outside the
+     * solver */
+    int clamped_index(v3 position) const {
+        return index(std::clamp(int(position.x), 0, n - 1), std::clamp(int(position.y), 0, n - 1),
+                     std::clamp(int(position.z), 0, n - 1));
+    }
+
+    /** calls f with the index matching this field's layout. Linear grids of the common sizes
+     * get a FixedIndex, so f is instantiated once per size and any other size takes the generic
+     * LinearIndex */
+    template <typename F>
+    decltype(auto) with_index(F f) const {
+        if (layout == FieldLayout::BRICKED) return f(BrickIndex{n, axes[1], axes[2]});
+        switch (n) {
+            case 32: return f(FixedIndex<32>{});
+            case 64: return f(FixedIndex<64>{});
+            case 128: return f(FixedIndex<128>{});
+            case 256: return f(FixedIndex<256>{});
+        }
+        return f(LinearIndex{n, axes[1].cell, axes[2].cell});
+    }
+
+    /** copy of the cells in x-fastest order, for writing to disk */
+    std::vector<T> to_linear(void) const {
+        if (layout == FieldLayout::LINEAR) return std::vector<T>(begin(), end());
+
+        std::vector<T> linear;
+        linear.reserve(n * n * n);
+        for (int z = 0; z < n; z++)
+            for (int y = 0; y < n; y++)
+                for (int x = 0; x < n; x++) linear.push_back((*this)(x, y, z));
+        return linear;
+    }
+
+    void fill(T value) { std::fill(begin(), end(), value); }
+};
+
+enum class FieldType { VX, VY, VZ, DENSITY };
+enum class CellType : uint8_t { SOLID, FLUID, CUT_CELL, UNDEFINED };
+
+enum class PressureSolver { GAUSS_SEIDEL, MULTIGRID, PCG };
+enum class DiffusionSolver { GAUSS_SEIDEL, PCG };
+enum class MultigridCycle { V, F };
+enum class Preconditioner { JACOBI, INCOMPLETE_CHOLESKY };
+enum class AdvectKernel { SCALAR, AVX2, AVX512 };
+enum class AdvectScheme { SEMI_LAGRANGIAN, MACCORMACK, BFECC };
+
+/** how the linear systems of project() and diffuse() are solved, read from [solver] in
+ * config.toml */
+struct SolverSettings {
+    PressureSolver pressure = PressureSolver::GAUSS_SEIDEL;
+    DiffusionSolver diffusion = DiffusionSolver::GAUSS_SEIDEL;
+    MultigridCycle cycle = MultigridCycle::V;
+    Preconditioner preconditioner = Preconditioner::INCOMPLETE_CHOLESKY;
+    float tolerance = 1e-4f;  /** relative residual |b - Ax| / |b| to stop at */
+    int max_cycles = 20;      /** multigrid cycles per solve */
+    int max_iterations = 200; /** conjugate gradient iterations per solve */
+};
+
+/** outcome of iterative solves: iterations summed over a step, worst final residual */
+struct SolveStats {
+    static constexpr float NOT_MEASURED = -1.0f; /** residual of fixed Gauss-Seidel sweeps */
+
+    int iterations;
+    float residual;
+
+    bool measured(void) const { return residual >= 0.0f; }
+};
+
+/** one field carried along the velocity by Fluid::advect: d = d0 at the back-traced position */
+struct AdvectedField {
+    FieldType type; /** boundary condition applied to d afterwards */
+    Field<real>& d;
+    const Field<real>& d0;
+};
+
+class Multigrid;
+class PCG;
+class Recorder;
+
+class Fluid {
+    friend struct StageBench; /** per-stage micro-benchmarks in bench/ */
+
+   private:
+    float dt;           /** simulated time advanced by step() */
+    float h;            /** timestep of the substep being advanced, dt unless adaptive */
+    FieldLayout layout; /** storage order of every field */
+    float visc;         /** viscosity constant */
+
+    /** 3D cell property fields */
+    Field<real> s, density;    /** density fields */
+    Field<real> vx, vy, vz;    /** velocity fields */
+    Field<real> vx0, vy0, vz0; /** backup velocity fields */
+
+    Field<CellType> state;  // cell state field
+    Field<real> volume;    // cell volume field
+    Field<uint8_t> mask;   /** state of each cell and its 6 neighbours, see update_mask() */
+    Field<uint8_t> owner;  /** index in obstacles of the obstacle a SOLID cell belongs to */
+
+    /** an obstacle as it was last voxelized, cells.position is where it was */
+    struct PlacedObstacle {
+        const Obstacle* obstacle;
+        bool enabled;
+        Occupancy cells;
+    };
+    std::vector<PlacedObstacle> placed; /** in the order of obstacles, see voxelize_moved() */
+    bool cut_cells;        /** state holds CUT_CELLs, whose volume project() has to read */
+    Arena arena;           /** storage of the fields above, sized for container_size */
+
+    std::vector<Field<real>> advect_scratch; /** error estimates of MacCormack and BFECC */
+
+    std::unique_ptr<Multigrid> multigrid; /** created on first use by project() */
+    std::unique_ptr<PCG> pcg;             /** created on first use by project() or diffuse() */
+    bool solids_changed;                  /** state changed since the pressure solver saw it */
+
+    /** 8^3 tiles of the grid for sparse stepping, see update_tiles() */
+    std::vector<uint8_t> tile_flags;    /** TileFlag bits per tile, x fastest */
+    std::vector<TileSpan> active_spans; /** tiles stepped this step */
+    int active_tiles;                   /** number of tiles in active_spans */
+    bool tiles_tracked;                 /** every field is zero outside the active tiles */
+
+    static size_t arena_size(int n, FieldLayout layout);
+    CellBox grid_box(void) const;
+    void stamp_obstacles(const CellBox& box);
+    void place_fields(void);
+    PCG& get_pcg(void);
+    void update_solids(void);
+    static void accumulate(SolveStats& total, SolveStats stats);
+
+    float max_speed(void);
+    void substep(void);
+
+    int tile_of(int x, int y, int z) const;
+    void seed_tile(v3 position);
+    void mark_solid_tiles(void);
+    void mark_solid_tiles(const CellBox& box);
+    void update_mask(void);
+    void update_mask(const CellBox& box);
+    void update_tiles(void);
+    void clear_inactive(Field<real>& f);
+    template <typename F>
+    void for_each_active_row(F row);
+    template <typename I, typename F>
+    void for_each_active_row(I ix, F row);
+
+    v3 get_position(int i);
+
+    void advect(std::initializer_list<AdvectedField> fields, Field<real>& velocX,
+                Field<real>& velocY, Field<real>& velocZ);
+    void diffuse(FieldType b, Field<real>& x, Field<real>& x0, float diff);
+    void lin_solve(FieldType b, Field<real>& x, Field<real>& x0, float a, float c);
+    /** with measure_forces the pressure on the faces of SOLID cells is added to the force of
+     * their obstacles */
+    void project(Field<real>& velocX, Field<real>& velocY, Field<real>& velocZ, Field<real>& p,
+                 Field<real>& div, bool measure_forces = false);
+    void set_boundaries(FieldType b, Field<real>& x);
+    template <typename I>
+    void set_row_boundaries(I ix, FieldType b, Field<real>& f, int y, int z, int x0, int x1);
+    void set_corners(Field<real>& f);
+
+   public:
+    int container_size;
+    float scaling;
+    float diffusion;
+
+    bool should_voxelize;
+    std::vector<std::unique_ptr<Obstacle>> obstacles;
+
+    SolverSettings solver;
+    AdvectKernel advect_kernel; /** widest the CPU supports unless overridden */
+    AdvectScheme advect_scheme; /** higher order schemes cost 2 to 3 advection passes */
+    bool sparse;                /** only step the tiles around flow and obstacles */
+    float sparse_threshold;     /** tiles below this density and speed are pruned */
+    float cfl;                  /** cells a substep may move the flow, 0 steps dt at once */
+    int max_substeps;           /** bound on the substeps of adaptive and sparse steps */
+    int substeps;               /** substeps of the last step */
+    SolveStats pressure_stats;  /** pressure solves of the last step */
+    SolveStats diffusion_stats; /** diffusion solves of the last step */
+    Recorder* recorder;         /** fed every completed step when set, not owned */
+
+    Fluid(int container_size, float fluid_size, float diffusion, float viscosity, float dt,
+          FieldLayout layout = FieldLayout::LINEAR);
+    ~Fluid(void);
+
+    void reset(void);
+    void step(void);
+    void add_obstacle(std::unique_ptr<Obstacle> obstacle);
+    void add_density(v3 position, float amount);
+    void add_velocity(v3 position, v3 amount);
+
+    float get_volume(v3 position);
+    float get_density(v3 position);
+    v3 get_velocity(v3 position);
+    const Field<real>& get_field(FieldType type) const;
+    const Field<CellType>& get_state_field(void) const { return state; }
+    FieldLayout get_layout(void) const { return layout; }
+    int get_active_tiles(void) const { return active_tiles; }
+
+    /** writes the fields, state, constants and obstacle transforms to a checkpoint file */
+    void save_checkpoint(const std::string& path) const;
+    /** resumes from a checkpoint, obstacles are matched by identifier. Throws
+     * std::runtime_error on files of another version or storage precision */
+    void load_checkpoint(const std::string& path);
+
+    void voxelize_all(void);
+    /** voxelizes again only the obstacles moved, enabled or disabled since the last
+     * voxelization, and only the cells around them. Falls back to voxelize_all() once obstacles
+     * were added, removed or reordered */
+    void voxelize_moved(void);
+    CellType get_state(v3 position);
+};
+
+bool point_in_box(v3 point, BoundingBox box);
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "Fluid.hpp"
+
+/** Geometric multigrid solver for the pressure Poisson equation of Fluid::project. Works on
+ * cell centred grids that are halved per level, container walls and SOLID cells are treated as
+ * Neumann boundaries (zero pressure gradient into the wall) */
+class Multigrid {
+   private:
+    struct Level {
+        int n;                       /** cells per axis, including the boundary layer */
+        std::vector<float> u, b, r;  /** solution, right hand side and residual */
+        std::vector<uint8_t> active; /** 1 for fluid cells that take part in the solve */
+        std::vector<uint8_t> diag;   /** number of active neighbours of a cell */
+
+        Level(int n);
+        int index(int x, int y, int z) const { return x + y * n + z * n * n; }
+    };
+
+    std::vector<Level> levels;
+
+    void smooth(Level& level, int sweeps);
+    double residual(Level& level);
+    void restrict_residual(const Level& fine, Level& coarse);
+    void prolongate(const Level& coarse, Level& fine);
+    void update_diagonal(Level& level);
+    void cycle(int l, MultigridCycle type);
+
+   public:
+    Multigrid(int container_size);
+
+    int size(void) const { return levels[0].n; }
+
+    /** marks SOLID cells as Neumann boundaries, needs to be called after every voxelization */
+    void set_solids(const Field<CellType>& state);
+
+    /** solves for p given the divergence, p's boundary layer is left to the caller */
+    SolveStats solve(Field<real>& p, const Field<real>& div, MultigridCycle type,
+                     float tolerance, int max_cycles);
+};
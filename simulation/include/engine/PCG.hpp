@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "Fluid.hpp"
+
+/** Matrix-free preconditioned conjugate gradient solver for the 7 point systems of
+ * Fluid::project (pressure Poisson) and Fluid::diffuse (implicit diffusion).
+ *
+ * Both are written as  A x = diag * x - a * sum(active neighbours)  on the interior cells.
+ * Container walls are folded into diag the same way set_boundaries mirrors them, SOLID cells
+ * are Neumann boundaries of the pressure solve. */
+class PCG {
+   private:
+    struct Operator {
+        float a;
+        std::vector<uint8_t> active; /** 1 for cells that take part in the solve */
+        std::vector<float> diag;     /** diagonal of A, 0 for inactive cells */
+    };
+
+    int n;
+    Operator pressure, diffusion;
+    Operator* op; /** operator of the running solve */
+
+    std::vector<float> inv_d; /** pivots of the preconditioner, inverted */
+    std::vector<float> x, b, r, z, p, q;
+
+    double dot(const std::vector<float>& u, const std::vector<float>& v);
+    void setup_preconditioner(Preconditioner preconditioner);
+    void apply_preconditioner(Preconditioner preconditioner);
+    double apply_operator(void);
+    SolveStats iterate(Preconditioner preconditioner, float tolerance, int max_iterations);
+
+   public:
+    PCG(int container_size);
+
+    int size(void) const { return n; }
+
+    /** marks SOLID cells as Neumann boundaries of the pressure solve, needs to be called after
+     * every voxelization */
+    void set_solids(const Field<CellType>& state);
+
+    /** solves project()'s pressure equation, p's boundary layer is left to the caller */
+    SolveStats solve_pressure(Field<real>& p, const Field<real>& div,
+                              const SolverSettings& settings);
+
+    /** solves diffuse()'s (1 + 6a) x - a * sum(neighbours) = x0 with the walls of field type b,
+     * x's boundary layer is left to the caller */
+    SolveStats solve_diffusion(FieldType type, Field<real>& f, const Field<real>& f0, float a,
+                               float c, const Field<CellType>& state,
+                               const SolverSettings& settings);
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include <span>
+#include <vector>
+
+#include "Fluid.hpp"
+
+/** fields interpolated per pass of advect_interior, longer lists take several passes */
+constexpr int max_fused_advection = 4;
+
+/** true if the running CPU can execute the given kernel */
+bool advect_kernel_supported(AdvectKernel kernel);
+
+/** widest kernel the running CPU supports */
+AdvectKernel best_advect_kernel(void);
+
+const char* advect_kernel_name(AdvectKernel kernel);
+
+/** semi-Lagrangian advection of the interior cells: every d = d0 sampled trilinearly at
+ * x - dt0 * v(x). The back-trace is computed once per cell for all fields. Boundary layers
+ * are left to the caller, unsupported kernels fall back to SCALAR. With a list of tile spans
+ * only the cells of those tiles are advected */
+void advect_interior(AdvectKernel kernel, std::span<const AdvectedField> fields,
+                     const Field<real>& vx, const Field<real>& vy, const Field<real>& vz,
+                     float dt0, const std::vector<TileSpan>* tiles = nullptr);
+
+/** single field version of the above */
+void advect_interior(AdvectKernel kernel, Field<real>& d, const Field<real>& d0,
+                     const Field<real>& vx, const Field<real>& vy, const Field<real>& vz,
+                     float dt0, const std::vector<TileSpan>* tiles = nullptr);
+
+/** clamps every d into the range of the 8 values of d0 that advect_interior interpolates for the
+ * same cell, the limiter of the MacCormack and BFECC schemes */
+void limit_interior(AdvectKernel kernel, std::span<const AdvectedField> fields,
+                    const Field<real>& vx, const Field<real>& vy, const Field<real>& vz,
+                    float dt0, const std::vector<TileSpan>* tiles = nullptr);
@@ -0,0 +1,61 @@
+#pragma once
+#include <stddef.h>
+
+#include <utility>
+
+/** One block of memory that the fields of a Fluid are carved out of. Slots start on 64 byte
+ * boundaries, so every field starts on a cache line, and blocks of a few MiB and up are backed by
+ * transparent huge pages where the OS supports them. */
+class Arena {
+   private:
+    char* block;
+    size_t capacity;
+    size_t used;
+
+   public:
+    static constexpr size_t alignment = 64;
+
+    /** gap between slots. Fields of a power of two size would otherwise start at the same
+     * offset into a huge page and evict each other from the same cache sets */
+    static constexpr size_t stagger = 4096 + alignment;
+
+    Arena(void) : block(nullptr), capacity(0), used(0) {}
+    ~Arena(void);
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&& other)
+        : block(std::exchange(other.block, nullptr)),
+          capacity(std::exchange(other.capacity, 0)),
+          used(std::exchange(other.used, 0)) {}
+    Arena& operator=(Arena&& other) {
+        std::swap(block, other.block);
+        std::swap(capacity, other.capacity);
+        std::swap(used, other.used);
+        return *this;
+    }
+
+    /** bytes taken by a slot of count objects of T, including the stagger */
+    template <typename T>
+    static size_t slot(size_t count) {
+        return (count * sizeof(T) + alignment - 1) / alignment * alignment + stagger;
+    }
+
+    /** makes the block exactly `bytes` large and hands out slots from its start again. The old
+     * block is only freed if the size changes, its contents are undefined afterwards */
+    void resize(size_t bytes);
+    size_t size(void) const { return capacity; }
+    const char* data(void) const { return block; }
+
+    /** next slot of count objects of T, the slots handed out since resize() must fit */
+    template <typename T>
+    T* take(size_t count) {
+        T* slot_start = reinterpret_cast<T*>(block + used);
+        used += slot<T>(count);
+        return slot_start;
+    }
+
+    /** zeroes the whole block, in parallel so large grids are faulted in by every thread */
+    void clear(void);
+    /** overwrites the whole block with size() bytes from source, in parallel like clear() */
+    void copy_from(const char* source);
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Fluid.hpp"
+#include "engine.hpp"
+#include "recorder.hpp"
+
+/** obstacle entry of a [[obstacle]] table in config.toml */
+struct ObstacleConfig {
+    v3 position;
+    v3 scaling;
+    std::string model;
+    bool enabled;
+    std::string identifier;
+};
+
+/** settings shared by the interactive viewer and the headless batch runner */
+struct Config {
+    int resolution = 24;
+    float scaling = 1.0f;
+    float diffusion = 0.0f;
+    float viscosity = 0.000001f;
+    float dt = 1.0f;
+    FieldLayout layout = FieldLayout::LINEAR;
+    bool sparse = false;
+    float sparse_threshold = 1e-3f;
+    float cfl = 0.0f;
+    int max_substeps = 16;
+    AdvectScheme advection = AdvectScheme::SEMI_LAGRANGIAN;
+    float steps_per_second = 60.0f; /** of the viewer's simulation thread, 0 = no limit */
+
+    v3 insert_position = v3(1.0f);
+    v3 insert_velocity = v3(4.0f);
+
+    std::vector<ObstacleConfig> obstacles;
+
+    /** [solver] table */
+    SolverSettings solver;
+
+    /** [record] table, used when paper-batch records a run */
+    RecordSettings record;
+
+    /** [batch] table, only used by paper-batch */
+    struct {
+        int steps = 100;
+        bool inject = true;
+        std::string output = "output";
+    } batch;
+};
+
+/** parses a config file, throws toml::parse_error on malformed input */
+Config load_config(const std::string& path);
+
+/** builds an obstacle from its config entry and an already loaded model */
+std::unique_ptr<Obstacle> make_obstacle(const ObstacleConfig& config, Model model);
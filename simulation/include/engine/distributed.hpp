@@ -0,0 +1,97 @@
+#pragma once
+#include <mpi.h>
+
+#include <memory>
+#include <vector>
+
+#include "Fluid.hpp"
+
+/** A Fluid split into slabs of whole z planes across the ranks of an MPI communicator, for grids
+ * beyond the cores and memory of one machine. Each rank stores its planes plus one halo plane on
+ * either side. Halo planes are exchanged with the neighbouring ranks before every red-black
+ * sweep and before the stencils of project(). Advection fetches the planes its back-traces reach
+ * from whichever ranks own them. Only the ranks holding the z = 0 and z = N - 1 walls apply
+ * those walls and the corners.
+ *
+ * Steps follow Fluid::step with Gauss-Seidel solves and semi-Lagrangian advection, the
+ * defaults, and match a single process Fluid up to rounding. Multigrid, PCG, the higher order
+ * advection schemes, sparse tiles and bricked storage are single process only. */
+class DistributedFluid {
+   private:
+    using Slab = std::vector<real>; /** planes z_begin - 1 .. z_end of a field, x fastest */
+
+    /** like AdvectedField */
+    struct Advected {
+        FieldType type;
+        Slab& d;
+        const Slab& d0;
+    };
+
+    MPI_Comm comm;
+    MPI_Datatype plane; /** the N * N values of a z plane, messages count whole planes */
+    int rank, ranks;
+    std::vector<int> plane_begin; /** first plane of every rank, N at the end */
+    int z_begin, z_end;           /** planes owned by this rank, walls included */
+
+    float dt;   /** simulated time advanced by step() */
+    float h;    /** timestep of the substep being advanced */
+    float visc; /** viscosity constant */
+
+    Slab s, density, vx, vy, vz, vx0, vy0, vz0;
+    std::vector<uint8_t> mask;  /** MaskBits of the owned and the halo planes */
+    std::vector<uint8_t> owner; /** obstacle a SOLID cell belongs to, like mask */
+    std::vector<v3> forces;     /** of the obstacles voxelize() saw, from the cells of all ranks */
+    Slab window;                /** planes of an advected field reached by the back-traces */
+
+    size_t at(int x, int y, int z) const {
+        return x + (size_t)N * (y + (size_t)N * (z - z_begin + 1));
+    }
+    int interior_begin(void) const { return std::max(1, z_begin); }
+    int interior_end(void) const { return std::min(N - 1, z_end); }
+
+    void exchange(Slab& f);
+    void fetch(const Slab& f, int lo, int hi);
+    float max_speed(void);
+    void substep(void);
+
+    void advect(std::initializer_list<Advected> fields, Slab& velocX, Slab& velocY,
+                Slab& velocZ);
+    void diffuse(FieldType b, Slab& x, Slab& x0, float diff);
+    void lin_solve(FieldType b, Slab& x, Slab& x0, float a, float c);
+    void project(Slab& velocX, Slab& velocY, Slab& velocZ, Slab& p, Slab& div,
+                 bool measure_forces = false);
+    void add_forces(const Slab& p);
+    void set_boundaries(FieldType b, Slab& f);
+    void set_corners(Slab& f);
+
+   public:
+    int container_size;
+    float diffusion;
+    float cfl;        /** cells a substep may move the flow, 0 steps dt at once */
+    int max_substeps; /** bound on the substeps of adaptive steps */
+    int substeps;     /** substeps of the last step */
+
+    /** collective over comm. Every rank needs at least two planes, throws std::runtime_error
+     * for a container_size below twice the number of ranks */
+    DistributedFluid(MPI_Comm comm, int container_size, float diffusion, float viscosity,
+                     float dt);
+    ~DistributedFluid(void);
+    DistributedFluid(const DistributedFluid&) = delete;
+    DistributedFluid& operator=(const DistributedFluid&) = delete;
+
+    void step(void); /** collective */
+    /** the rank owning position applies them, the others ignore the call */
+    void add_density(v3 position, float amount);
+    void add_velocity(v3 position, v3 amount);
+    /** classifies the owned and halo planes, a cell is SOLID if any enabled obstacle hits it.
+     * Later obstacles take the cells they share with earlier ones, as in Fluid */
+    void voxelize(const std::vector<std::unique_ptr<Obstacle>>& obstacles);
+
+    /** collective, the whole field on rank 0, x fastest like Field::to_linear. Empty elsewhere */
+    std::vector<real> gather(FieldType type);
+    /** like Obstacle::force, of the obstacle at that index when the fluid was voxelized and zero
+     * for other indices. The same on every rank */
+    v3 get_force(int obstacle) const;
+    int get_rank(void) const { return rank; }
+    int get_ranks(void) const { return ranks; }
+};
@@ -11,6 +11,8 @@
 #include <fcl/math/bv/OBBRSS.h>
 #include <fcl/math/triangle.h>
 
+#include <vector>
+
 #include "v3.hpp"
 
 struct Cell {
@@ -24,13 +26,40 @@ struct Obstacle {
     Model model;
     bool enabled;
     std::string identifier;
+    /** pressure force of the fluid on the obstacle, averaged over the substeps of the last
+     * Fluid::step(). The container is one unit long and the fluid has unit density */
+    v3 force;
 
     std::shared_ptr<fcl::BVHModel<fcl::OBBf>> geom;
+    std::vector<v3> triangles; /** corners of the triangles in geom, three per triangle */
 
     Obstacle(v3 position, v3 scaling, Model model, bool enabled, std::string identifier);
     ~Obstacle();
+
+    /** drag(), lift() and lift_to_drag() below of the force */
+    float drag(v3 flow) const;
+    float lift(v3 flow, v3 up) const;
+    float lift_to_drag(v3 flow, v3 up) const;
 };
 
+/** component of a force along the flow direction */
+float drag(v3 force, v3 flow);
+/** component of a force along up, once the part along the flow is taken out of up */
+float lift(v3 force, v3 flow, v3 up);
+/** lift over drag, 0 without drag */
+float lift_to_drag(v3 force, v3 flow, v3 up);
+
+/** corners of the triangles of every mesh of the model, three per triangle, without the model's
+ * transform. Throws std::runtime_error on meshes without vertices or triangles */
+std::vector<v3> mesh_triangles(const Model& model);
 std::shared_ptr<fcl::BVHModel<fcl::OBBf>> mesh_to_bvh(const Model& mesh);
 
+/** loads the geometry of a wavefront .obj file without uploading it to the GPU, so it can be used
+ * without a raylib window. Throws std::runtime_error naming the file and line of unreadable
+ * vertices and faces */
+Model load_obj_headless(const char* path);
+
+/** model of a triangle soup, three x y z vertices per triangle, without a raylib window */
+Model model_from_triangles(const std::vector<float>& vertices);
+
 bool drag_v3(const char* label, v3& v, float speed, float min, float max);
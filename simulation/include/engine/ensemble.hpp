@@ -0,0 +1,90 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "Fluid.hpp"
+#include "arena.hpp"
+
+/** Many small independent Fluids stepped in lockstep, e.g. one per genome of a NEAT
+ * generation. The instances are interleaved cell by cell, the instance index is the innermost
+ * and fastest axis, so every kernel updates a cell of all instances with one vectorised loop
+ * over contiguous lanes instead of sweeping each small grid on its own. Each instance has its
+ * own obstacles, with a cell mask and the pressure forces on them like a Fluid. Calls naming
+ * an instance throw std::out_of_range for instances outside 0 .. instances - 1.
+ *
+ * Steps follow Fluid::step with Gauss-Seidel solves and semi-Lagrangian advection, the
+ * defaults, and give every instance the fields of a Fluid stepped on its own. With a CFL
+ * target all instances take the substeps of the fastest one. Lane counts that are a multiple
+ * of the SIMD width, 8 or 16, leave no remainder loops. */
+class EnsembleFluid {
+   private:
+    float dt;   /** simulated time advanced by step() */
+    float h;    /** timestep of the substep being advanced */
+    float visc; /** viscosity constant */
+    int lanes;  /** instances, the innermost axis of every field */
+
+    /** cell (x, y, z) of instance k at at(x, y, z) + k */
+    real *s, *density;           /** density fields */
+    real *vx, *vy, *vz;          /** velocity fields */
+    real *vx0, *vy0, *vz0;       /** backup velocity fields */
+    Arena arena;                 /** storage of the fields above */
+    std::vector<uint8_t> mask;   /** MaskBits of every instance, interleaved like the fields */
+    std::vector<uint8_t> owner;  /** obstacle a SOLID cell belongs to, interleaved */
+
+    std::vector<std::vector<v3>> forces; /** per instance, of the obstacles voxelize() saw */
+
+    size_t at(int x, int y, int z) const {
+        return (x + (size_t)N * (y + (size_t)N * z)) * lanes;
+    }
+    /** clamps position into the grid like Fluid does */
+    size_t at(int instance, v3 position) const;
+    /** throws std::out_of_range unless 0 <= instance < lanes */
+    void check_instance(int instance) const;
+
+    float max_speed(void);
+    void substep(void);
+
+    void advect(FieldType b, real* d, const real* d0, const real* velocX, const real* velocY,
+                const real* velocZ);
+    void diffuse(FieldType b, real* x, real* x0, float diff);
+    void lin_solve(FieldType b, real* x, const real* x0, float a, float c);
+    void project(real* velocX, real* velocY, real* velocZ, real* p, real* div,
+                 bool measure_forces = false);
+    void add_forces(const real* p);
+    void set_boundaries(FieldType b, real* f);
+    void set_corners(real* f);
+
+   public:
+    int container_size;
+    float diffusion;
+    float cfl;        /** cells a substep may move the flow, 0 steps dt at once */
+    int max_substeps; /** bound on the substeps of adaptive steps */
+    int substeps;     /** substeps of the last step */
+    /** SCALAR keeps advect() on the baseline instruction set, any other kernel gathers with
+     * AVX2 where the CPU has it */
+    AdvectKernel advect_kernel;
+
+    /** instances start empty and without obstacles. Throws std::runtime_error if the
+     * interleaved fields exceed 2^31 values, the gathers of advect() index them with 32 bits */
+    EnsembleFluid(int container_size, int instances, float diffusion, float viscosity,
+                  float dt);
+
+    /** zeroes the flow of every instance, obstacles stay */
+    void reset(void);
+    void step(void);
+    void add_density(int instance, v3 position, float amount);
+    void add_velocity(int instance, v3 position, v3 amount);
+    /** classifies the cells of one instance, a cell is SOLID if any enabled obstacle hits it.
+     * Later obstacles take the cells they share with earlier ones, as in Fluid */
+    void voxelize(int instance, const std::vector<std::unique_ptr<Obstacle>>& obstacles);
+
+    float get_density(int instance, v3 position) const;
+    v3 get_velocity(int instance, v3 position) const;
+    /** one field of one instance, x fastest like Field::to_linear */
+    std::vector<real> get_field(int instance, FieldType type) const;
+    CellType get_state(int instance, v3 position) const;
+    /** like Obstacle::force, of the obstacle at that index when the instance was voxelized and
+     * zero for other obstacle indices. drag(), lift() and lift_to_drag() of engine.hpp take it */
+    v3 get_force(int instance, int obstacle) const;
+    int get_instances(void) const { return lanes; }
+};
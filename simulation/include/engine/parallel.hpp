@@ -0,0 +1,52 @@
+#pragma once
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+/** sums f(z) over the interior slabs 1..n-2 of an n^3 grid in parallel. Partial sums are added
+ * in slab order, so results do not depend on the number of threads */
+template <typename F>
+double slab_sum(int n, F f) {
+    std::vector<double> partial(n, 0.0);
+#pragma omp parallel for
+    for (int z = 1; z < n - 1; z++) partial[z] = f(z);
+    return std::accumulate(partial.begin(), partial.end(), 0.0);
+}
+
+/** calls row(y, z) for every interior row of an n^3 grid. Rows are grouped into 8x8 columns
+ * matching the bricks of FieldLayout::BRICKED, so consecutive rows of a thread share bricks.
+ * Columns run in parallel, row must not depend on the order */
+template <typename F>
+void for_each_row(int n, F row) {
+    int bricks = (n + 7) / 8;
+#pragma omp parallel for collapse(2)
+    for (int bz = 0; bz < bricks; bz++) {
+        for (int by = 0; by < bricks; by++) {
+            for (int z = std::max(1, 8 * bz); z < std::min(n - 1, 8 * bz + 8); z++)
+                for (int y = std::max(1, 8 * by); y < std::min(n - 1, 8 * by + 8); y++) row(y, z);
+        }
+    }
+}
+
+/** tiles first .. first + count - 1 of an n^3 grid cut into 8^3 tiles, consecutive along x. Tile
+ * t covers the cells from 8 * (t % tiles, t / tiles % tiles, t / tiles^2), tiles = (n + 7) / 8 */
+struct TileSpan {
+    int first, count;
+};
+
+/** calls row(y, z, x0, x1) for the interior cells x0..x1-1 of every row through the listed tile
+ * spans. Spans run in parallel, row must not depend on the order */
+template <typename F>
+void for_each_tile_row(int n, const std::vector<TileSpan>& spans, F row) {
+    int tiles = (n + 7) / 8;
+#pragma omp parallel for schedule(dynamic, 4)
+    for (size_t i = 0; i < spans.size(); i++) {
+        int t = spans[i].first;
+        int tx = t % tiles, ty = t / tiles % tiles, tz = t / (tiles * tiles);
+        int x0 = std::max(1, 8 * tx), x1 = std::min(n - 1, 8 * (tx + spans[i].count));
+
+        for (int z = std::max(1, 8 * tz); z < std::min(n - 1, 8 * tz + 8); z++)
+            for (int y = std::max(1, 8 * ty); y < std::min(n - 1, 8 * ty + 8); y++)
+                row(y, z, x0, x1);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+/* Storage precision of the solver fields, picked at build time with `make precision=half` or
+ * `make precision=bfloat16` (default float). The 16 bit types convert implicitly to and from
+ * float, so kernels widen every value on load, compute in float and round once on store. */
+
+/** IEEE binary16: 11 bit mantissa, values up to 65504 */
+struct float16 {
+    _Float16 value;
+
+    float16() = default;
+    float16(float v) : value((_Float16)v) {}
+    operator float() const { return (float)value; }
+
+    float16& operator+=(float v) { return *this = float(*this) + v; }
+    float16& operator-=(float v) { return *this = float(*this) - v; }
+};
+
+/** upper half of a float: the range of float with an 8 bit mantissa */
+struct bfloat16 {
+    uint16_t bits;
+
+    bfloat16() = default;
+    bfloat16(float v) {
+        uint32_t u;
+        memcpy(&u, &v, sizeof(u));
+        bits = (u + 0x7fff + ((u >> 16) & 1)) >> 16;  // round to nearest even
+    }
+    operator float() const {
+        uint32_t u = uint32_t(bits) << 16;
+        float v;
+        memcpy(&v, &u, sizeof(v));
+        return v;
+    }
+
+    bfloat16& operator+=(float v) { return *this = float(*this) + v; }
+    bfloat16& operator-=(float v) { return *this = float(*this) - v; }
+};
+
+#if defined(FLUID_PRECISION_HALF)
+using real = float16;
+#define FLUID_PRECISION_16
+constexpr const char* real_name = "half";
+#elif defined(FLUID_PRECISION_BFLOAT16)
+using real = bfloat16;
+#define FLUID_PRECISION_16
+constexpr const char* real_name = "bfloat16";
+#else
+using real = float;
+constexpr const char* real_name = "float";
+#endif
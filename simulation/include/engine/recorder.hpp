@@ -0,0 +1,121 @@
+#pragma once
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Fluid.hpp"
+#include "simulation.hpp"
+
+/** how frames are quantised and compressed, read from [record] in config.toml */
+struct RecordSettings {
+    float density_step = 1e-3f;  /** density is stored as a multiple of this */
+    float velocity_step = 1e-4f; /** velocity is stored as a multiple of this */
+    int keyframe_interval = 60;  /** frames between frames that decode on their own */
+    int threads = 0;             /** compression threads, 0 = half the hardware threads */
+};
+
+/** Streams the frames of a run to a file. Every frame is quantised and stored as the difference
+ * to the previous one, which is small and compresses well where the flow changes slowly. Frames
+ * are split into blocks of cells that a pool of threads compresses while the fluid steps on, and
+ * are appended in order with an index at the end for seeking. Frames are fed by Fluid::step
+ * while Fluid::recorder is set. */
+class Recorder {
+   private:
+    struct Frame {
+        int index;
+        bool keyframe;
+        std::vector<int32_t> delta[4]; /** density, vx, vy, vz against the previous frame */
+        std::vector<uint8_t> state;    /** xor with the previous frame */
+        std::vector<std::vector<uint8_t>> blocks;
+        std::vector<uint32_t> raw_sizes;
+        int remaining; /** blocks still compressing, guarded by lock */
+    };
+
+    struct Task {
+        Frame* frame;
+        int block;
+    };
+
+    int fd;
+    std::string path;
+    RecordSettings settings;
+    int container_size;
+    int frames; /** frames fed so far */
+
+    std::vector<int32_t> previous[4]; /** quantised fields of the last frame fed */
+    std::vector<uint8_t> previous_state;
+
+    std::mutex lock;
+    std::condition_variable work;  /** tasks were queued or the pool is stopping */
+    std::condition_variable space; /** a frame was written */
+    std::deque<Task> tasks;
+    std::map<int, std::unique_ptr<Frame>> pending; /** frames queued or compressed, not written */
+    int written;                                   /** frames appended to the file */
+    bool stopping;
+    bool appending; /** a pool thread is appending frames */
+    std::vector<std::thread> pool;
+
+    /** only touched by the appending thread, and by finish() once the pool stopped */
+    std::vector<uint64_t> offsets; /** of every written frame */
+    uint64_t end;                  /** of the file */
+    std::string error;             /** of the first failed write */
+
+    void compress(void);
+    void encode(Frame& frame, int block);
+    void append(Frame& frame);
+
+   public:
+    static constexpr int block_cells = 1 << 18; /** cells compressed together */
+
+    /** creates or truncates path, throws std::runtime_error if it cannot be written */
+    Recorder(const std::string& path, int container_size, RecordSettings settings = {});
+    ~Recorder(void); /** finish() if it was not called */
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    /** queues the current fields as the next frame, waits only while several frames are
+     * still compressing */
+    void record(const Fluid& fluid);
+    /** writes every queued frame and the index, further frames are ignored */
+    void finish(void);
+    int get_frames(void) const { return frames; }
+};
+
+/** Reads a file written by Recorder. Frames decode from the nearest keyframe before them, or
+ * from the frame decoded last when playing forward, so stepping through a recording in order
+ * decodes each frame once. A file without its index, cut short by a crash, is scanned instead */
+class Recording {
+   private:
+    const uint8_t* bytes;
+    size_t size;
+    int container_size;
+    int keyframe_interval;
+    float density_step, velocity_step;
+    std::vector<uint64_t> offsets; /** of every frame */
+
+    int decoded;                     /** frame held in current, -1 if none */
+    std::vector<int32_t> current[4]; /** quantised fields of the frame decoded last */
+    std::vector<uint8_t> state;
+
+    void decode(int frame);
+
+   public:
+    /** throws std::runtime_error if path is not a recording */
+    Recording(const std::string& path);
+    ~Recording(void);
+    Recording(const Recording&) = delete;
+    Recording& operator=(const Recording&) = delete;
+
+    int get_frames(void) const { return offsets.size(); }
+    int get_container_size(void) const { return container_size; }
+
+    /** fills snapshot with a frame, steps holds the frame number */
+    void read(int frame, Snapshot& snapshot);
+};
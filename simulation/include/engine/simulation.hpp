@@ -0,0 +1,117 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "Fluid.hpp"
+
+/** what the viewer draws of one completed step, copied out of the Fluid. Cells are x-fastest
+ * like Field::to_linear, values are widened to float whatever the storage precision */
+struct Snapshot {
+    int container_size = 0;
+    std::vector<float> density, vx, vy, vz;
+    std::vector<CellType> state;
+
+    SolveStats pressure_stats = {0, SolveStats::NOT_MEASURED};
+    SolveStats diffusion_stats = {0, SolveStats::NOT_MEASURED};
+    int active_tiles = 0;
+    int substeps = 1;
+    long steps = 0;          /** steps completed since the simulation started */
+    float step_time = 0.0f;  /** wall time of the last step in seconds */
+
+    /** clamps positions outside the grid onto the nearest cell, like Field::clamped_index */
+    int clamped_index(v3 position) const;
+    float get_density(v3 position) const { return density[clamped_index(position)]; }
+    v3 get_velocity(v3 position) const;
+    CellType get_state(v3 position) const { return state[clamped_index(position)]; }
+};
+
+/** Single writer, single reader triple buffer. The writer fills back() and publish() swaps it
+ * with the middle slot, acquire() swaps the middle slot with the reader's if it holds a newer
+ * value. The slots only ever change hands through one atomic exchange, so neither side waits
+ * for the other and the reader never sees a half written value */
+template <typename T>
+class TripleBuffer {
+   private:
+    static constexpr int fresh = 4;  /** set in middle while it holds an unread value */
+
+    T slots[3];
+    std::atomic<int> middle;
+    int back_slot, front_slot;
+
+   public:
+    TripleBuffer(void) : middle(2), back_slot(1), front_slot(0) {}
+
+    T& back(void) { return slots[back_slot]; }
+    void publish(void) { back_slot = middle.exchange(back_slot | fresh) & 3; }
+
+    /** newest published value, the same as last time if nothing was published since */
+    const T& acquire(void) {
+        if (middle.load(std::memory_order_relaxed) & fresh)
+            front_slot = middle.exchange(front_slot) & 3;
+        return slots[front_slot];
+    }
+};
+
+/** edit of the Fluid, run on the simulation thread between two steps */
+using Command = std::function<void(Fluid&)>;
+
+/** bounded single producer, single consumer queue of Commands without locks */
+class CommandQueue {
+   private:
+    static constexpr size_t capacity = 1024;
+
+    Command slots[capacity];
+    std::atomic<size_t> head; /** next slot to pop */
+    std::atomic<size_t> tail; /** next slot to push */
+
+   public:
+    CommandQueue(void) : head(0), tail(0) {}
+
+    /** false if the queue is full */
+    bool push(Command& command) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == capacity) return false;
+        slots[t % capacity] = std::move(command);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** false if the queue is empty */
+    bool pop(Command& command) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        command = std::move(slots[h % capacity]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+/** Steps a Fluid on a thread of its own, so the frame rate of the viewer and the step rate no
+ * longer wait for each other. Once started, the Fluid belongs to that thread: the viewer edits
+ * it with send() and draws the newest completed step from latest(). */
+class Simulation {
+   private:
+    Fluid& fluid;
+    CommandQueue commands;
+    TripleBuffer<Snapshot> snapshots;
+    std::atomic<bool> running;
+    std::atomic<float> rate;
+    std::thread thread;
+
+    void run(void);
+    void capture(Snapshot& snapshot, long steps, float step_time);
+
+   public:
+    /** starts stepping fluid at up to steps_per_second, 0 steps as fast as possible */
+    Simulation(Fluid& fluid, float steps_per_second);
+    ~Simulation(void);  /** finishes the running step and joins the thread */
+
+    /** queues a command for the start of the next step, waits only while the queue is full */
+    void send(Command command);
+    const Snapshot& latest(void) { return snapshots.acquire(); }
+
+    void set_rate(float steps_per_second) { rate = steps_per_second; }
+    float get_rate(void) const { return rate; }
+};
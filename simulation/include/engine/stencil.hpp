@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+
+/* The cell updates of a step, shared by Fluid, EnsembleFluid and DistributedFluid. Each of them
+ * walks its own storage and hands the values a stencil reads to the functions below, so a cell
+ * gets the same value from all three. Arithmetic is in float whatever real is. */
+
+/** bits of a cell mask, the neighbour bits are only set for interior cells */
+enum MaskBit : uint8_t {
+    MASK_SOLID = 1,
+    MASK_CUT_CELL = 2,
+    MASK_SOLID_XM = 4,  // the neighbour at x - 1 is SOLID
+    MASK_SOLID_XP = 8,
+    MASK_SOLID_YM = 16,
+    MASK_SOLID_YP = 32,
+    MASK_SOLID_ZM = 64,
+    MASK_SOLID_ZP = 128,
+
+    MASK_SOLID_NEIGHBOURS = 252,
+};
+
+/** owner of cells no obstacle claimed, obstacles past the 255th get no forces */
+constexpr uint8_t NO_OWNER = 255;
+
+/** mask of a cell, solid(dx, dy, dz) tells whether the cell at that offset is SOLID and is only
+ * asked about the neighbours of interior cells */
+template <typename S>
+inline uint8_t cell_mask(bool cut, bool interior, S solid) {
+    uint8_t bits = (solid(0, 0, 0) ? MASK_SOLID : 0) | (cut ? MASK_CUT_CELL : 0);
+    if (interior) {
+        bits |= (solid(-1, 0, 0) ? MASK_SOLID_XM : 0) | (solid(1, 0, 0) ? MASK_SOLID_XP : 0) |
+                (solid(0, -1, 0) ? MASK_SOLID_YM : 0) | (solid(0, 1, 0) ? MASK_SOLID_YP : 0) |
+                (solid(0, 0, -1) ? MASK_SOLID_ZM : 0) | (solid(0, 0, 1) ? MASK_SOLID_ZP : 0);
+    }
+    return bits;
+}
+
+/** calls face(dx, dy, dz) for every SOLID neighbour in bits, in the order of the MaskBits. The
+ * offset is the normal of the face between the cell and the neighbour, into the neighbour */
+template <typename F>
+inline void for_each_solid_face(uint8_t bits, F face) {
+    if (bits & MASK_SOLID_XM) face(-1, 0, 0);
+    if (bits & MASK_SOLID_XP) face(1, 0, 0);
+    if (bits & MASK_SOLID_YM) face(0, -1, 0);
+    if (bits & MASK_SOLID_YP) face(0, 1, 0);
+    if (bits & MASK_SOLID_ZM) face(0, 0, -1);
+    if (bits & MASK_SOLID_ZP) face(0, 0, 1);
+}
+
+/** Gauss-Seidel update of a cell from its source and its 6 neighbours */
+inline float relax(float src, float xp, float xm, float yp, float ym, float zp, float zm, float a,
+                   float c_recip) {
+    return (src + a * (xp + xm + yp + ym + zp + zm)) * c_recip;
+}
+
+/** divergence of a cell of an n^3 grid from the velocities of its neighbours, times the fluid
+ * fraction of the cell */
+inline float divergence(float xp, float xm, float yp, float ym, float zp, float zm,
+                        float fraction, int n) {
+    return -0.5f * fraction * (xp - xm + yp - ym + zp - zm) / n;
+}
+
+/** velocity component v less the gradient of the pressures on either side along its axis */
+inline float subtract_gradient(float v, float pp, float pm, float fraction, int n) {
+    return v - 0.5f * fraction * (pp - pm) * n;
+}
+
+/** ghost cell behind a wall: zero if it is SOLID, else the cell in front, negated for the
+ * velocity component normal to the wall */
+inline float wall_value(bool solid, float inner, bool flip) {
+    return solid ? 0.0f : flip ? -inner : inner;
+}
+
+/** corner ghost cell from its 3 neighbours along the edges */
+inline float corner_value(float a, float b, float c) { return 0.33f * (a + b + c); }
+
+/** coordinate cell c traces back to along velocity v, within [0.5, n - 1] so that all 8 taps of
+ * the trilinear stencil lie inside the grid. The clamp is written out, std::clamp returns
+ * references that keep lane loops from vectorising */
+inline float trace_back(int c, float v, float dt0, int n) {
+    float t = c - dt0 * v, upper = n - 1;
+    return t < 0.5f ? 0.5f : upper < t ? upper : t;
+}
+
+/** lower of the two samples a traced coordinate lies between */
+inline int lower_sample(float t, int n) { return int(t) < n - 2 ? int(t) : n - 2; }
+
+/** trilinear stencil of a traced position: the lower corner and the weights of both samples
+ * along each axis */
+struct Trilinear {
+    int i0, j0, k0;
+    float s0, s1, t0, t1, u0, u1;
+};
+
+inline Trilinear trilinear_at(float x, float y, float z, int n) {
+    Trilinear w;
+    w.i0 = lower_sample(x, n);
+    w.j0 = lower_sample(y, n);
+    w.k0 = lower_sample(z, n);
+    w.s1 = x - w.i0;
+    w.s0 = 1.0f - w.s1;
+    w.t1 = y - w.j0;
+    w.t0 = 1.0f - w.t1;
+    w.u1 = z - w.k0;
+    w.u0 = 1.0f - w.u1;
+    return w;
+}
+
+/** interpolates tap(dx, dy, dz), the value at the lower corner plus dx, dy, dz in 0..1 */
+template <typename T>
+inline float interpolate(const Trilinear& w, T tap) {
+    return w.s0 * (w.t0 * (w.u0 * tap(0, 0, 0) + w.u1 * tap(0, 0, 1)) +
+                   w.t1 * (w.u0 * tap(0, 1, 0) + w.u1 * tap(0, 1, 1))) +
+           w.s1 * (w.t0 * (w.u0 * tap(1, 0, 0) + w.u1 * tap(1, 0, 1)) +
+                   w.t1 * (w.u0 * tap(1, 1, 0) + w.u1 * tap(1, 1, 1)));
+}
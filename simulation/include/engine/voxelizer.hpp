@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "v3.hpp"
+
+/** cells lo..hi-1 along each axis of a grid, empty if hi <= lo along any axis */
+struct CellBox {
+    int lo[3] = {0, 0, 0};
+    int hi[3] = {0, 0, 0};
+
+    bool empty(void) const { return hi[0] <= lo[0] || hi[1] <= lo[1] || hi[2] <= lo[2]; }
+    int dim(int axis) const { return std::max(0, hi[axis] - lo[axis]); }
+    bool contains(int x, int y, int z) const {
+        return x >= lo[0] && x < hi[0] && y >= lo[1] && y < hi[1] && z >= lo[2] && z < hi[2];
+    }
+    /** true if every cell of other lies in this box */
+    bool holds(const CellBox& other) const {
+        if (other.empty()) return true;
+        for (int k = 0; k < 3; k++)
+            if (other.lo[k] < lo[k] || other.hi[k] > hi[k]) return false;
+        return true;
+    }
+    /** smallest box holding both, an empty box adds nothing */
+    CellBox join(const CellBox& other) const;
+    CellBox intersect(const CellBox& other) const;
+};
+
+/** solid cells of a placed mesh within a box of the grid, x fastest */
+struct Occupancy {
+    CellBox box;
+    v3 position; /** placement of the mesh the cells were found for */
+    std::vector<uint8_t> cells;
+
+    bool solid(int x, int y, int z) const {
+        if (!box.contains(x, y, z)) return false;
+        size_t row = (y - box.lo[1]) + (size_t)box.dim(1) * (z - box.lo[2]);
+        return cells[(x - box.lo[0]) + box.dim(0) * row];
+    }
+};
+
+/* Cell (x, y, z) is the unit box centred on (x, y, z). A cell is solid if the mesh, three corners
+ * per triangle as in Obstacle::triangles, overlaps it or encloses its centre.
+ *
+ * Each triangle is tested against the cells of its bounding box by separating axes, so the cost
+ * follows the surface and not the grid. Rows along x are then filled between pairs of crossings
+ * of the mesh through the row's cell centres, rows that cross an open mesh an odd number of
+ * times keep the surface only.
+ *
+ * The mesh is voxelized relative to the whole cells of its position, so moving it by whole cells
+ * moves its solid cells along without changing them. */
+
+/** the planes z_begin..z_end-1 of an n^3 grid, cells[x + n * (y + n * (z - z_begin))] is 1 for
+ * solid cells and 0 for the rest */
+std::vector<uint8_t> voxelize_mesh(const std::vector<v3>& triangles, v3 position, int n,
+                                   int z_begin, int z_end);
+
+/** the cells of an n^3 grid within the mesh's bounds. An occupancy of the same mesh at an
+ * earlier position is moved along instead of voxelized again when the mesh moved by whole cells
+ * and the earlier box, moved along, still holds every cell within the new bounds */
+Occupancy voxelize_placed(const std::vector<v3>& triangles, v3 position, int n,
+                          const Occupancy* previous = nullptr);
@@ -0,0 +1,413 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include <climits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../include/engine/Fluid.hpp"
+#include "../include/engine/engine.hpp"
+
+/* Python module `paper`, built with `make python`: a Fluid that the genetic search in neural/
+ * drives directly instead of going through files.
+ *
+ *     fluid = paper.Fluid(32, dt=0.1)
+ *     fluid.add_obstacle(vertices, indices, position=(12, 12, 12))
+ *     fluid.add_density((4, 16, 16), 100)
+ *     fluid.step(10)
+ *     fluid.density[z, y, x]
+ *
+ * density, vx, vy, vz and state are NumPy arrays over the solver's own fields, indexed
+ * [z, y, x]. They hold no copy and see every later step. They stay valid as long as they are
+ * referenced, each keeps its Fluid alive. step() releases the GIL, other threads may run Python
+ * meanwhile. Its methods raise a RuntimeError while it steps, the arrays have no such guard and
+ * must not be read or written until step() returned. */
+
+#if defined(FLUID_PRECISION_HALF)
+static constexpr int real_type = NPY_FLOAT16;
+#elif defined(FLUID_PRECISION_BFLOAT16)
+static constexpr int real_type = NPY_UINT16;  // numpy has no bfloat16, the arrays hold the bits
+#else
+static constexpr int real_type = NPY_FLOAT32;
+#endif
+
+struct FluidObject {
+    PyObject_HEAD
+    Fluid* fluid;
+    bool stepping; /** step() runs without the GIL */
+};
+
+static PyTypeObject FluidType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+/** false with a RuntimeError set if the fluid was never constructed */
+static bool check_init(FluidObject* self) {
+    if (!self->fluid) PyErr_SetString(PyExc_RuntimeError, "Fluid.__init__ was not called");
+    return self->fluid;
+}
+
+/** false with a RuntimeError set if the fluid cannot be changed right now */
+static bool check_idle(FluidObject* self) {
+    if (!check_init(self)) return false;
+    if (self->stepping) {
+        PyErr_SetString(PyExc_RuntimeError, "Fluid is stepping on another thread");
+        return false;
+    }
+    return true;
+}
+
+static int fluid_init(FluidObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"size", "diffusion", "viscosity", "dt", nullptr};
+    int size;
+    float diffusion = 0.0f, viscosity = 0.000001f, dt = 1.0f;  // the defaults of config.toml
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|fff", (char**)keywords, &size, &diffusion,
+                                     &viscosity, &dt))
+        return -1;
+
+    // arrays handed out so far point into the fields of the current Fluid
+    if (self->fluid) {
+        PyErr_SetString(PyExc_RuntimeError, "Fluid is already initialised");
+        return -1;
+    }
+    if (size < 3) {
+        PyErr_SetString(PyExc_ValueError, "size has to be 3 or more");
+        return -1;
+    }
+    // fields count their cells with an int
+    if ((long long)size * size * size > INT_MAX) {
+        PyErr_Format(PyExc_ValueError, "size %d has more cells than a field can hold", size);
+        return -1;
+    }
+
+    try {
+        auto fluid = std::make_unique<Fluid>(size, 1.0f, diffusion, viscosity, dt);
+        fluid->voxelize_all();
+        self->fluid = fluid.release();
+    } catch (const std::bad_alloc&) {
+        PyErr_NoMemory();
+        return -1;
+    } catch (const std::exception& err) {
+        PyErr_SetString(PyExc_RuntimeError, err.what());
+        return -1;
+    }
+    self->stepping = false;
+    return 0;
+}
+
+static void fluid_dealloc(FluidObject* self) {
+    delete self->fluid;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* fluid_step(FluidObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"n", nullptr};
+    int n = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", (char**)keywords, &n)) return nullptr;
+    if (!check_idle(self)) return nullptr;
+
+    std::string error;
+    self->stepping = true;
+    Py_BEGIN_ALLOW_THREADS;
+    try {
+        for (int i = 0; i < n; i++) self->fluid->step();
+    } catch (const std::exception& err) {
+        error = err.what();
+    }
+    Py_END_ALLOW_THREADS;
+    self->stepping = false;
+
+    if (!error.empty()) {
+        PyErr_SetString(PyExc_RuntimeError, error.c_str());
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* fluid_reset(FluidObject* self, PyObject*) {
+    if (!check_idle(self)) return nullptr;
+    self->fluid->reset();
+    Py_RETURN_NONE;
+}
+
+static PyObject* fluid_add_density(FluidObject* self, PyObject* args) {
+    v3 position;
+    float amount;
+    if (!PyArg_ParseTuple(args, "(fff)f", &position.x, &position.y, &position.z, &amount))
+        return nullptr;
+    if (!check_idle(self)) return nullptr;
+
+    self->fluid->add_density(position, amount);
+    Py_RETURN_NONE;
+}
+
+static PyObject* fluid_add_velocity(FluidObject* self, PyObject* args) {
+    v3 position, amount;
+    if (!PyArg_ParseTuple(args, "(fff)(fff)", &position.x, &position.y, &position.z, &amount.x,
+                          &amount.y, &amount.z))
+        return nullptr;
+    if (!check_idle(self)) return nullptr;
+
+    self->fluid->add_velocity(position, amount);
+    Py_RETURN_NONE;
+}
+
+/* vertices is an (n, 3) array of positions, indices an (m, 3) integer array of vertex numbers
+ * per triangle. Without indices every three vertices form a triangle */
+static PyObject* fluid_add_obstacle(FluidObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"vertices", "indices", "position", "identifier", nullptr};
+    PyObject *vertices_arg, *indices_arg = Py_None;
+    v3 position(0.0f);
+    const char* identifier = "obstacle";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O(fff)s", (char**)keywords, &vertices_arg,
+                                     &indices_arg, &position.x, &position.y, &position.z,
+                                     &identifier))
+        return nullptr;
+    if (!check_idle(self)) return nullptr;
+
+    // any numeric vertices are converted, float64 alike. Indices only from integer arrays of
+    // any width, a cast would truncate float indices without a word
+    int flags = NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST;
+    PyArrayObject* vertices =
+        (PyArrayObject*)PyArray_FROMANY(vertices_arg, NPY_FLOAT32, 2, 2, flags);
+    if (!vertices) return nullptr;
+    PyArrayObject* indices = nullptr;
+    if (indices_arg != Py_None) {
+        PyArrayObject* given = (PyArrayObject*)PyArray_FROM_O(indices_arg);
+        if (given && !PyArray_ISINTEGER(given)) {
+            PyErr_SetString(PyExc_TypeError, "indices have to be an integer array");
+            Py_CLEAR(given);
+        }
+        if (given) {
+            indices = (PyArrayObject*)PyArray_FROMANY((PyObject*)given, NPY_INTP, 2, 2, flags);
+            Py_DECREF(given);
+        }
+        if (!indices) {
+            Py_DECREF(vertices);
+            return nullptr;
+        }
+    }
+
+    npy_intp count = PyArray_DIM(vertices, 0);
+    const float* xyz = (const float*)PyArray_DATA(vertices);
+    std::vector<float> soup;
+    std::string error;
+
+    if (PyArray_DIM(vertices, 1) != 3) {
+        error = "vertices have to be an (n, 3) array";
+    } else if (indices) {
+        const npy_intp* corners = (const npy_intp*)PyArray_DATA(indices);
+        if (PyArray_DIM(indices, 1) != 3) error = "indices have to be an (m, 3) array";
+        for (npy_intp i = 0; error.empty() && i < PyArray_SIZE(indices); i++) {
+            if (corners[i] < 0 || corners[i] >= count) error = "index out of range";
+            else soup.insert(soup.end(), xyz + 3 * corners[i], xyz + 3 * corners[i] + 3);
+        }
+    } else if (count % 3) {
+        error = "vertices without indices have to be whole triangles";
+    } else {
+        soup.assign(xyz, xyz + 3 * count);
+    }
+    Py_DECREF(vertices);
+    Py_XDECREF(indices);
+
+    if (error.empty() && soup.empty()) error = "obstacle has no triangles";
+    if (!error.empty()) {
+        PyErr_SetString(PyExc_ValueError, error.c_str());
+        return nullptr;
+    }
+
+    try {
+        self->fluid->add_obstacle(std::make_unique<Obstacle>(
+            position, v3(1.0f), model_from_triangles(soup), true, identifier));
+    } catch (const std::bad_alloc&) {
+        return PyErr_NoMemory();
+    } catch (const std::runtime_error& err) {
+        PyErr_SetString(PyExc_ValueError, err.what());  // a mesh the engine cannot use
+        return nullptr;
+    } catch (const std::exception& err) {
+        PyErr_SetString(PyExc_RuntimeError, err.what());
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+/* only the cells around the obstacle's old and new placement are voxelized again */
+static PyObject* fluid_move_obstacle(FluidObject* self, PyObject* args) {
+    const char* identifier;
+    v3 position;
+    if (!PyArg_ParseTuple(args, "s(fff)", &identifier, &position.x, &position.y, &position.z))
+        return nullptr;
+    if (!check_idle(self)) return nullptr;
+
+    bool found = false;
+    for (auto& obstacle : self->fluid->obstacles) {
+        if (obstacle->identifier != identifier) continue;
+        obstacle->position = position;
+        found = true;
+    }
+    if (!found) {
+        PyErr_Format(PyExc_KeyError, "no obstacle %s", identifier);
+        return nullptr;
+    }
+    try {
+        self->fluid->voxelize_moved();
+    } catch (const std::bad_alloc&) {
+        return PyErr_NoMemory();
+    } catch (const std::exception& err) {
+        PyErr_SetString(PyExc_RuntimeError, err.what());
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+/** array over cells the fluid owns, which keeps the fluid alive */
+static PyObject* field_view(FluidObject* self, const void* cells, int type, bool writeable) {
+    npy_intp n = self->fluid->container_size;
+    npy_intp dims[3] = {n, n, n};
+    PyObject* array = PyArray_New(&PyArray_Type, 3, dims, type, nullptr, const_cast<void*>(cells),
+                                  0, writeable ? NPY_ARRAY_CARRAY : NPY_ARRAY_CARRAY_RO, nullptr);
+    if (!array) return nullptr;
+
+    Py_INCREF(self);
+    if (PyArray_SetBaseObject((PyArrayObject*)array, (PyObject*)self) < 0) {  // steals self
+        Py_DECREF(array);
+        return nullptr;
+    }
+    return array;
+}
+
+/* velocity and density can be written like add_density() does, state only changes through
+ * obstacles, since project() reads it through a mask derived from it */
+static PyObject* fluid_field(FluidObject* self, void* type) {
+    if (!check_init(self)) return nullptr;
+    const Field<real>& field = self->fluid->get_field(FieldType((intptr_t)type));
+    return field_view(self, field.data(), real_type, true);
+}
+
+static PyObject* fluid_state(FluidObject* self, void*) {
+    if (!check_init(self)) return nullptr;
+    return field_view(self, self->fluid->get_state_field().data(), NPY_UINT8, false);
+}
+
+static PyObject* fluid_forces(FluidObject* self, void*) {
+    if (!check_idle(self)) return nullptr;
+    PyObject* forces = PyDict_New();
+    if (!forces) return nullptr;
+    for (const auto& obstacle : self->fluid->obstacles) {
+        v3 f = obstacle->force;
+        PyObject* force = Py_BuildValue("(fff)", f.x, f.y, f.z);
+        if (!force || PyDict_SetItemString(forces, obstacle->identifier.c_str(), force) < 0) {
+            Py_XDECREF(force);
+            Py_DECREF(forces);
+            return nullptr;
+        }
+        Py_DECREF(force);
+    }
+    return forces;
+}
+
+static PyObject* fluid_size(FluidObject* self, void*) {
+    return PyLong_FromLong(self->fluid ? self->fluid->container_size : 0);
+}
+
+static PyObject* fluid_substeps(FluidObject* self, void*) {
+    return PyLong_FromLong(self->fluid ? self->fluid->substeps : 0);
+}
+
+static PyObject* fluid_get_cfl(FluidObject* self, void*) {
+    return PyFloat_FromDouble(self->fluid ? self->fluid->cfl : 0.0);
+}
+
+static int fluid_set_cfl(FluidObject* self, PyObject* value, void*) {
+    double cfl = value ? PyFloat_AsDouble(value) : -1.0;
+    if (!value) PyErr_SetString(PyExc_TypeError, "cfl cannot be deleted");
+    if (PyErr_Occurred() || !check_idle(self)) return -1;
+    self->fluid->cfl = cfl;
+    return 0;
+}
+
+static PyObject* fluid_get_max_substeps(FluidObject* self, void*) {
+    return PyLong_FromLong(self->fluid ? self->fluid->max_substeps : 0);
+}
+
+static int fluid_set_max_substeps(FluidObject* self, PyObject* value, void*) {
+    long substeps = value ? PyLong_AsLong(value) : -1;
+    if (!value) PyErr_SetString(PyExc_TypeError, "max_substeps cannot be deleted");
+    if (PyErr_Occurred() || !check_idle(self)) return -1;
+    self->fluid->max_substeps = substeps;
+    return 0;
+}
+
+static PyMethodDef fluid_methods[] = {
+    {"step", (PyCFunction)(void (*)(void))fluid_step, METH_VARARGS | METH_KEYWORDS,
+     "step(n=1): advances n steps of dt without holding the GIL"},
+    {"reset", (PyCFunction)fluid_reset, METH_NOARGS,
+     "reset(): zeroes every field, obstacles stay"},
+    {"add_density", (PyCFunction)fluid_add_density, METH_VARARGS,
+     "add_density((x, y, z), amount)"},
+    {"add_velocity", (PyCFunction)fluid_add_velocity, METH_VARARGS,
+     "add_velocity((x, y, z), (vx, vy, vz))"},
+    {"add_obstacle", (PyCFunction)(void (*)(void))fluid_add_obstacle,
+     METH_VARARGS | METH_KEYWORDS,
+     "add_obstacle(vertices, indices=None, position=(0, 0, 0), identifier='obstacle'): "
+     "vertices is an (n, 3) array, indices an (m, 3) integer array of triangles"},
+    {"move_obstacle", (PyCFunction)fluid_move_obstacle, METH_VARARGS,
+     "move_obstacle(identifier, (x, y, z)): places the obstacles of that identifier"},
+    {nullptr},
+};
+
+static PyGetSetDef fluid_getset[] = {
+    {"density", (getter)fluid_field, nullptr, "density field, a view indexed [z, y, x]",
+     (void*)(intptr_t)FieldType::DENSITY},
+    {"vx", (getter)fluid_field, nullptr, "x velocity, a view indexed [z, y, x]",
+     (void*)(intptr_t)FieldType::VX},
+    {"vy", (getter)fluid_field, nullptr, "y velocity, a view indexed [z, y, x]",
+     (void*)(intptr_t)FieldType::VY},
+    {"vz", (getter)fluid_field, nullptr, "z velocity, a view indexed [z, y, x]",
+     (void*)(intptr_t)FieldType::VZ},
+    {"state", (getter)fluid_state, nullptr,
+     "read only view of the CellType of every cell: 0 solid, 1 fluid", nullptr},
+    {"size", (getter)fluid_size, nullptr, "cells along each axis", nullptr},
+    {"forces", (getter)fluid_forces, nullptr,
+     "pressure force of the last step on each obstacle, {identifier: (fx, fy, fz)}", nullptr},
+    {"substeps", (getter)fluid_substeps, nullptr, "substeps of the last step", nullptr},
+    {"cfl", (getter)fluid_get_cfl, (setter)fluid_set_cfl,
+     "cells a substep may move the flow, 0 steps dt at once", nullptr},
+    {"max_substeps", (getter)fluid_get_max_substeps, (setter)fluid_set_max_substeps,
+     "bound on the substeps of adaptive steps", nullptr},
+    {nullptr},
+};
+
+static PyModuleDef module = {PyModuleDef_HEAD_INIT, "paper",
+                             "Fluid solver of paper with NumPy views of its fields", -1};
+
+PyMODINIT_FUNC PyInit_paper(void) {
+    import_array();
+    SetTraceLogLevel(LOG_WARNING);
+
+    FluidType.tp_name = "paper.Fluid";
+    FluidType.tp_doc = "Fluid(size, diffusion=0, viscosity=1e-6, dt=1): a size^3 grid";
+    FluidType.tp_basicsize = sizeof(FluidObject);
+    FluidType.tp_flags = Py_TPFLAGS_DEFAULT;
+    FluidType.tp_new = PyType_GenericNew;
+    FluidType.tp_init = (initproc)fluid_init;
+    FluidType.tp_dealloc = (destructor)fluid_dealloc;
+    FluidType.tp_methods = fluid_methods;
+    FluidType.tp_getset = fluid_getset;
+    if (PyType_Ready(&FluidType) < 0) return nullptr;
+
+    PyObject* m = PyModule_Create(&module);
+    if (!m) return nullptr;
+
+    Py_INCREF(&FluidType);
+    if (PyModule_AddObject(m, "Fluid", (PyObject*)&FluidType) < 0 ||
+        PyModule_AddStringConstant(m, "precision", real_name) < 0) {
+        Py_DECREF(&FluidType);
+        Py_DECREF(m);
+        return nullptr;
+    }
+    return m;
+}
@@ -0,0 +1,205 @@
+#include <omp.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <toml++/toml.hpp>
+#include <vector>
+
+#include "../include/engine/Fluid.hpp"
+#include "../include/engine/config.hpp"
+#include "../include/engine/engine.hpp"
+#include "../include/engine/recorder.hpp"
+
+/* Headless runner: steps the simulation as fast as possible without opening a raylib window and
+ * writes the final fields, per-step timings and obstacle forces to disk */
+
+static void usage(const char* program) {
+    std::cerr << "usage: " << program
+              << " [-c config.toml] [-n steps] [-o output_dir] [-r resume.fluid] [-s save.fluid]"
+                 " [-w recording.fluidrec]"
+              << std::endl;
+}
+
+template <typename T>
+static void write_field(const std::filesystem::path& path, const std::vector<T>& field) {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(field.data()), field.size() * sizeof(T));
+}
+
+/** fields are written as 32 bit floats whatever precision they are stored in */
+static std::vector<float> widen(const Field<real>& field) {
+    std::vector<real> cells = field.to_linear();
+    return std::vector<float>(cells.begin(), cells.end());
+}
+
+int main(int argc, char* argv[]) {
+    SetTraceLogLevel(LOG_WARNING);
+
+    std::string config_path = "config.toml";
+    int steps = -1;
+    std::string output;
+    std::string resume, save, record;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            config_path = argv[++i];
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            steps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            resume = argv[++i];
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            save = argv[++i];
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            record = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    Config config;
+    try {
+        config = load_config(config_path);
+    } catch (const toml::parse_error& err) {
+        std::cerr << "Failed to parse config file: " << err.what() << std::endl;
+        return 1;
+    }
+
+    if (steps < 0) steps = config.batch.steps;
+    if (output.empty()) output = config.batch.output;
+
+    Fluid fluid(config.resolution, config.scaling, config.diffusion, config.viscosity, config.dt,
+                config.layout);
+    fluid.solver = config.solver;
+    fluid.sparse = config.sparse;
+    fluid.sparse_threshold = config.sparse_threshold;
+    fluid.cfl = config.cfl;
+    fluid.max_substeps = config.max_substeps;
+    fluid.advect_scheme = config.advection;
+
+    for (const auto& obstacle : config.obstacles) {
+        try {
+            fluid.add_obstacle(make_obstacle(obstacle, load_obj_headless(obstacle.model.c_str())));
+        } catch (const std::runtime_error& err) {
+            std::cerr << "Skipping obstacle " << obstacle.identifier << ": " << err.what()
+                      << std::endl;
+        }
+    }
+
+    if (fluid.obstacles.empty()) fluid.voxelize_all();
+
+    // a checkpoint replaces the fields and obstacle placement set up from the config
+    try {
+        if (!resume.empty()) fluid.load_checkpoint(resume);
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+
+    // every step is recorded while the fluid steps on, finish() waits for the last frames
+    std::unique_ptr<Recorder> recorder;
+    try {
+        if (!record.empty()) {
+            recorder = std::make_unique<Recorder>(record, fluid.container_size, config.record);
+            fluid.recorder = recorder.get();
+        }
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+
+    std::filesystem::create_directories(output);
+    std::ofstream timings(std::filesystem::path(output) / "timings.csv");
+    timings << "step,ms,pressure_iterations,pressure_residual,diffusion_iterations,"
+               "diffusion_residual,substeps\n";
+
+    // lift and drag are taken against the injected flow, with lift pointing up along y
+    std::ofstream forces(std::filesystem::path(output) / "forces.csv");
+    forces << "step,obstacle,fx,fy,fz,drag,lift\n";
+    v3 up(0.0f, 1.0f, 0.0f);
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+
+    for (int i = 0; i < steps; i++) {
+        if (config.batch.inject) {
+            fluid.add_density(config.insert_position, 100);
+            fluid.add_velocity(config.insert_position, config.insert_velocity);
+        }
+
+        auto step_start = clock::now();
+        fluid.step();
+        auto step_end = clock::now();
+
+        double ms = std::chrono::duration<double, std::milli>(step_end - step_start).count();
+        // residuals the solver did not measure are left empty
+        auto residual = [](const SolveStats& stats) {
+            std::ostringstream text;
+            if (stats.measured()) text << stats.residual;
+            return text.str();
+        };
+        timings << i << "," << ms << "," << fluid.pressure_stats.iterations << ","
+                << residual(fluid.pressure_stats) << "," << fluid.diffusion_stats.iterations << ","
+                << residual(fluid.diffusion_stats) << "," << fluid.substeps << "\n";
+
+        for (const auto& obstacle : fluid.obstacles) {
+            if (!obstacle->enabled) continue;
+            forces << i << "," << obstacle->identifier << "," << obstacle->force.x << ","
+                   << obstacle->force.y << "," << obstacle->force.z << ","
+                   << obstacle->drag(config.insert_velocity) << ","
+                   << obstacle->lift(config.insert_velocity, up) << "\n";
+        }
+    }
+
+    double total = std::chrono::duration<double>(clock::now() - start).count();
+
+    try {
+        if (recorder) recorder->finish();
+        if (!save.empty()) fluid.save_checkpoint(save);
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+
+    /* Fields are written as raw x-fastest arrays of container_size^3 values */
+    std::filesystem::path out(output);
+    write_field(out / "density.f32", widen(fluid.get_field(FieldType::DENSITY)));
+    write_field(out / "vx.f32", widen(fluid.get_field(FieldType::VX)));
+    write_field(out / "vy.f32", widen(fluid.get_field(FieldType::VY)));
+    write_field(out / "vz.f32", widen(fluid.get_field(FieldType::VZ)));
+
+    std::vector<uint8_t> state;
+    for (int z = 0; z < fluid.container_size; z++)
+        for (int y = 0; y < fluid.container_size; y++)
+            for (int x = 0; x < fluid.container_size; x++)
+                state.push_back((uint8_t)fluid.get_state(v3(x, y, z)));
+    write_field(out / "state.u8", state);
+
+    double cells = (double)fluid.container_size * fluid.container_size * fluid.container_size;
+    std::ofstream summary(out / "summary.toml");
+    summary << "resolution = " << fluid.container_size << "\n"
+            << "layout = \""
+            << (fluid.get_layout() == FieldLayout::BRICKED ? "bricked" : "linear") << "\"\n"
+            << "precision = \"" << real_name << "\"\n"
+            << "sparse = " << (fluid.sparse ? "true" : "false") << "\n"
+            << "active_tiles = " << fluid.get_active_tiles() << "\n"
+            << "steps = " << steps << "\n"
+            << "threads = " << omp_get_max_threads() << "\n"
+            << "total_seconds = " << total << "\n"
+            << "steps_per_second = " << steps / total << "\n"
+            << "cell_updates_per_second = " << cells * steps / total << "\n";
+
+    std::cout << steps << " steps at " << fluid.container_size << "^3 in " << total << " s ("
+              << steps / total << " steps/s), output written to " << output << std::endl;
+
+    return 0;
+}
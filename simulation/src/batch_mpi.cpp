@@ -0,0 +1,189 @@
+#include <mpi.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <toml++/toml.hpp>
+#include <vector>
+
+#include "../include/engine/Fluid.hpp"
+#include "../include/engine/config.hpp"
+#include "../include/engine/distributed.hpp"
+#include "../include/engine/engine.hpp"
+
+/* Headless runner over MPI: the grid is split into slabs of z planes, one per rank. With
+ * --verify rank 0 repeats the run in a single process Fluid and compares the fields, e.g.
+ * mpirun -np 4 ./paper-batch-mpi -n 20 --verify */
+
+static void usage(const char* program) {
+    std::cerr << "usage: " << program << " [-c config.toml] [-n steps] [-o output_dir] [--verify]"
+              << std::endl;
+}
+
+/** largest difference to the reference, relative to the largest reference value but at least
+ * absolute */
+static float mismatch(const std::vector<real>& field, const std::vector<real>& reference) {
+    float difference = 0.0f, scale = 1.0f;
+    for (size_t i = 0; i < field.size(); i++) {
+        difference = std::max(difference, std::fabs(float(field[i]) - float(reference[i])));
+        scale = std::max(scale, std::fabs(float(reference[i])));
+    }
+    return difference / scale;
+}
+
+int main(int argc, char* argv[]) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    SetTraceLogLevel(LOG_WARNING);
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    std::string config_path = "config.toml";
+    int steps = -1;
+    std::string output;
+    bool verify = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            config_path = argv[++i];
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            steps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "--verify")) {
+            verify = true;
+        } else {
+            if (rank == 0) usage(argv[0]);
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
+    Config config;
+    try {
+        config = load_config(config_path);
+    } catch (const toml::parse_error& err) {
+        if (rank == 0) std::cerr << "Failed to parse config file: " << err.what() << std::endl;
+        MPI_Finalize();
+        return 1;
+    }
+    if (steps < 0) steps = config.batch.steps;
+
+    if (rank == 0 && (config.solver.pressure != PressureSolver::GAUSS_SEIDEL ||
+                      config.solver.diffusion != DiffusionSolver::GAUSS_SEIDEL ||
+                      config.advection != AdvectScheme::SEMI_LAGRANGIAN || config.sparse ||
+                      config.layout != FieldLayout::LINEAR))
+        std::cerr << "Distributed runs use Gauss-Seidel solves, semi-Lagrangian advection and "
+                     "linear storage, the other settings are ignored"
+                  << std::endl;
+
+    std::vector<std::unique_ptr<Obstacle>> obstacles;
+    for (const auto& obstacle : config.obstacles) {
+        try {
+            obstacles.push_back(
+                make_obstacle(obstacle, load_obj_headless(obstacle.model.c_str())));
+        } catch (const std::runtime_error& err) {
+            if (rank == 0)
+                std::cerr << "Skipping obstacle " << obstacle.identifier << ": " << err.what()
+                          << std::endl;
+        }
+    }
+
+    std::unique_ptr<DistributedFluid> fluid;
+    try {
+        fluid = std::make_unique<DistributedFluid>(MPI_COMM_WORLD, config.resolution,
+                                                   config.diffusion, config.viscosity, config.dt);
+    } catch (const std::runtime_error& err) {
+        if (rank == 0) std::cerr << err.what() << std::endl;
+        MPI_Finalize();
+        return 1;
+    }
+    fluid->cfl = config.cfl;
+    fluid->max_substeps = config.max_substeps;
+    fluid->voxelize(obstacles);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+
+    for (int i = 0; i < steps; i++) {
+        if (config.batch.inject) {
+            fluid->add_density(config.insert_position, 100);
+            fluid->add_velocity(config.insert_position, config.insert_velocity);
+        }
+        fluid->step();
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double total = MPI_Wtime() - start;
+
+    const FieldType types[] = {FieldType::DENSITY, FieldType::VX, FieldType::VY, FieldType::VZ};
+    const char* names[] = {"density", "vx", "vy", "vz"};
+    std::vector<std::vector<real>> fields;
+    for (FieldType type : types) fields.push_back(fluid->gather(type));
+
+    int status = 0;
+    if (rank == 0) {
+        std::cout << steps << " steps at " << config.resolution << "^3 on " << fluid->get_ranks()
+                  << " ranks in " << total << " s (" << steps / total << " steps/s)" << std::endl;
+
+        /* Fields are written as raw x-fastest arrays of 32 bit floats, like paper-batch */
+        if (!output.empty()) {
+            std::filesystem::create_directories(output);
+            for (int f = 0; f < 4; f++) {
+                std::vector<float> cells(fields[f].begin(), fields[f].end());
+                std::filesystem::path path = std::filesystem::path(output) / names[f];
+                std::ofstream file(path.replace_extension(".f32"), std::ios::binary);
+                file.write(reinterpret_cast<const char*>(cells.data()),
+                           cells.size() * sizeof(float));
+            }
+        }
+    }
+
+    if (rank == 0 && verify) {
+        Fluid reference(config.resolution, config.scaling, config.diffusion, config.viscosity,
+                        config.dt);
+        reference.advect_kernel = AdvectKernel::SCALAR;
+        reference.cfl = config.cfl;
+        reference.max_substeps = config.max_substeps;
+        for (auto& obstacle : obstacles) reference.obstacles.push_back(std::move(obstacle));
+        reference.voxelize_all();
+
+        for (int i = 0; i < steps; i++) {
+            if (config.batch.inject) {
+                reference.add_density(config.insert_position, 100);
+                reference.add_velocity(config.insert_position, config.insert_velocity);
+            }
+            reference.step();
+        }
+
+        for (int f = 0; f < 4; f++) {
+            float error = mismatch(fields[f], reference.get_field(types[f]).to_linear());
+            bool ok = error <= 1e-4f;
+            std::cout << names[f] << ": relative difference " << error << (ok ? "" : " FAILED")
+                      << std::endl;
+            if (!ok) status = 1;
+        }
+
+        for (size_t i = 0; i < reference.obstacles.size(); i++) {
+            // forces are far below 1, so they are compared relative to their own size
+            const Obstacle& obstacle = *reference.obstacles[i];
+            v3 f = obstacle.force, d = fluid->get_force(i) - f;
+            float error = std::max({std::fabs(d.x), std::fabs(d.y), std::fabs(d.z)}) /
+                          std::max({std::fabs(f.x), std::fabs(f.y), std::fabs(f.z), 1e-6f});
+            bool ok = error <= 1e-4f;
+            std::cout << obstacle.identifier << " force: relative difference " << error
+                      << (ok ? "" : " FAILED") << std::endl;
+            if (!ok) status = 1;
+        }
+    }
+
+    MPI_Bcast(&status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    fluid.reset();
+    MPI_Finalize();
+    return status;
+}
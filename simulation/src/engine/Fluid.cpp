@@ -1,526 +1,868 @@
-#include "../../include/engine/engine.hpp"
-#include "../../include/engine/Fluid.hpp"
-
-#include <fcl/common/types.h>
-
-Fluid::Fluid(int container_size, float scaling, float diffusion, float viscosity, float dt) {
-    this->container_size = container_size;
-    this->scaling        = scaling;  // raylib world size of a single cell
-    this->dt             = dt;
-    this->diffusion      = diffusion;
-    this->visc           = viscosity;
-
-    s       = Field<float>(N3);
-    density = Field<float>(N3);
-    vx      = Field<float>(N3);
-    vy      = Field<float>(N3);
-    vz      = Field<float>(N3);
-    vx0     = Field<float>(N3);
-    vy0     = Field<float>(N3);
-    vz0     = Field<float>(N3);
-    state   = Field<CellType>(N3, CellType::UNDEFINED);
-    volume  = Field<float>(N3);
-
-    obstacles = std::vector<std::unique_ptr<Obstacle>>();
-
-    should_voxelize = false;
-}
-
-Fluid::~Fluid(void) {}
-
-float Fluid::get_density(v3 position) { return density[IXv(position)]; }
-
-v3 Fluid::get_velocity(v3 position) {
-    return {
-        vx[IXv(position)],
-        vy[IXv(position)],
-        vz[IXv(position)],
-    };
-}
-
-void Fluid::reset(void) {
-    s       = Field<float>(N3);
-    density = Field<float>(N3);
-    vx      = Field<float>(N3);
-    vy      = Field<float>(N3);
-    vz      = Field<float>(N3);
-    vx0     = Field<float>(N3);
-    vy0     = Field<float>(N3);
-    vz0     = Field<float>(N3);
-    state   = Field<CellType>(N3, CellType::UNDEFINED);
-
-    voxelize_all();
-}
-
-void Fluid::add_density(v3 position, float amount) { this->density[IXv(position)] += amount; }
-
-void Fluid::add_velocity(v3 position, v3 amount) {
-    int index = IXv(position);
-    vx[index] += amount.x;
-    vy[index] += amount.y;
-    vz[index] += amount.z;
-}
-
-/* void Fluid::advect(
-    FieldType     b,
-    Field<float> &d,
-    Field<float> &d0,
-    Field<float> &velocX,
-    Field<float> &velocY,
-    Field<float> &velocZ
-) {
-    float dtx = dt * (N - 2);
-    float dty = dt * (N - 2);
-    float dtz = dt * (N - 2);
-
-#pragma omp parallel for collapse(3)
-    for (int k = 1; k < N - 1; k++) {
-        for (int j = 1; j < N - 1; j++) {
-            for (int i = 1; i < N - 1; i++) {
-                float tmp1 = dtx * velocX[IX(i, j, k)];
-                float tmp2 = dty * velocY[IX(i, j, k)];
-                float tmp3 = dtz * velocZ[IX(i, j, k)];
-                float x    = i - tmp1;
-                float y    = j - tmp2;
-                float z    = k - tmp3;
-
-                if (x < 0.5f) x = 0.5f;
-                if (x > N + 0.5f) x = N + 0.5f;
-                float i0 = floorf(x);
-                float i1 = i0 + 1.0f;
-                if (y < 0.5f) y = 0.5f;
-                if (y > N + 0.5f) y = N + 0.5f;
-                float j0 = floorf(y);
-                float j1 = j0 + 1.0f;
-                if (z < 0.5f) z = 0.5f;
-                if (z > N + 0.5f) z = N + 0.5f;
-                float k0 = floorf(z);
-                float k1 = k0 + 1.0f;
-
-                float s1 = x - i0;
-                float s0 = 1.0f - s1;
-                float t1 = y - j0;
-                float t0 = 1.0f - t1;
-                float u1 = z - k0;
-                float u0 = 1.0f - u1;
-
-                d[IX(i, j, k)]
-                    = s0
-                        * (t0 * (u0 * d0[IX(i0, j0, k0)] + u1 * d0[IX(i0, j0, k1)])
-                           + (t1 * (u0 * d0[IX(i0, j1, k0)] + u1 * d0[IX(i0, j1, k1)])))
-                    + s1
-                          * (t0 * (u0 * d0[IX(i1, j0, k0)] + u1 * d0[IX(i1, j0, k1)])
-                             + (t1 * (u0 * d0[IX(i1, j1, k0)] + u1 * d0[IX(i1, j1, k1)])));
-            }
-        }
-    }
-
-    set_boundaries(b, d);
-} */
-
-void Fluid::advect(
-    FieldType     b,
-    Field<float> &d,
-    Field<float> &d0,
-    Field<float> &velocX,
-    Field<float> &velocY,
-    Field<float> &velocZ
-) {
-    float i0, i1, j0, j1, k0, k1;
-
-    float dtx = dt * (N - 2);
-    float dty = dt * (N - 2);
-    float dtz = dt * (N - 2);
-
-    float s0, s1, t0, t1, u0, u1;
-    float tmp1, tmp2, tmp3, x, y, z;
-
-    float Nfloat = N;
-    float ifloat, jfloat, kfloat;
-    int   i, j, k;
-
-    for (k = 1, kfloat = 1; k < N - 1; k++, kfloat++) {
-        for (j = 1, jfloat = 1; j < N - 1; j++, jfloat++) {
-            for (i = 1, ifloat = 1; i < N - 1; i++, ifloat++) {
-                tmp1 = dtx * velocX[IX(i, j, k)];
-                tmp2 = dty * velocY[IX(i, j, k)];
-                tmp3 = dtz * velocZ[IX(i, j, k)];
-                x    = ifloat - tmp1;
-                y    = jfloat - tmp2;
-                z    = kfloat - tmp3;
-
-                if (x < 0.5f) x = 0.5f;
-                if (x > Nfloat + 0.5f) x = Nfloat + 0.5f;
-                i0 = floorf(x);
-                i1 = i0 + 1.0f;
-                if (y < 0.5f) y = 0.5f;
-                if (y > Nfloat + 0.5f) y = Nfloat + 0.5f;
-                j0 = floorf(y);
-                j1 = j0 + 1.0f;
-                if (z < 0.5f) z = 0.5f;
-                if (z > Nfloat + 0.5f) z = Nfloat + 0.5f;
-                k0 = floorf(z);
-                k1 = k0 + 1.0f;
-
-                s1 = x - i0;
-                s0 = 1.0f - s1;
-                t1 = y - j0;
-                t0 = 1.0f - t1;
-                u1 = z - k0;
-                u0 = 1.0f - u1;
-
-                int i0i = i0;
-                int i1i = i1;
-                int j0i = j0;
-                int j1i = j1;
-                int k0i = k0;
-                int k1i = k1;
-
-                d[IX(i, j, k)] =
-
-                    s0
-                        * (t0 * (u0 * d0[IX(i0i, j0i, k0i)] + u1 * d0[IX(i0i, j0i, k1i)])
-                           + (t1 * (u0 * d0[IX(i0i, j1i, k0i)] + u1 * d0[IX(i0i, j1i, k1i)])))
-                    + s1
-                          * (t0 * (u0 * d0[IX(i1i, j0i, k0i)] + u1 * d0[IX(i1i, j0i, k1i)])
-                             + (t1 * (u0 * d0[IX(i1i, j1i, k0i)] + u1 * d0[IX(i1i, j1i, k1i)])));
-            }
-        }
-    }
-    set_boundaries(b, d);
-}
-
-void Fluid::diffuse(FieldType b, Field<float> &x, Field<float> &x0, float diff) {
-    float a = dt * diff * pow(container_size - 2, 3);
-    lin_solve(b, x, x0, a, 1 + 6 * a);
-}
-
-void Fluid::lin_solve(FieldType b, Field<float> &f, Field<float> &f0, float a, float c) {
-    float cRecip = 1.0f / c;
-
-    for (int i = 0; i < 4; i++) {
-        for (int z = 1; z < N - 1; z++) {
-#pragma omp parallel for collapse(2)
-            for (int y = 1; y < N - 1; y++) {
-                for (int x = 1; x < N - 1; x++) {
-                    f[IX(x, y, z)] = (f0[IX(x, y, z)]
-                                      + a
-                                            * (f[IX(x + 1, y, z)] + f[IX(x - 1, y, z)]
-                                               + f[IX(x, y + 1, z)] + f[IX(x, y - 1, z)]
-                                               + f[IX(x, y, z + 1)] + f[IX(x, y, z - 1)]))
-                                   * cRecip;
-                }
-            }
-        }
-
-        set_boundaries(b, f);
-    }
-}
-
-void Fluid::project(
-    Field<float> &velocX,
-    Field<float> &velocY,
-    Field<float> &velocZ,
-    Field<float> &p,
-    Field<float> &div
-) {
-    // Calculate divergence
-    for (int z = 1; z < N - 1; z++) {
-        for (int y = 1; y < N - 1; y++) {
-            for (int x = 1; x < N - 1; x++) {
-                if (state[IX(x, y, z)] == CellType::SOLID) {
-                    div[IX(x, y, z)] = 0;  // No divergence in solid cells
-                    p[IX(x, y, z)]   = 0;  // Pressure is also zero
-                } else if (state[IX(x, y, z)] == CellType::CUT_CELL) {
-                    float fraction   = volume[IX(x, y, z)];
-                    div[IX(x, y, z)] = -0.5f * fraction
-                                     * (velocX[IX(x + 1, y, z)] - velocX[IX(x - 1, y, z)]
-                                        + velocY[IX(x, y + 1, z)] - velocY[IX(x, y - 1, z)]
-                                        + velocZ[IX(x, y, z + 1)] - velocZ[IX(x, y, z - 1)])
-                                     / N;
-                    p[IX(x, y, z)] = 0;
-                } else {  // FLUID cells
-                    div[IX(x, y, z)] = -0.5f
-                                     * (velocX[IX(x + 1, y, z)] - velocX[IX(x - 1, y, z)]
-                                        + velocY[IX(x, y + 1, z)] - velocY[IX(x, y - 1, z)]
-                                        + velocZ[IX(x, y, z + 1)] - velocZ[IX(x, y, z - 1)])
-                                     / N;
-                    p[IX(x, y, z)] = 0;
-                }
-            }
-        }
-    }
-
-    // Apply boundary conditions for divergence and pressure
-    set_boundaries(FieldType::DENSITY, div);
-    set_boundaries(FieldType::DENSITY, p);
-
-    // Solve for pressure
-    lin_solve(FieldType::DENSITY, p, div, 1, 6);
-
-    // Adjust velocity based on the pressure gradient
-    for (int z = 1; z < N - 1; z++) {
-        for (int y = 1; y < N - 1; y++) {
-            for (int x = 1; x < N - 1; x++) {
-                if (state[IX(x, y, z)] == CellType::SOLID) {
-                    velocX[IX(x, y, z)] = 0;
-                    velocY[IX(x, y, z)] = 0;
-                    velocZ[IX(x, y, z)] = 0;
-                } else if (state[IX(x, y, z)] == CellType::CUT_CELL) {
-                    float fraction = volume[IX(x, y, z)];
-                    velocX[IX(x, y, z)]
-                        -= 0.5f * fraction * (p[IX(x + 1, y, z)] - p[IX(x - 1, y, z)]) * N;
-                    velocY[IX(x, y, z)]
-                        -= 0.5f * fraction * (p[IX(x, y + 1, z)] - p[IX(x, y - 1, z)]) * N;
-                    velocZ[IX(x, y, z)]
-                        -= 0.5f * fraction * (p[IX(x, y, z + 1)] - p[IX(x, y, z - 1)]) * N;
-                } else {  // FLUID cells
-                    velocX[IX(x, y, z)] -= 0.5f * (p[IX(x + 1, y, z)] - p[IX(x - 1, y, z)]) * N;
-                    velocY[IX(x, y, z)] -= 0.5f * (p[IX(x, y + 1, z)] - p[IX(x, y - 1, z)]) * N;
-                    velocZ[IX(x, y, z)] -= 0.5f * (p[IX(x, y, z + 1)] - p[IX(x, y, z - 1)]) * N;
-                }
-            }
-        }
-    }
-
-    // Apply boundary conditions for velocity
-    set_boundaries(FieldType::VX, velocX);
-    set_boundaries(FieldType::VY, velocY);
-    set_boundaries(FieldType::VZ, velocZ);
-}
-
-void        Fluid::set_boundaries(FieldType b, Field<float> &f) {
-// Handle each face of the bounding box
-#pragma omp parallel for collapse(2)
-    for (int y = 1; y < N - 1; y++) {
-        for (int x = 1; x < N - 1; x++) {
-            int index0 = IX(x, y, 0);
-            int indexN = IX(x, y, N - 1);
-
-            // Handle bottom (z=0) and top (z=N-1) boundaries
-            if (state[index0] == CellType::SOLID) {
-                f[index0] = 0.0f;  // No velocity through solid
-            } else if (b == FieldType::VZ) {
-                f[index0] = -f[IX(x, y, 1)];
-            } else {
-                f[index0] = f[IX(x, y, 1)];
-            }
-
-            if (state[indexN] == CellType::SOLID) {
-                f[indexN] = 0.0f;
-            } else if (b == FieldType::VZ) {
-                f[indexN] = -f[IX(x, y, N - 2)];
-            } else {
-                f[indexN] = f[IX(x, y, N - 2)];
-            }
-        }
-    }
-
-#pragma omp parallel for collapse(2)
-    for (int z = 1; z < N - 1; z++) {
-        for (int x = 1; x < N - 1; x++) {
-            int index0 = IX(x, 0, z);
-            int indexN = IX(x, N - 1, z);
-
-            // Handle front (y=0) and back (y=N-1) boundaries
-            if (state[index0] == CellType::SOLID) {
-                f[index0] = 0.0f;
-            } else if (b == FieldType::VY) {
-                f[index0] = -f[IX(x, 1, z)];
-            } else {
-                f[index0] = f[IX(x, 1, z)];
-            }
-
-            if (state[indexN] == CellType::SOLID) {
-                f[indexN] = 0.0f;
-            } else if (b == FieldType::VY) {
-                f[indexN] = -f[IX(x, N - 2, z)];
-            } else {
-                f[indexN] = f[IX(x, N - 2, z)];
-            }
-        }
-    }
-
-#pragma omp parallel for collapse(2)
-    for (int z = 1; z < N - 1; z++) {
-        for (int y = 1; y < N - 1; y++) {
-            int index0 = IX(0, y, z);
-            int indexN = IX(N - 1, y, z);
-
-            if (state[index0] == CellType::SOLID) {
-                f[index0] = 0.0f;
-            } else if (b == FieldType::VX) {
-                f[index0] = -f[IX(1, y, z)];
-            } else {
-                f[index0] = f[IX(1, y, z)];
-            }
-
-            if (state[indexN] == CellType::SOLID) {
-                f[indexN] = 0.0f;
-            } else if (b == FieldType::VX) {
-                f[indexN] = -f[IX(N - 2, y, z)];
-            } else {
-                f[indexN] = f[IX(N - 2, y, z)];
-            }
-        }
-    }
-
-    // Handle corners (ensure no fluid leakage)
-    f[IX(0, 0, 0)]     = 0.33f * (f[IX(1, 0, 0)] + f[IX(0, 1, 0)] + f[IX(0, 0, 1)]);
-    f[IX(0, N - 1, 0)] = 0.33f * (f[IX(1, N - 1, 0)] + f[IX(0, N - 2, 0)] + f[IX(0, N - 1, 1)]);
-    f[IX(0, 0, N - 1)] = 0.33f * (f[IX(1, 0, N - 1)] + f[IX(0, 1, N - 1)] + f[IX(0, 0, N - 2)]);
-    f[IX(0, N - 1, N - 1)]
-        = 0.33f * (f[IX(1, N - 1, N - 1)] + f[IX(0, N - 2, N - 1)] + f[IX(0, N - 1, N - 2)]);
-    f[IX(N - 1, 0, 0)] = 0.33f * (f[IX(N - 2, 0, 0)] + f[IX(N - 1, 1, 0)] + f[IX(N - 1, 0, 1)]);
-    f[IX(N - 1, N - 1, 0)]
-        = 0.33f * (f[IX(N - 2, N - 1, 0)] + f[IX(N - 1, N - 2, 0)] + f[IX(N - 1, N - 1, 1)]);
-    f[IX(N - 1, 0, N - 1)]
-        = 0.33f * (f[IX(N - 2, 0, N - 1)] + f[IX(N - 1, 1, N - 1)] + f[IX(N - 1, 0, N - 2)]);
-    f[IX(N - 1, N - 1, N - 1)]
-        = 0.33f
-        * (f[IX(N - 2, N - 1, N - 1)] + f[IX(N - 1, N - 2, N - 1)] + f[IX(N - 1, N - 1, N - 2)]);
-}
-
-void Fluid::step() {
-    diffuse(FieldType::VX, vx0, vx, visc);
-    diffuse(FieldType::VY, vy0, vy, visc);
-    diffuse(FieldType::VZ, vz0, vz, visc);
-
-    project(vx0, vy0, vz0, vx, vy);
-
-    advect(FieldType::VX, vx, vx0, vx0, vy0, vz0);
-    advect(FieldType::VY, vy, vy0, vx0, vy0, vz0);
-    advect(FieldType::VZ, vz, vz0, vx0, vy0, vz0);
-
-    project(vx, vy, vz, vx0, vy0);
-
-    diffuse(FieldType::DENSITY, s, density, diffusion);
-    advect(FieldType::DENSITY, density, s, vx, vy, vz);
-}
-
-void Fluid::add_obstacle(std::unique_ptr<Obstacle> obstacle) {
-    obstacles.push_back(std::move(obstacle));
-    voxelize_all();
-}
-
-void Fluid::voxelize(Obstacle &obstacle) {
-    // Prepare the obstacle collision object
-    obstacle.geom->computeLocalAABB();
-    fcl::CollisionObjectf obstacle_obj(
-        obstacle.geom,
-        fcl::Transform3f(fcl::Translation3f(obstacle.position))
-    );
-
-#pragma omp parallel for collapse(3)
-    for (int z = 0; z < N; z++) {
-        for (int y = 0; y < N; y++) {
-            for (int x = 0; x < N; x++) {
-                // Define the voxel's position and size
-                v3 cell_position(x, y, z);
-                v3 cell_size(1.0f, 1.0f, 1.0f);
-
-                // Create a voxel collision object
-                auto cell_geometry
-                    = std::make_shared<fcl::Boxf>(cell_size.x, cell_size.y, cell_size.z);
-                fcl::CollisionObjectf cell_obj(
-                    cell_geometry,
-                    fcl::Transform3f(fcl::Translation3f(cell_position))
-                );
-
-                // Perform collision query
-                fcl::CollisionRequestf request;
-                fcl::CollisionResultf  result;
-                fcl::collide(&cell_obj, &obstacle_obj, request, result);
-
-                // Classification logic
-                if (result.isCollision()) {
-                    // Simplify: Assume SOLID if collision exists (for
-                    // debugging)
-                    state[IX(x, y, z)] = CellType::SOLID;
-
-                    // Uncomment below for detailed classification
-                    /*
-                    // Define the voxel's AABB
-                    fcl::AABBf cell_aabb(cell_position, cell_position +
-                    cell_size);
-
-                    // Check if all contact points are inside the voxel's AABB
-                    bool fully_inside = true;
-                    for (int i = 0; i < result.numContacts(); i++) {
-                        const auto& contact = result.getContact(i);
-                        std::cout << "Contact Point: " <<
-                    contact.pos.transpose() << std::endl; if
-                    (!cell_aabb.contain(contact.pos)) { fully_inside = false;
-                            break;
-                        }
-                    }
-
-                    if (fully_inside) {
-                        state[IX(x, y, z)] = CellType::SOLID;
-                    } else {
-                        state[IX(x, y, z)] = CellType::CUT_CELL;
-                    }
-                    */
-                } else {
-                    state[IX(x, y, z)] = CellType::FLUID;
-                }
-            }
-        }
-    }
-
-    should_voxelize = false;
-}
-
-void Fluid::voxelize_all() {
-    bool no_obstacles = true;
-    for (auto &obstacle : obstacles) {
-        if (obstacle->enabled) {
-            no_obstacles = false;
-            break;
-        }
-    }
-
-    if (no_obstacles) {
-        should_voxelize = false;
-        state           = Field<CellType>(N3, CellType::FLUID);
-    } else {
-        state = Field<CellType>(N3, CellType::UNDEFINED);
-#pragma omp parallel for
-        for (auto &obstacle : obstacles)
-            if (obstacle->enabled) voxelize(*obstacle);
-    }
-}
-
-float Fluid::get_volume(v3 cell_position) {
-    v3         cell_size(1.0f, 1.0f, 1.0f);
-    fcl::AABBf cell_aabb(cell_position, cell_position + cell_size);
-
-    for (auto &obstacle : obstacles) {
-        fcl::AABBf obstacle_aabb(
-            obstacle->geom->aabb_local.min_ + (fcl::Vector3f)obstacle->position,
-            obstacle->geom->aabb_local.max_ + (fcl::Vector3f)obstacle->position
-        );
-
-        fcl::AABBf intersection_aabb;
-        intersection_aabb.min_ = cell_aabb.min_.cwiseMax(obstacle_aabb.min_);
-        intersection_aabb.max_ = cell_aabb.max_.cwiseMin(obstacle_aabb.max_);
-
-        fcl::Vector3f intersection_size = intersection_aabb.max_ - intersection_aabb.min_;
-        if (intersection_size[0] <= 0 || intersection_size[1] <= 0 || intersection_size[2] <= 0) {
-            return 0.0f;
-        }
-
-        float intersection_volume
-            = intersection_size[0] * intersection_size[1] * intersection_size[2];
-
-        float cell_volume = cell_size.x * cell_size.y * cell_size.z;
-        return intersection_volume / cell_volume;
-    }
-
-    return 1.0f;
-}
-
-// float Fluid::get_volume(v3 cell_position) { return
-// volume[IXv(cell_position)]; }
-
-CellType Fluid::get_state(v3 position) { return state[IXv(position)]; }
+#include "../../include/engine/engine.hpp"
+#include "../../include/engine/Fluid.hpp"
+#include "../../include/engine/Multigrid.hpp"
+#include "../../include/engine/PCG.hpp"
+#include "../../include/engine/advect.hpp"
+#include "../../include/engine/parallel.hpp"
+#include "../../include/engine/recorder.hpp"
+#include "../../include/engine/stencil.hpp"
+#include "../../include/engine/voxelizer.hpp"
+
+#include <fcl/common/types.h>
+#include <omp.h>
+
+Fluid::Fluid(
+    int         container_size,
+    float       scaling,
+    float       diffusion,
+    float       viscosity,
+    float       dt,
+    FieldLayout layout
+) {
+    this->container_size = container_size;
+    this->layout         = layout;
+    this->scaling        = scaling;  // raylib world size of a single cell
+    this->dt             = dt;
+    this->h              = dt;
+    this->diffusion      = diffusion;
+    this->visc           = viscosity;
+
+    place_fields();
+    arena.clear();
+    state.fill(CellType::UNDEFINED);
+
+    obstacles = std::vector<std::unique_ptr<Obstacle>>();
+
+    should_voxelize  = false;
+    solids_changed   = true;
+    cut_cells        = false;
+    tiles_tracked    = false;
+    active_tiles     = 0;
+    pressure_stats   = {0, SolveStats::NOT_MEASURED};
+    diffusion_stats  = {0, SolveStats::NOT_MEASURED};
+    advect_kernel    = best_advect_kernel();
+    advect_scheme    = AdvectScheme::SEMI_LAGRANGIAN;
+    sparse           = false;
+    sparse_threshold = 1e-3f;
+    cfl              = 0.0f;
+    max_substeps     = 16;
+    substeps         = 1;
+    recorder         = nullptr;
+}
+
+Fluid::~Fluid(void) {}
+
+float Fluid::get_density(v3 position) { return density[density.clamped_index(position)]; }
+
+v3 Fluid::get_velocity(v3 position) {
+    int index = vx.clamped_index(position);
+    return {
+        vx[index],
+        vy[index],
+        vz[index],
+    };
+}
+
+const Field<real> &Fluid::get_field(FieldType type) const {
+    switch (type) {
+        case FieldType::VX: return vx;
+        case FieldType::VY: return vy;
+        case FieldType::VZ: return vz;
+        default: return density;
+    }
+}
+
+/* Zeroes every field in place, memory is only reallocated after container_size changed */
+void Fluid::reset(void) {
+    place_fields();
+    arena.clear();
+    state.fill(CellType::UNDEFINED);
+
+    if (!advect_scratch.empty() && advect_scratch[0].dim() != N) advect_scratch.clear();
+    for (Field<real> &e : advect_scratch) e.fill(0.0f);
+    voxelize_all();
+}
+
+size_t Fluid::arena_size(int n, FieldLayout layout) {
+    int cells = Field<real>::storage(n, layout);
+    return 9 * Arena::slot<real>(cells) + Arena::slot<CellType>(cells)
+         + 2 * Arena::slot<uint8_t>(cells);
+}
+
+/* Every field lives in its own slot of the arena, resizing it to the size it already has keeps
+ * the block and only points the fields at it again */
+void Fluid::place_fields(void) {
+    int cells = Field<real>::storage(N, layout);
+    arena.resize(arena_size(N, layout));
+
+    for (Field<real> *f : {&s, &density, &vx, &vy, &vz, &vx0, &vy0, &vz0, &volume})
+        *f = Field<real>(N, arena.take<real>(cells), layout);
+    state = Field<CellType>(N, arena.take<CellType>(cells), layout);
+    mask  = Field<uint8_t>(N, arena.take<uint8_t>(cells), layout);
+    owner = Field<uint8_t>(N, arena.take<uint8_t>(cells), layout);
+}
+
+void Fluid::add_density(v3 position, float amount) {
+    this->density[density.clamped_index(position)] += amount;
+    seed_tile(position);
+}
+
+void Fluid::add_velocity(v3 position, v3 amount) {
+    int index = vx.clamped_index(position);
+    vx[index] += amount.x;
+    vy[index] += amount.y;
+    vz[index] += amount.z;
+    seed_tile(position);
+}
+
+/* All fields share one back-trace per cell, so advecting several of them in a single call
+ * reads the velocity once instead of once per field.
+ *
+ * MacCormack and BFECC estimate the error of the semi-Lagrangian step by advecting its result
+ * back to the start, e = (d0 - back(forward(d0))) / 2. MacCormack adds e to the forward result,
+ * BFECC advects d0 + e forward again. Both are clamped to the corners the plain step
+ * interpolates, which keeps them from creating new extrema where the flow is not smooth. */
+void Fluid::advect(
+    std::initializer_list<AdvectedField> fields,
+    Field<real>                        &velocX,
+    Field<real>                        &velocY,
+    Field<real>                        &velocZ
+) {
+    std::span<const AdvectedField> list(fields.begin(), fields.size());
+    const std::vector<TileSpan>   *tiles = tiles_tracked ? &active_spans : nullptr;
+    float                          dt0   = h * (N - 2);
+
+    advect_interior(advect_kernel, list, velocX, velocY, velocZ, dt0, tiles);
+    for (const AdvectedField &field : fields) set_boundaries(field.type, field.d);
+
+    if (advect_scheme == AdvectScheme::SEMI_LAGRANGIAN) return;
+
+    while (advect_scratch.size() < fields.size()) advect_scratch.emplace_back(N, 0.0f, layout);
+
+    std::vector<AdvectedField> back;
+    for (size_t f = 0; f < fields.size(); f++)
+        back.push_back({list[f].type, advect_scratch[f], list[f].d});
+    advect_interior(advect_kernel, back, velocX, velocY, velocZ, -dt0, tiles);
+    for (const AdvectedField &field : back) set_boundaries(field.type, field.d);
+
+    for (size_t f = 0; f < fields.size(); f++) {
+        Field<real>       &d = list[f].d, &e = advect_scratch[f];
+        const Field<real> &d0 = list[f].d0;
+
+        for_each_active_row([&](int y, int z, int x0, int x1) {
+            for (int x = x0; x < x1; x++) {
+                int i = d.index(x, y, z);
+                if (advect_scheme == AdvectScheme::MACCORMACK) d[i] += 0.5f * (d0[i] - e[i]);
+                else e[i] = d0[i] + 0.5f * (d0[i] - e[i]);
+            }
+        });
+        if (advect_scheme == AdvectScheme::BFECC) set_boundaries(list[f].type, e);
+    }
+
+    if (advect_scheme == AdvectScheme::BFECC) {
+        std::vector<AdvectedField> corrected;
+        for (size_t f = 0; f < fields.size(); f++)
+            corrected.push_back({list[f].type, list[f].d, advect_scratch[f]});
+        advect_interior(advect_kernel, corrected, velocX, velocY, velocZ, dt0, tiles);
+    }
+
+    limit_interior(advect_kernel, list, velocX, velocY, velocZ, dt0, tiles);
+    for (const AdvectedField &field : fields) set_boundaries(field.type, field.d);
+}
+
+void Fluid::diffuse(FieldType b, Field<real> &x, Field<real> &x0, float diff) {
+    float a = h * diff * pow(container_size - 2, 3);
+
+    if (solver.diffusion == DiffusionSolver::PCG && N > 2) {
+        accumulate(
+            diffusion_stats,
+            get_pcg().solve_diffusion(b, x, x0, a, 1 + 6 * a, state, solver)
+        );
+        clear_inactive(x);
+        set_boundaries(b, x);
+    } else {
+        lin_solve(b, x, x0, a, 1 + 6 * a);
+        accumulate(diffusion_stats, {4, SolveStats::NOT_MEASURED});
+    }
+}
+
+PCG &Fluid::get_pcg(void) {
+    if (!pcg || pcg->size() != N) {
+        pcg            = std::make_unique<PCG>(N);
+        solids_changed = true;
+    }
+    return *pcg;
+}
+
+/* hands the current obstacles to the pressure solvers after a voxelization */
+void Fluid::update_solids(void) {
+    if (!solids_changed) return;
+
+    if (multigrid) multigrid->set_solids(state);
+    if (pcg) pcg->set_solids(state);
+    solids_changed = false;
+}
+
+void Fluid::accumulate(SolveStats &total, SolveStats stats) {
+    total.iterations += stats.iterations;
+    total.residual = std::max(total.residual, stats.residual);  // NOT_MEASURED is negative
+}
+
+enum TileFlag : uint8_t {
+    TILE_ACTIVE = 1,  // stepped this step
+    TILE_SEEDED = 2,  // density or velocity was added since the last step
+    TILE_SOLID  = 4,  // holds obstacle cells
+};
+
+/** cells a sparse substep may move the flow, half the one tile margin of update_tiles so the flow
+ * can speed up within the step */
+constexpr float SPARSE_SUBSTEP_CELLS = 4.0f;
+
+/** calls f(x, y, z) for every cell of tile t, ghost cells included */
+template <typename F>
+static void for_each_tile_cell(int n, int t, F f) {
+    int tiles = (n + 7) / 8;
+    int tx = t % tiles, ty = t / tiles % tiles, tz = t / (tiles * tiles);
+
+    for (int z = 8 * tz; z < std::min(n, 8 * tz + 8); z++)
+        for (int y = 8 * ty; y < std::min(n, 8 * ty + 8); y++)
+            for (int x = 8 * tx; x < std::min(n, 8 * tx + 8); x++) f(x, y, z);
+}
+
+int Fluid::tile_of(int x, int y, int z) const {
+    int tiles = (N + 7) / 8;
+    return x / 8 + tiles * (y / 8 + tiles * (z / 8));
+}
+
+/* wakes the tile an injection lands in, untracked tiles all wake on the next sparse step anyway */
+void Fluid::seed_tile(v3 position) {
+    if (!tiles_tracked) return;
+
+    tile_flags[tile_of(
+        std::clamp(int(position.x), 0, N - 1),
+        std::clamp(int(position.y), 0, N - 1),
+        std::clamp(int(position.z), 0, N - 1)
+    )] |= TILE_SEEDED;
+}
+
+/* obstacle tiles stay active so the flow around them is resolved before it arrives */
+void Fluid::mark_solid_tiles(void) { mark_solid_tiles(grid_box()); }
+
+/* only the tiles overlapping box are looked at again */
+void Fluid::mark_solid_tiles(const CellBox &box) {
+    int tiles = (N + 7) / 8;
+    if (tile_flags.size() != (size_t)tiles * tiles * tiles) {
+        tile_flags.assign(tiles * tiles * tiles, 0);
+        active_spans.clear();
+        active_tiles = 0;
+        tiles_tracked = false;
+    }
+
+    int first[3], last[3];
+    for (int k = 0; k < 3; k++) {
+        first[k] = std::max(0, box.lo[k] / 8);
+        last[k]  = std::min(tiles, (box.hi[k] + 7) / 8);
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int tz = first[2]; tz < last[2]; tz++) {
+        for (int ty = first[1]; ty < last[1]; ty++) {
+            for (int tx = first[0]; tx < last[0]; tx++) {
+                int  t     = tx + tiles * (ty + tiles * tz);
+                bool solid = false;
+                for_each_tile_cell(N, t, [&](int x, int y, int z) {
+                    solid |= state(x, y, z) == CellType::SOLID
+                          || state(x, y, z) == CellType::CUT_CELL;
+                });
+                tile_flags[t] = (tile_flags[t] & ~TILE_SOLID) | (solid ? TILE_SOLID : 0);
+            }
+        }
+    }
+}
+
+/* packs the state into one byte per cell, so project() can select on bits instead of branching
+ * on the state of a cell and the ghost cells behind it */
+void Fluid::update_mask(void) { update_mask(grid_box()); }
+
+/* only the cells in box, which has to reach one cell past the cells whose state changed */
+void Fluid::update_mask(const CellBox &changed) {
+    CellBox box     = changed.intersect(grid_box());
+    bool    any_cut = false;
+
+#pragma omp parallel for collapse(2) reduction(|| : any_cut)
+    for (int z = box.lo[2]; z < box.hi[2]; z++) {
+        for (int y = box.lo[1]; y < box.hi[1]; y++) {
+            for (int x = box.lo[0]; x < box.hi[0]; x++) {
+                bool interior = x > 0 && y > 0 && z > 0 && x < N - 1 && y < N - 1 && z < N - 1;
+                uint8_t bits  = cell_mask(
+                    state(x, y, z) == CellType::CUT_CELL,
+                    interior,
+                    [&](int dx, int dy, int dz) {
+                        return state(x + dx, y + dy, z + dz) == CellType::SOLID;
+                    }
+                );
+                mask(x, y, z) = bits;
+                any_cut |= (bits & MASK_CUT_CELL) != 0;
+            }
+        }
+    }
+
+    // cut cells outside the box are not looked for, only a full update can clear the flag
+    cut_cells = any_cut || (cut_cells && !box.holds(grid_box()));
+}
+
+/* A tile is active while it or one of its 26 neighbours holds flow above sparse_threshold,
+ * obstacle and freshly seeded tiles count as flow. Tiles dropping out are zeroed, so every field
+ * is exactly zero outside the active tiles and stencils at the edge of the active region read
+ * zeros. Flow cannot skip the one tile margin as long as it moves less than 8 cells per substep,
+ * step() cuts sparse steps to keep it below SPARSE_SUBSTEP_CELLS. */
+void Fluid::update_tiles(void) {
+    int tiles = (N + 7) / 8;
+    if (tile_flags.size() != (size_t)tiles * tiles * tiles) mark_solid_tiles();
+    if (!tiles_tracked)
+        for (uint8_t &flag : tile_flags) flag |= TILE_ACTIVE;
+
+    std::vector<uint8_t> flow(tile_flags.size(), 0);
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int t = 0; t < (int)tile_flags.size(); t++) {
+        if (tile_flags[t] & (TILE_SEEDED | TILE_SOLID)) {
+            flow[t] = 1;
+        } else if (tile_flags[t] & TILE_ACTIVE) {
+            bool moving = false;
+            for_each_tile_cell(N, t, [&](int x, int y, int z) {
+                int i = density.index(x, y, z);
+                moving |= fabsf(density[i]) > sparse_threshold || fabsf(vx[i]) > sparse_threshold
+                        || fabsf(vy[i]) > sparse_threshold || fabsf(vz[i]) > sparse_threshold;
+            });
+            flow[t] = moving;
+        }
+    }
+
+    std::vector<int> pruned;
+    active_spans.clear();
+    active_tiles = 0;
+    for (int tz = 0; tz < tiles; tz++) {
+        for (int ty = 0; ty < tiles; ty++) {
+            for (int tx = 0; tx < tiles; tx++) {
+                bool near = false;
+                for (int z = std::max(0, tz - 1); z <= std::min(tiles - 1, tz + 1); z++)
+                    for (int y = std::max(0, ty - 1); y <= std::min(tiles - 1, ty + 1); y++)
+                        for (int x = std::max(0, tx - 1); x <= std::min(tiles - 1, tx + 1); x++)
+                            near |= flow[x + tiles * (y + tiles * z)];
+
+                int t = tx + tiles * (ty + tiles * tz);
+                if (near) {
+                    // runs of active tiles along x are stepped as one piece of the row
+                    bool extends = tx > 0 && !active_spans.empty()
+                                && active_spans.back().first + active_spans.back().count == t;
+                    if (extends) active_spans.back().count++;
+                    else active_spans.push_back({t, 1});
+                    active_tiles++;
+                } else if (tile_flags[t] & TILE_ACTIVE) {
+                    pruned.push_back(t);
+                }
+                tile_flags[t] = (tile_flags[t] & TILE_SOLID) | (near ? TILE_ACTIVE : 0);
+            }
+        }
+    }
+
+#pragma omp parallel for
+    for (size_t i = 0; i < pruned.size(); i++) {
+        for_each_tile_cell(N, pruned[i], [&](int x, int y, int z) {
+            int index = density.index(x, y, z);
+            for (Field<real> *f : {&s, &density, &vx, &vy, &vz, &vx0, &vy0, &vz0})
+                (*f)[index] = 0.0f;
+            for (Field<real> &f : advect_scratch) f[index] = 0.0f;
+        });
+    }
+
+    tiles_tracked = true;
+}
+
+/* The multigrid and PCG solvers work on the whole grid, their result is cut back to the active
+ * tiles to keep the zero outside of them */
+void Fluid::clear_inactive(Field<real> &f) {
+    if (!tiles_tracked) return;
+
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int t = 0; t < (int)tile_flags.size(); t++) {
+        if (tile_flags[t] & TILE_ACTIVE) continue;
+        for_each_tile_cell(N, t, [&](int x, int y, int z) { f(x, y, z) = 0.0f; });
+    }
+}
+
+/* interior rows of the whole grid, or of the active tiles only once sparse stepping tracks them */
+template <typename F>
+void Fluid::for_each_active_row(F row) {
+    if (tiles_tracked) for_each_tile_row(N, active_spans, row);
+    else for_each_row(N, [&](int y, int z) { row(y, z, 1, N - 1); });
+}
+
+/* same rows, with the grid size taken from the index of Field::with_index so the full rows of a
+ * FixedIndex have constant bounds */
+template <typename I, typename F>
+void Fluid::for_each_active_row(I ix, F row) {
+    if (tiles_tracked) for_each_tile_row(ix.dim(), active_spans, row);
+    else for_each_row(ix.dim(), [&](int y, int z) { row(y, z, 1, ix.dim() - 1); });
+}
+
+/* Red-black Gauss-Seidel: cells of one colour only read neighbours of the other colour, so each
+ * half sweep runs as a single parallel region over the whole volume and the result is bitwise
+ * identical for any number of threads. */
+void Fluid::lin_solve(FieldType b, Field<real> &f, Field<real> &f0, float a, float c) {
+    float cRecip = 1.0f / c;
+
+    for (int i = 0; i < 4; i++) {
+        for (int color = 0; color < 2; color++) {
+            f.with_index([&](auto ix) {
+                for_each_active_row(ix, [&](int y, int z, int x0, int x1) {
+                    real       *row = f.data() + ix.y(y) + ix.z(z);
+                    const real *src = f0.data() + ix.y(y) + ix.z(z);
+                    const real *ym  = f.data() + ix.y(y - 1) + ix.z(z);
+                    const real *yp  = f.data() + ix.y(y + 1) + ix.z(z);
+                    const real *zm  = f.data() + ix.y(y) + ix.z(z - 1);
+                    const real *zp  = f.data() + ix.y(y) + ix.z(z + 1);
+
+                    for (int x = x0 + ((x0 + y + z + color) & 1); x < x1; x += 2) {
+                        int xo  = ix.x(x);
+                        row[xo] = relax(
+                            src[xo],
+                            row[ix.x(x + 1)],
+                            row[ix.x(x - 1)],
+                            yp[xo],
+                            ym[xo],
+                            zp[xo],
+                            zm[xo],
+                            a,
+                            cRecip
+                        );
+                    }
+                });
+            });
+        }
+
+        set_boundaries(b, f);
+    }
+}
+
+/* Both sweeps run branch free on the mask: SOLID cells select zero, CUT_CELLs scale by their
+ * volume, which is only read when the grid has any. Rows on the container walls also fill the
+ * ghost cells behind them, so the boundary conditions need no passes of their own.
+ *
+ * Obstacle forces are summed in the gradient sweep while a row is still in cache: every face
+ * between a fluid cell and a SOLID cell pushes the solid with the fluid cell's pressure, into
+ * the solid. p is the pressure times h, on faces 1 / N^2 large. Each thread sums into a copy of
+ * its own, the copies are added up once the sweep is done. */
+void Fluid::project(
+    Field<real> &velocX,
+    Field<real> &velocY,
+    Field<real> &velocZ,
+    Field<real> &p,
+    Field<real> &div,
+    bool         measure_forces
+) {
+    // Calculate divergence, p starts the solve from zero
+    p.with_index([&](auto ix) {
+        for_each_active_row(ix, [&](int y, int z, int x0, int x1) {
+            int row = ix.y(y) + ix.z(z);
+            int ym  = ix.y(y - 1) + ix.z(z), yp = ix.y(y + 1) + ix.z(z);
+            int zm  = ix.y(y) + ix.z(z - 1), zp = ix.y(y) + ix.z(z + 1);
+
+            for (int x = x0; x < x1; x++) {
+                int xo = ix.x(x), i = row + xo;
+                int xm = row + ix.x(x - 1), xp = row + ix.x(x + 1);
+
+                uint8_t bits     = mask[i];
+                float   fraction = cut_cells && (bits & MASK_CUT_CELL) ? float(volume[i]) : 1.0f;
+                float   d        = divergence(
+                    velocX[xp],
+                    velocX[xm],
+                    velocY[yp + xo],
+                    velocY[ym + xo],
+                    velocZ[zp + xo],
+                    velocZ[zm + xo],
+                    fraction,
+                    ix.dim()
+                );
+
+                div[i] = bits & MASK_SOLID ? 0.0f : d;
+                p[i]   = 0.0f;
+            }
+
+            set_row_boundaries(ix, FieldType::DENSITY, div, y, z, x0, x1);
+            set_row_boundaries(ix, FieldType::DENSITY, p, y, z, x0, x1);
+        });
+    });
+    set_corners(div);
+    set_corners(p);
+
+    // Solve for pressure
+    if (solver.pressure == PressureSolver::MULTIGRID && N > 2) {
+        if (!multigrid || multigrid->size() != N) {
+            multigrid      = std::make_unique<Multigrid>(N);
+            solids_changed = true;
+        }
+        update_solids();
+
+        accumulate(
+            pressure_stats,
+            multigrid->solve(p, div, solver.cycle, solver.tolerance, solver.max_cycles)
+        );
+        clear_inactive(p);
+        set_boundaries(FieldType::DENSITY, p);
+    } else if (solver.pressure == PressureSolver::PCG && N > 2) {
+        PCG &pcg = get_pcg();
+        update_solids();
+
+        accumulate(pressure_stats, pcg.solve_pressure(p, div, solver));
+        clear_inactive(p);
+        set_boundaries(FieldType::DENSITY, p);
+    } else {
+        lin_solve(FieldType::DENSITY, p, div, 1, 6);
+        // fixed sweep count, residual is never computed
+        accumulate(pressure_stats, {4, SolveStats::NOT_MEASURED});
+    }
+
+    int bodies = measure_forces ? (int)std::min(obstacles.size(), (size_t)NO_OWNER) : 0;
+    std::vector<v3> forces(bodies * omp_get_max_threads());
+
+    // Adjust velocity based on the pressure gradient
+    p.with_index([&](auto ix) {
+        for_each_active_row(ix, [&](int y, int z, int x0, int x1) {
+            int row = ix.y(y) + ix.z(z);
+            int ym  = ix.y(y - 1) + ix.z(z), yp = ix.y(y + 1) + ix.z(z);
+            int zm  = ix.y(y) + ix.z(z - 1), zp = ix.y(y) + ix.z(z + 1);
+
+            for (int x = x0; x < x1; x++) {
+                int xo = ix.x(x), i = row + xo;
+                int xm = row + ix.x(x - 1), xp = row + ix.x(x + 1);
+
+                uint8_t bits     = mask[i];
+                float   fraction = cut_cells && (bits & MASK_CUT_CELL) ? float(volume[i]) : 1.0f;
+                int     n        = ix.dim();
+                float   gx = subtract_gradient(velocX[i], p[xp], p[xm], fraction, n);
+                float   gy = subtract_gradient(velocY[i], p[yp + xo], p[ym + xo], fraction, n);
+                float   gz = subtract_gradient(velocZ[i], p[zp + xo], p[zm + xo], fraction, n);
+
+                velocX[i] = bits & MASK_SOLID ? 0.0f : gx;
+                velocY[i] = bits & MASK_SOLID ? 0.0f : gy;
+                velocZ[i] = bits & MASK_SOLID ? 0.0f : gz;
+            }
+
+            if (bodies) {
+                v3 *force = &forces[omp_get_thread_num() * bodies];
+                for (int x = x0; x < x1; x++) {
+                    int     xo = ix.x(x), i = row + xo;
+                    uint8_t bits = mask[i];
+                    if (!(bits & MASK_SOLID_NEIGHBOURS) || bits & MASK_SOLID) continue;
+
+                    float pressure = p[i];
+                    for_each_solid_face(bits, [&](int dx, int dy, int dz) {
+                        int j = ix.x(x + dx) + ix.y(y + dy) + ix.z(z + dz);
+                        if (owner[j] < bodies) force[owner[j]] += v3(dx, dy, dz) * pressure;
+                    });
+                }
+            }
+
+            set_row_boundaries(ix, FieldType::VX, velocX, y, z, x0, x1);
+            set_row_boundaries(ix, FieldType::VY, velocY, y, z, x0, x1);
+            set_row_boundaries(ix, FieldType::VZ, velocZ, y, z, x0, x1);
+        });
+    });
+    set_corners(velocX);
+    set_corners(velocY);
+    set_corners(velocZ);
+
+    // the step's force is the mean over its substeps
+    float scale = 1.0f / (h * N * N * substeps);
+    for (size_t t = 0; t < forces.size(); t++)
+        obstacles[t % bodies]->force += forces[t] * scale;
+}
+
+void Fluid::set_boundaries(FieldType b, Field<real> &f) {
+    // no velocity through solid ghost cells, the normal component is mirrored at the walls
+    auto wall = [&](int ghost, int inner, bool flip) {
+        f[ghost] = wall_value(state[ghost] == CellType::SOLID, f[inner], flip);
+    };
+
+    // bottom (z=0) and top (z=N-1) boundaries
+#pragma omp parallel for collapse(2)
+    for (int y = 1; y < N - 1; y++) {
+        for (int x = 1; x < N - 1; x++) {
+            wall(f.index(x, y, 0), f.index(x, y, 1), b == FieldType::VZ);
+            wall(f.index(x, y, N - 1), f.index(x, y, N - 2), b == FieldType::VZ);
+        }
+    }
+
+    // front (y=0) and back (y=N-1) boundaries
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < N - 1; z++) {
+        for (int x = 1; x < N - 1; x++) {
+            wall(f.index(x, 0, z), f.index(x, 1, z), b == FieldType::VY);
+            wall(f.index(x, N - 1, z), f.index(x, N - 2, z), b == FieldType::VY);
+        }
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < N - 1; z++) {
+        for (int y = 1; y < N - 1; y++) {
+            wall(f.index(0, y, z), f.index(1, y, z), b == FieldType::VX);
+            wall(f.index(N - 1, y, z), f.index(N - 2, y, z), b == FieldType::VX);
+        }
+    }
+
+    set_corners(f);
+}
+
+/* the ghost cells behind the wall cells of row (y, z), as set_boundaries() fills them. Called by
+ * sweeps right after they wrote the row, the neighbour bits of the wall cells tell whether the
+ * ghost cell is SOLID */
+template <typename I>
+void Fluid::set_row_boundaries(
+    I            ix,
+    FieldType    b,
+    Field<real> &f,
+    int          y,
+    int          z,
+    int          x0,
+    int          x1
+) {
+    int n   = ix.dim();
+    int row = ix.y(y) + ix.z(z);
+
+    auto wall = [&](int ghost, int inner, uint8_t solid_bit, bool flip) {
+        f[ghost] = wall_value(mask[inner] & solid_bit, f[inner], flip);
+    };
+
+    if (x0 == 1) wall(row + ix.x(0), row + ix.x(1), MASK_SOLID_XM, b == FieldType::VX);
+    if (x1 == n - 1)
+        wall(row + ix.x(n - 1), row + ix.x(n - 2), MASK_SOLID_XP, b == FieldType::VX);
+
+    // rows next to a y or z wall have a whole row of ghost cells behind them
+    auto wall_row = [&](int ghost_row, uint8_t solid_bit, bool flip) {
+        for (int x = x0; x < x1; x++) wall(ghost_row + ix.x(x), row + ix.x(x), solid_bit, flip);
+    };
+
+    if (y == 1) wall_row(ix.y(0) + ix.z(z), MASK_SOLID_YM, b == FieldType::VY);
+    if (y == n - 2) wall_row(ix.y(n - 1) + ix.z(z), MASK_SOLID_YP, b == FieldType::VY);
+    if (z == 1) wall_row(ix.y(y) + ix.z(0), MASK_SOLID_ZM, b == FieldType::VZ);
+    if (z == n - 2) wall_row(ix.y(y) + ix.z(n - 1), MASK_SOLID_ZP, b == FieldType::VZ);
+}
+
+void Fluid::set_corners(Field<real> &f) {
+    // Handle corners (ensure no fluid leakage)
+    int m = N - 1, l = N - 2;
+    f(0, 0, 0) = corner_value(f(1, 0, 0), f(0, 1, 0), f(0, 0, 1));
+    f(0, m, 0) = corner_value(f(1, m, 0), f(0, l, 0), f(0, m, 1));
+    f(0, 0, m) = corner_value(f(1, 0, m), f(0, 1, m), f(0, 0, l));
+    f(0, m, m) = corner_value(f(1, m, m), f(0, l, m), f(0, m, l));
+    f(m, 0, 0) = corner_value(f(l, 0, 0), f(m, 1, 0), f(m, 0, 1));
+    f(m, m, 0) = corner_value(f(l, m, 0), f(m, l, 0), f(m, m, 1));
+    f(m, 0, m) = corner_value(f(l, 0, m), f(m, 1, m), f(m, 0, l));
+    f(m, m, m) = corner_value(f(l, m, m), f(m, l, m), f(m, m, l));
+}
+
+/* Advection moves the flow by h * (N - 2) * |v| cells. With a target CFL number the step is cut
+ * into as many equal substeps as keep the fastest cell below it, so a step always advances dt
+ * however fast the flow gets. The speed is sampled once at the start of the step.
+ *
+ * Sparse steps are also cut so the flow stays within the margin of the active tiles. Flow too
+ * fast for that within max_substeps is stepped on the whole grid instead. */
+void Fluid::step() {
+    pressure_stats  = {0, SolveStats::NOT_MEASURED};
+    diffusion_stats = {0, SolveStats::NOT_MEASURED};
+
+    if (sparse) update_tiles();
+    else tiles_tracked = false;
+
+    substeps = 1;
+    if (cfl > 0.0f || sparse) {
+        float cells = dt * (N - 2) * max_speed();
+        int   limit = std::max(1, max_substeps);
+        if (cfl > 0.0f) substeps = std::clamp((int)std::ceil(cells / cfl), 1, limit);
+
+        float needed = std::ceil(cells / SPARSE_SUBSTEP_CELLS);
+        if (sparse && needed <= limit) substeps = std::max(substeps, (int)needed);
+        else if (sparse) tiles_tracked = false;
+    }
+
+    for (auto &obstacle : obstacles) obstacle->force = v3();
+
+    h = dt / substeps;
+    for (int i = 0; i < substeps; i++) {
+        if (i > 0 && tiles_tracked) update_tiles();  // the flow has moved since
+        substep();
+    }
+
+    if (recorder) recorder->record(*this);
+}
+
+/* largest |v| of the interior, outside the active tiles of a sparse step every speed is zero */
+float Fluid::max_speed(void) {
+    std::vector<float> fastest(omp_get_max_threads(), 0.0f);
+
+    for_each_active_row([&](int y, int z, int x0, int x1) {
+        float &speed = fastest[omp_get_thread_num()];
+        for (int x = x0; x < x1; x++) {
+            int i = vx.index(x, y, z);
+            speed = std::max(speed, vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]);
+        }
+    });
+
+    return std::sqrt(*std::max_element(fastest.begin(), fastest.end()));
+}
+
+void Fluid::substep(void) {
+    diffuse(FieldType::VX, vx0, vx, visc);
+    diffuse(FieldType::VY, vy0, vy, visc);
+    diffuse(FieldType::VZ, vz0, vz, visc);
+
+    project(vx0, vy0, vz0, vx, vy);
+
+    advect(
+        {{FieldType::VX, vx, vx0}, {FieldType::VY, vy, vy0}, {FieldType::VZ, vz, vz0}},
+        vx0,
+        vy0,
+        vz0
+    );
+
+    project(vx, vy, vz, vx0, vy0, true);
+
+    diffuse(FieldType::DENSITY, s, density, diffusion);
+    // density moves with the projected velocity, so it cannot share the pass above
+    advect({{FieldType::DENSITY, density, s}}, vx, vy, vz);
+}
+
+void Fluid::add_obstacle(std::unique_ptr<Obstacle> obstacle) {
+    obstacles.push_back(std::move(obstacle));
+    voxelize_all();
+}
+
+CellBox Fluid::grid_box(void) const {
+    CellBox grid;
+    grid.hi[0] = grid.hi[1] = grid.hi[2] = N;
+    return grid;
+}
+
+/* Rebuilds state and owner in box from the cached cells of the obstacles, later obstacles take
+ * the cells they share with earlier ones */
+void Fluid::stamp_obstacles(const CellBox &box) {
+    std::vector<size_t> reaching;
+    for (size_t i = 0; i < placed.size(); i++)
+        if (placed[i].enabled && !placed[i].cells.box.intersect(box).empty())
+            reaching.push_back(i);
+
+#pragma omp parallel for collapse(2)
+    for (int z = box.lo[2]; z < box.hi[2]; z++) {
+        for (int y = box.lo[1]; y < box.hi[1]; y++) {
+            for (int x = box.lo[0]; x < box.hi[0]; x++) {
+                CellType cell = CellType::FLUID;
+                uint8_t  id   = NO_OWNER;
+                for (size_t i : reaching) {
+                    if (!placed[i].cells.solid(x, y, z)) continue;
+                    cell = CellType::SOLID;
+                    id   = std::min(i, (size_t)NO_OWNER);
+                }
+                state(x, y, z) = cell;
+                owner(x, y, z) = id;
+            }
+        }
+    }
+}
+
+void Fluid::voxelize_all() {
+    solids_changed = true;
+
+    placed.clear();
+    for (auto &obstacle : obstacles) {
+        obstacle->geom->computeLocalAABB();  // bounds read by get_volume()
+        PlacedObstacle entry = {obstacle.get(), obstacle->enabled, {}};
+        entry.cells.position = obstacle->position;
+        if (obstacle->enabled)
+            entry.cells = voxelize_placed(obstacle->triangles, obstacle->position, N);
+        placed.push_back(std::move(entry));
+    }
+    stamp_obstacles(grid_box());
+    should_voxelize = false;
+
+    update_mask();
+    mark_solid_tiles();
+}
+
+/* The cells an obstacle had and the cells it has now both lie in the box joining its old and
+ * new bounds, so only that box is stamped again. An obstacle moved by whole cells keeps its
+ * voxelization, see voxelize_placed(). */
+void Fluid::voxelize_moved(void) {
+    bool same = placed.size() == obstacles.size();
+    for (size_t i = 0; same && i < placed.size(); i++)
+        same = placed[i].obstacle == obstacles[i].get();
+    if (!same) return voxelize_all();
+
+    CellBox changed;
+    for (size_t i = 0; i < placed.size(); i++) {
+        PlacedObstacle &entry    = placed[i];
+        Obstacle       &obstacle = *obstacles[i];
+        bool moved = obstacle.enabled && obstacle.position != entry.cells.position;
+        if (obstacle.enabled == entry.enabled && !moved) continue;
+
+        if (entry.enabled) changed = changed.join(entry.cells.box);
+        obstacle.geom->computeLocalAABB();
+        if (obstacle.enabled) {
+            const Occupancy *previous = entry.enabled ? &entry.cells : nullptr;
+            entry.cells = voxelize_placed(obstacle.triangles, obstacle.position, N, previous);
+            changed     = changed.join(entry.cells.box);
+        } else {
+            entry.cells          = Occupancy();
+            entry.cells.position = obstacle.position;
+        }
+        entry.enabled = obstacle.enabled;
+    }
+    should_voxelize = false;
+    if (changed.empty()) return;
+
+    solids_changed = true;
+    stamp_obstacles(changed);
+
+    // the mask of a cell also holds its neighbours
+    CellBox around = changed;
+    for (int k = 0; k < 3; k++) {
+        around.lo[k]--;
+        around.hi[k]++;
+    }
+    update_mask(around);
+    mark_solid_tiles(changed);
+}
+
+float Fluid::get_volume(v3 cell_position) {
+    v3         cell_size(1.0f, 1.0f, 1.0f);
+    fcl::AABBf cell_aabb(cell_position, cell_position + cell_size);
+
+    for (auto &obstacle : obstacles) {
+        fcl::AABBf obstacle_aabb(
+            obstacle->geom->aabb_local.min_ + (fcl::Vector3f)obstacle->position,
+            obstacle->geom->aabb_local.max_ + (fcl::Vector3f)obstacle->position
+        );
+
+        fcl::AABBf intersection_aabb;
+        intersection_aabb.min_ = cell_aabb.min_.cwiseMax(obstacle_aabb.min_);
+        intersection_aabb.max_ = cell_aabb.max_.cwiseMin(obstacle_aabb.max_);
+
+        fcl::Vector3f intersection_size = intersection_aabb.max_ - intersection_aabb.min_;
+        if (intersection_size[0] <= 0 || intersection_size[1] <= 0 || intersection_size[2] <= 0) {
+            return 0.0f;
+        }
+
+        float intersection_volume
+            = intersection_size[0] * intersection_size[1] * intersection_size[2];
+
+        float cell_volume = cell_size.x * cell_size.y * cell_size.z;
+        return intersection_volume / cell_volume;
+    }
+
+    return 1.0f;
+}
+
+// float Fluid::get_volume(v3 cell_position) { return
+// volume[IXv(cell_position)]; }
+
+CellType Fluid::get_state(v3 position) { return state[state.clamped_index(position)]; }
@@ -0,0 +1,266 @@
+#include "../../include/engine/Multigrid.hpp"
+
+#include <cmath>
+
+#include "../../include/engine/parallel.hpp"
+
+/* Operator on every level is the 7 point Laplacian  A u = diag * u - sum(active neighbours),
+ * where inactive cells (walls, solids) always hold u = 0 and are left out of diag. Coarse levels
+ * halve the number of interior cells per axis, so their spacing doubles and the restricted
+ * right hand side is scaled by h^2 = 4. */
+
+static constexpr int pre_sweeps = 2;
+static constexpr int post_sweeps = 2;
+static constexpr int coarsest_sweeps = 40;
+static constexpr int coarsest_interior = 4;
+
+Multigrid::Level::Level(int n)
+    : n(n), u(n * n * n), b(n * n * n), r(n * n * n), active(n * n * n), diag(n * n * n) {}
+
+Multigrid::Multigrid(int container_size) {
+    levels.emplace_back(container_size);
+
+    int interior = container_size - 2;
+    while (interior > coarsest_interior) {
+        interior = (interior + 1) / 2;
+        levels.emplace_back(interior + 2);
+    }
+}
+
+void Multigrid::update_diagonal(Level& level) {
+    int n = level.n;
+    int sy = n, sz = n * n;
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < n - 1; z++) {
+        for (int y = 1; y < n - 1; y++) {
+            for (int x = 1; x < n - 1; x++) {
+                int i = level.index(x, y, z);
+                const auto& a = level.active;
+                level.diag[i] = a[i] ? a[i - 1] + a[i + 1] + a[i - sy] + a[i + sy] + a[i - sz] +
+                                           a[i + sz]
+                                     : 0;
+            }
+        }
+    }
+}
+
+void Multigrid::set_solids(const Field<CellType>& state) {
+    Level& fine = levels[0];
+    int n = fine.n;
+
+    std::fill(fine.active.begin(), fine.active.end(), 0);
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < n - 1; z++) {
+        for (int y = 1; y < n - 1; y++) {
+            for (int x = 1; x < n - 1; x++) {
+                fine.active[fine.index(x, y, z)] = state(x, y, z) != CellType::SOLID;
+            }
+        }
+    }
+    update_diagonal(fine);
+
+    // a coarse cell takes part in the solve if any of its children does
+    for (size_t l = 1; l < levels.size(); l++) {
+        const Level& f = levels[l - 1];
+        Level& c = levels[l];
+
+        std::fill(c.active.begin(), c.active.end(), 0);
+#pragma omp parallel for collapse(2)
+        for (int z = 1; z < c.n - 1; z++) {
+            for (int y = 1; y < c.n - 1; y++) {
+                for (int x = 1; x < c.n - 1; x++) {
+                    uint8_t any = 0;
+                    for (int fz = 2 * z - 1; fz <= std::min(2 * z, f.n - 2); fz++)
+                        for (int fy = 2 * y - 1; fy <= std::min(2 * y, f.n - 2); fy++)
+                            for (int fx = 2 * x - 1; fx <= std::min(2 * x, f.n - 2); fx++)
+                                any |= f.active[f.index(fx, fy, fz)];
+                    c.active[c.index(x, y, z)] = any;
+                }
+            }
+        }
+        update_diagonal(c);
+    }
+}
+
+/** red-black Gauss-Seidel, every colour only reads the other one so it parallelises without
+ * races */
+void Multigrid::smooth(Level& level, int sweeps) {
+    int n = level.n;
+    int sy = n, sz = n * n;
+    float* u = level.u.data();
+    const float* b = level.b.data();
+    const uint8_t* diag = level.diag.data();
+
+    for (int sweep = 0; sweep < sweeps; sweep++) {
+        for (int color = 0; color < 2; color++) {
+#pragma omp parallel for collapse(2)
+            for (int z = 1; z < n - 1; z++) {
+                for (int y = 1; y < n - 1; y++) {
+                    for (int x = 1 + ((1 + y + z + color) & 1); x < n - 1; x += 2) {
+                        int i = level.index(x, y, z);
+                        if (!diag[i]) continue;
+                        u[i] = (b[i] + u[i - 1] + u[i + 1] + u[i - sy] + u[i + sy] + u[i - sz] +
+                                u[i + sz]) /
+                               diag[i];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/** stores b - Au in r and returns its squared norm */
+double Multigrid::residual(Level& level) {
+    int n = level.n;
+    int sy = n, sz = n * n;
+    const float* u = level.u.data();
+
+    return slab_sum(n, [&](int z) {
+        double sum = 0.0;
+        for (int y = 1; y < n - 1; y++) {
+            for (int x = 1; x < n - 1; x++) {
+                int i = level.index(x, y, z);
+                if (!level.active[i]) {
+                    level.r[i] = 0.0f;
+                    continue;
+                }
+
+                float Au = level.diag[i] * u[i] - (u[i - 1] + u[i + 1] + u[i - sy] + u[i + sy] +
+                                                   u[i - sz] + u[i + sz]);
+                level.r[i] = level.b[i] - Au;
+                sum += (double)level.r[i] * level.r[i];
+            }
+        }
+        return sum;
+    });
+}
+
+void Multigrid::restrict_residual(const Level& fine, Level& coarse) {
+    std::fill(coarse.u.begin(), coarse.u.end(), 0.0f);
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < coarse.n - 1; z++) {
+        for (int y = 1; y < coarse.n - 1; y++) {
+            for (int x = 1; x < coarse.n - 1; x++) {
+                int i = coarse.index(x, y, z);
+                if (!coarse.active[i]) {
+                    coarse.b[i] = 0.0f;
+                    continue;
+                }
+
+                // average of the 8 children times h^2 = 4
+                float sum = 0.0f;
+                for (int fz = 2 * z - 1; fz <= std::min(2 * z, fine.n - 2); fz++)
+                    for (int fy = 2 * y - 1; fy <= std::min(2 * y, fine.n - 2); fy++)
+                        for (int fx = 2 * x - 1; fx <= std::min(2 * x, fine.n - 2); fx++)
+                            sum += fine.r[fine.index(fx, fy, fz)];
+                coarse.b[i] = 0.5f * sum;
+            }
+        }
+    }
+}
+
+/** trilinear interpolation of the coarse correction, inactive coarse neighbours are replaced
+ * by the parent cell so walls do not drag the correction towards zero */
+void Multigrid::prolongate(const Level& coarse, Level& fine) {
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < fine.n - 1; z++) {
+        for (int y = 1; y < fine.n - 1; y++) {
+            for (int x = 1; x < fine.n - 1; x++) {
+                int i = fine.index(x, y, z);
+                if (!fine.active[i]) continue;
+
+                // parent cell and the direction of the nearest coarse neighbours
+                int px = (x + 1) / 2, py = (y + 1) / 2, pz = (z + 1) / 2;
+                int dx = (x & 1) ? -1 : 1, dy = (y & 1) ? -1 : 1, dz = (z & 1) ? -1 : 1;
+                int parent = coarse.index(px, py, pz);
+
+                float value = 0.0f;
+                for (int k = 0; k < 2; k++) {
+                    for (int j = 0; j < 2; j++) {
+                        for (int h = 0; h < 2; h++) {
+                            int c = coarse.index(px + h * dx, py + j * dy, pz + k * dz);
+                            float w = (h ? 0.25f : 0.75f) * (j ? 0.25f : 0.75f) *
+                                      (k ? 0.25f : 0.75f);
+                            value += w * coarse.u[coarse.active[c] ? c : parent];
+                        }
+                    }
+                }
+                fine.u[i] += value;
+            }
+        }
+    }
+}
+
+void Multigrid::cycle(int l, MultigridCycle type) {
+    Level& level = levels[l];
+
+    if (l + 1 == (int)levels.size()) {
+        smooth(level, coarsest_sweeps);
+        return;
+    }
+
+    smooth(level, pre_sweeps);
+    residual(level);
+    restrict_residual(level, levels[l + 1]);
+
+    cycle(l + 1, type);
+    if (type == MultigridCycle::F) cycle(l + 1, MultigridCycle::V);
+
+    prolongate(levels[l + 1], level);
+    smooth(level, post_sweeps);
+}
+
+SolveStats Multigrid::solve(Field<real>& p, const Field<real>& div, MultigridCycle type,
+                            float tolerance, int max_cycles) {
+    Level& fine = levels[0];
+    int n = fine.n;
+
+    // with Neumann boundaries everywhere the right hand side needs a zero mean to be solvable
+    double sum = 0.0;
+    int count = 0;
+    for (int z = 0; z < n; z++) {
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                int i = fine.index(x, y, z);
+                fine.u[i] = fine.active[i] ? float(p(x, y, z)) : 0.0f;
+                fine.b[i] = fine.active[i] ? float(div(x, y, z)) : 0.0f;
+                sum += fine.b[i];
+                count += fine.active[i];
+            }
+        }
+    }
+
+    SolveStats stats = {0, 0.0f};
+    if (count == 0) return stats;
+
+    float mean = sum / count;
+    double b_norm = 0.0;
+    for (int i = 0; i < n * n * n; i++) {
+        if (!fine.active[i]) continue;
+        fine.b[i] -= mean;
+        b_norm += (double)fine.b[i] * fine.b[i];
+    }
+    b_norm = std::sqrt(b_norm);
+
+    if (b_norm > 0.0) {
+        stats.residual = std::sqrt(residual(fine)) / b_norm;
+        while (stats.residual > tolerance && stats.iterations < max_cycles) {
+            cycle(0, type);
+            stats.residual = std::sqrt(residual(fine)) / b_norm;
+            stats.iterations++;
+        }
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < n - 1; z++) {
+        for (int y = 1; y < n - 1; y++) {
+            for (int x = 1; x < n - 1; x++) {
+                p(x, y, z) = fine.u[fine.index(x, y, z)];
+            }
+        }
+    }
+
+    return stats;
+}
@@ -0,0 +1,355 @@
+#include "../../include/engine/PCG.hpp"
+
+#include <cmath>
+
+#include "../../include/engine/parallel.hpp"
+
+/* Inactive cells and the boundary layer always hold 0 in x, p and z, so stencils can sum all six
+ * neighbours without checking the mask. */
+
+PCG::PCG(int container_size)
+    : n(container_size),
+      pressure{1.0f, std::vector<uint8_t>(n * n * n), std::vector<float>(n * n * n)},
+      diffusion{1.0f, std::vector<uint8_t>(n * n * n), std::vector<float>(n * n * n)},
+      op(&pressure),
+      inv_d(n * n * n),
+      x(n * n * n),
+      b(n * n * n),
+      r(n * n * n),
+      z(n * n * n),
+      p(n * n * n),
+      q(n * n * n) {}
+
+void PCG::set_solids(const Field<CellType>& state) {
+    int sy = n, sz = n * n;
+    auto& active = pressure.active;
+
+    std::fill(active.begin(), active.end(), 0);
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1; i < n - 1; i++) {
+                active[i + j * sy + k * sz] = state(i, j, k) != CellType::SOLID;
+            }
+        }
+    }
+
+    // walls and solids are left out of the diagonal, which makes them Neumann boundaries
+    std::fill(pressure.diag.begin(), pressure.diag.end(), 0.0f);
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1; i < n - 1; i++) {
+                int c = i + j * sy + k * sz;
+                if (active[c])
+                    pressure.diag[c] = active[c - 1] + active[c + 1] + active[c - sy] +
+                                       active[c + sy] + active[c - sz] + active[c + sz];
+            }
+        }
+    }
+}
+
+double PCG::dot(const std::vector<float>& u, const std::vector<float>& v) {
+    int sy = n, sz = n * n;
+
+    return slab_sum(n, [&](int k) {
+        double sum = 0.0;
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1; i < n - 1; i++) {
+                int c = i + j * sy + k * sz;
+                sum += (double)u[c] * v[c];
+            }
+        }
+        return sum;
+    });
+}
+
+/** Jacobi uses 1 / diag. Incomplete Cholesky IC(0) is factored in red-black order: red cells
+ * keep their diagonal as pivot, black cells subtract their red neighbours, so both the
+ * factorisation and the triangular solves parallelise within a colour. */
+void PCG::setup_preconditioner(Preconditioner preconditioner) {
+    int sy = n, sz = n * n;
+    const auto& diag = op->diag;
+    float a = op->a;
+
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1; i < n - 1; i++) {
+                int c = i + j * sy + k * sz;
+                bool red = ((i + j + k) & 1) == 0;
+                inv_d[c] = (diag[c] > 0.0f && (red || preconditioner == Preconditioner::JACOBI))
+                             ? 1.0f / diag[c]
+                             : 0.0f;
+            }
+        }
+    }
+
+    if (preconditioner == Preconditioner::JACOBI) return;
+
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1 + ((k + j) & 1); i < n - 1; i += 2) {
+                int c = i + j * sy + k * sz;
+                if (diag[c] <= 0.0f) continue;
+
+                float d = diag[c] - a * a *
+                                        (inv_d[c - 1] + inv_d[c + 1] + inv_d[c - sy] +
+                                         inv_d[c + sy] + inv_d[c - sz] + inv_d[c + sz]);
+
+                // fall back to the plain diagonal where the incomplete factor breaks down
+                inv_d[c] = 1.0f / (d > 0.25f * diag[c] ? d : diag[c]);
+            }
+        }
+    }
+}
+
+/** z = M^-1 r */
+void PCG::apply_preconditioner(Preconditioner preconditioner) {
+    int sy = n, sz = n * n;
+    const auto& active = op->active;
+    float a = op->a;
+
+    if (preconditioner == Preconditioner::JACOBI) {
+#pragma omp parallel for
+        for (int c = 0; c < n * n * n; c++) z[c] = r[c] * inv_d[c];
+        return;
+    }
+
+    // forward substitution L y = r, red cells have no earlier neighbours. y is stored in z
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1 + ((k + j + 1) & 1); i < n - 1; i += 2) {
+                int c = i + j * sy + k * sz;
+                z[c] = active[c] ? r[c] : 0.0f;
+            }
+        }
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1 + ((k + j) & 1); i < n - 1; i += 2) {
+                int c = i + j * sy + k * sz;
+                if (!active[c]) {
+                    z[c] = 0.0f;
+                    continue;
+                }
+                z[c] = r[c] + a * (z[c - 1] * inv_d[c - 1] + z[c + 1] * inv_d[c + 1] +
+                                   z[c - sy] * inv_d[c - sy] + z[c + sy] * inv_d[c + sy] +
+                                   z[c - sz] * inv_d[c - sz] + z[c + sz] * inv_d[c + sz]);
+            }
+        }
+    }
+
+    // backward substitution D L^T z = y, black cells first
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1 + ((k + j) & 1); i < n - 1; i += 2) {
+                int c = i + j * sy + k * sz;
+                z[c] *= inv_d[c];
+            }
+        }
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1 + ((k + j + 1) & 1); i < n - 1; i += 2) {
+                int c = i + j * sy + k * sz;
+                if (!active[c]) continue;
+                z[c] = inv_d[c] * (z[c] + a * (z[c - 1] + z[c + 1] + z[c - sy] + z[c + sy] +
+                                               z[c - sz] + z[c + sz]));
+            }
+        }
+    }
+}
+
+/** q = A p, returns p . q */
+double PCG::apply_operator(void) {
+    int sy = n, sz = n * n;
+    const auto& active = op->active;
+    const auto& diag = op->diag;
+    float a = op->a;
+
+    return slab_sum(n, [&](int k) {
+        double sum = 0.0;
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1; i < n - 1; i++) {
+                int c = i + j * sy + k * sz;
+                if (!active[c]) {
+                    q[c] = 0.0f;
+                    continue;
+                }
+                q[c] = diag[c] * p[c] -
+                       a * (p[c - 1] + p[c + 1] + p[c - sy] + p[c + sy] + p[c - sz] + p[c + sz]);
+                sum += (double)p[c] * q[c];
+            }
+        }
+        return sum;
+    });
+}
+
+SolveStats PCG::iterate(Preconditioner preconditioner, float tolerance, int max_iterations) {
+    int sy = n, sz = n * n;
+    SolveStats stats = {0, 0.0f};
+
+    double b_norm = std::sqrt(dot(b, b));
+    if (b_norm == 0.0) {
+        std::fill(x.begin(), x.end(), 0.0f);
+        return stats;
+    }
+
+    // r = b - A x
+    std::copy(x.begin(), x.end(), p.begin());
+    apply_operator();
+#pragma omp parallel for
+    for (int c = 0; c < n * n * n; c++) r[c] = b[c] - q[c];
+
+    stats.residual = std::sqrt(dot(r, r)) / b_norm;
+    if (stats.residual <= tolerance) return stats;
+
+    setup_preconditioner(preconditioner);
+    apply_preconditioner(preconditioner);
+    std::copy(z.begin(), z.end(), p.begin());
+    double rz = dot(r, z);
+
+    while (stats.iterations < max_iterations && rz > 0.0) {
+        double pq = apply_operator();
+        if (pq <= 0.0) break;
+        float alpha = rz / pq;
+
+        // x += alpha p, r -= alpha q
+        double r_norm = slab_sum(n, [&](int k) {
+            double sum = 0.0;
+            for (int j = 1; j < n - 1; j++) {
+                for (int i = 1; i < n - 1; i++) {
+                    int c = i + j * sy + k * sz;
+                    x[c] += alpha * p[c];
+                    r[c] -= alpha * q[c];
+                    sum += (double)r[c] * r[c];
+                }
+            }
+            return sum;
+        });
+
+        stats.iterations++;
+        stats.residual = std::sqrt(r_norm) / b_norm;
+        if (stats.residual <= tolerance) break;
+
+        apply_preconditioner(preconditioner);
+        double rz_new = dot(r, z);
+        float beta = rz_new / rz;
+        rz = rz_new;
+
+        // p = z + beta p
+#pragma omp parallel for
+        for (int c = 0; c < n * n * n; c++) p[c] = z[c] + beta * p[c];
+    }
+
+    return stats;
+}
+
+SolveStats PCG::solve_pressure(Field<real>& f, const Field<real>& div,
+                               const SolverSettings& settings) {
+    int sy = n, sz = n * n;
+    const auto& active = pressure.active;
+    op = &pressure;
+
+    // with Neumann boundaries everywhere the right hand side needs a zero mean to be solvable
+    double sum = 0.0;
+    int count = 0;
+    for (int k = 0; k < n; k++) {
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                if (!active[i + j * sy + k * sz]) continue;
+                sum += div(i, j, k);
+                count++;
+            }
+        }
+    }
+    if (count == 0) return {0, 0.0f};
+    float mean = sum / count;
+
+#pragma omp parallel for collapse(2)
+    for (int k = 0; k < n; k++) {
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                int c = i + j * sy + k * sz;
+                x[c] = active[c] ? float(f(i, j, k)) : 0.0f;
+                b[c] = active[c] ? div(i, j, k) - mean : 0.0f;
+            }
+        }
+    }
+
+    SolveStats stats =
+        iterate(settings.preconditioner, settings.tolerance, settings.max_iterations);
+
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1; i < n - 1; i++) {
+                f(i, j, k) = x[i + j * sy + k * sz];
+            }
+        }
+    }
+
+    return stats;
+}
+
+SolveStats PCG::solve_diffusion(FieldType type, Field<real>& f, const Field<real>& f0, float a,
+                                float c, const Field<CellType>& state,
+                                const SolverSettings& settings) {
+    int sy = n, sz = n * n;
+    op = &diffusion;
+    diffusion.a = a;
+
+    // every interior cell takes part. A wall neighbour is the mirrored cell itself (negated for
+    // the velocity component normal to that wall, zero if it is solid), which moves its
+    // coefficient onto the diagonal
+    float mirror_x = type == FieldType::VX ? -1.0f : 1.0f;
+    float mirror_y = type == FieldType::VY ? -1.0f : 1.0f;
+    float mirror_z = type == FieldType::VZ ? -1.0f : 1.0f;
+    auto wall = [&](int i, int j, int k, float mirror) {
+        return state(i, j, k) == CellType::SOLID ? 0.0f : mirror;
+    };
+
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1; i < n - 1; i++) {
+                int cell = i + j * sy + k * sz;
+
+                float d = c;
+                if (i == 1) d -= a * wall(0, j, k, mirror_x);
+                if (i == n - 2) d -= a * wall(n - 1, j, k, mirror_x);
+                if (j == 1) d -= a * wall(i, 0, k, mirror_y);
+                if (j == n - 2) d -= a * wall(i, n - 1, k, mirror_y);
+                if (k == 1) d -= a * wall(i, j, 0, mirror_z);
+                if (k == n - 2) d -= a * wall(i, j, n - 1, mirror_z);
+
+                diffusion.active[cell] = 1;
+                diffusion.diag[cell] = d;
+                x[cell] = f(i, j, k);
+                b[cell] = f0(i, j, k);
+            }
+        }
+    }
+
+    SolveStats stats =
+        iterate(settings.preconditioner, settings.tolerance, settings.max_iterations);
+
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < n - 1; k++) {
+        for (int j = 1; j < n - 1; j++) {
+            for (int i = 1; i < n - 1; i++) {
+                f(i, j, k) = x[i + j * sy + k * sz];
+            }
+        }
+    }
+
+    return stats;
+}
@@ -0,0 +1,418 @@
+#include "../../include/engine/advect.hpp"
+
+#include <algorithm>
+
+#include "../../include/engine/parallel.hpp"
+#include "../../include/engine/stencil.hpp"
+
+// the vector kernels load and gather 32 bit floats, 16 bit storage runs the scalar kernel
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(FLUID_PRECISION_16)
+#include <immintrin.h>
+#define ADVECT_X86
+#endif
+
+/* The scalar kernel back-traces and interpolates with the stencils of stencil.hpp, shared with
+ * EnsembleFluid and DistributedFluid. The vector kernels evaluate the same expression in the
+ * same order, lane by lane, so they only differ where the compiler contracts multiplies and adds
+ * into FMAs. */
+
+/** fields carried by one pass, the back-trace and weights of a cell are shared by all of them */
+struct AdvectGrid {
+    int count;
+    real* d[max_fused_advection];
+    const real* d0[max_fused_advection];
+    const real *vx, *vy, *vz;
+    int n;
+    AxisStride ax, ay, az; /** storage layout shared by all fields */
+    bool bricked;
+    float dt0;
+};
+
+/** back-traced position of a cell: storage offsets of its 8 stencil corners and their weights */
+struct Trace {
+    int index;
+    int x[2], y[2], z[2];
+    Trilinear w;
+
+    int tap(int dx, int dy, int dz) const { return x[dx] + y[dy] + z[dz]; }
+};
+
+static inline Trace trace(const AdvectGrid& g, int i, int j, int k) {
+    int index = g.ax(i) + g.ay(j) + g.az(k);
+    Trilinear w = trilinear_at(trace_back(i, g.vx[index], g.dt0, g.n),
+                               trace_back(j, g.vy[index], g.dt0, g.n),
+                               trace_back(k, g.vz[index], g.dt0, g.n), g.n);
+
+    return {
+        .index = index,
+        .x = {g.ax(w.i0), g.ax(w.i0 + 1)},
+        .y = {g.ay(w.j0), g.ay(w.j0 + 1)},
+        .z = {g.az(w.k0), g.az(w.k0 + 1)},
+        .w = w,
+    };
+}
+
+static inline void advect_cell(const AdvectGrid& g, int i, int j, int k) {
+    Trace t = trace(g, i, j, k);
+
+    for (int f = 0; f < g.count; f++) {
+        const real* c = g.d0[f];
+        auto tap = [&](int dx, int dy, int dz) { return c[t.tap(dx, dy, dz)]; };
+        g.d[f][t.index] = interpolate(t.w, tap);
+    }
+}
+
+static void advect_row_scalar(const AdvectGrid& g, int j, int k, int x0, int x1) {
+    for (int i = x0; i < x1; i++) advect_cell(g, i, j, k);
+}
+
+/** clamps d into the range of the 8 corners of d0 that advect_cell interpolates */
+static inline void limit_cell(const AdvectGrid& g, int i, int j, int k) {
+    Trace t = trace(g, i, j, k);
+
+    for (int f = 0; f < g.count; f++) {
+        const real* c = g.d0[f];
+        float v000 = c[t.tap(0, 0, 0)], v001 = c[t.tap(0, 0, 1)];
+        float v010 = c[t.tap(0, 1, 0)], v011 = c[t.tap(0, 1, 1)];
+        float v100 = c[t.tap(1, 0, 0)], v101 = c[t.tap(1, 0, 1)];
+        float v110 = c[t.tap(1, 1, 0)], v111 = c[t.tap(1, 1, 1)];
+
+        // same order of min and max as the vector kernels
+        float low = std::min(std::min(std::min(v000, v001), std::min(v010, v011)),
+                             std::min(std::min(v100, v101), std::min(v110, v111)));
+        float high = std::max(std::max(std::max(v000, v001), std::max(v010, v011)),
+                              std::max(std::max(v100, v101), std::max(v110, v111)));
+        g.d[f][t.index] = std::min(std::max(float(g.d[f][t.index]), low), high);
+    }
+}
+
+static void limit_row(const AdvectGrid& g, int j, int k, int x0, int x1) {
+    for (int i = x0; i < x1; i++) limit_cell(g, i, j, k);
+}
+
+#ifdef ADVECT_X86
+
+/** w0 * a + w1 * b, in the order of the scalar kernel */
+__attribute__((target("avx2"))) static inline __m256 lerp(__m256 w0, __m256 a, __m256 w1,
+                                                          __m256 b) {
+    return _mm256_add_ps(_mm256_mul_ps(w0, a), _mm256_mul_ps(w1, b));
+}
+
+__attribute__((target("avx512f"))) static inline __m512 lerp(__m512 w0, __m512 a, __m512 w1,
+                                                             __m512 b) {
+    return _mm512_add_ps(_mm512_mul_ps(w0, a), _mm512_mul_ps(w1, b));
+}
+
+/** AxisStride applied lane by lane */
+__attribute__((target("avx2"))) static inline __m256i offset(__m256i v, AxisStride stride) {
+    return _mm256_add_epi32(
+        _mm256_mullo_epi32(_mm256_srli_epi32(v, 3), _mm256_set1_epi32(stride.brick)),
+        _mm256_mullo_epi32(_mm256_and_si256(v, _mm256_set1_epi32(7)),
+                           _mm256_set1_epi32(stride.cell)));
+}
+
+__attribute__((target("avx512f"))) static inline __m512i offset(__m512i v, AxisStride stride) {
+    return _mm512_add_epi32(
+        _mm512_mullo_epi32(_mm512_srli_epi32(v, 3), _mm512_set1_epi32(stride.brick)),
+        _mm512_mullo_epi32(_mm512_and_si512(v, _mm512_set1_epi32(7)),
+                           _mm512_set1_epi32(stride.cell)));
+}
+
+/** 8 cells per iteration. Chunks start at multiples of 8, so in both layouts a chunk is 8
+ * consecutive floats, and lanes outside x0..x1-1 are masked off. With limit set the row is
+ * clamped to the gathered corners like limit_cell instead of being interpolated */
+template <bool limit>
+__attribute__((target("avx2"))) static void advect_row_avx2(const AdvectGrid& g, int j, int k,
+                                                            int x0, int x1) {
+    const __m256 dt0 = _mm256_set1_ps(g.dt0);
+    const __m256 lower = _mm256_set1_ps(0.5f);
+    const __m256 upper = _mm256_set1_ps(g.n - 1);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 fj = _mm256_set1_ps(j);
+    const __m256 fk = _mm256_set1_ps(k);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i first = _mm256_set1_epi32(x0 - 1);
+    const __m256i end = _mm256_set1_epi32(x1);
+    const __m256i last = _mm256_set1_epi32(g.n - 2);
+    const __m256i next = _mm256_set1_epi32(1);
+
+    int row = g.ay(j) + g.az(k);
+    for (int i = x0 & ~7; i < x1; i += 8) {
+        int index = row + g.ax(i);
+        __m256i xi = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+        __m256i mask =
+            _mm256_and_si256(_mm256_cmpgt_epi32(xi, first), _mm256_cmpgt_epi32(end, xi));
+
+        __m256 vx = _mm256_maskload_ps(g.vx + index, mask);
+        __m256 vy = _mm256_maskload_ps(g.vy + index, mask);
+        __m256 vz = _mm256_maskload_ps(g.vz + index, mask);
+
+        __m256 x = _mm256_sub_ps(_mm256_cvtepi32_ps(xi), _mm256_mul_ps(dt0, vx));
+        __m256 y = _mm256_sub_ps(fj, _mm256_mul_ps(dt0, vy));
+        __m256 z = _mm256_sub_ps(fk, _mm256_mul_ps(dt0, vz));
+        x = _mm256_min_ps(_mm256_max_ps(x, lower), upper);
+        y = _mm256_min_ps(_mm256_max_ps(y, lower), upper);
+        z = _mm256_min_ps(_mm256_max_ps(z, lower), upper);
+
+        __m256i i0 = _mm256_min_epi32(_mm256_cvttps_epi32(x), last);
+        __m256i j0 = _mm256_min_epi32(_mm256_cvttps_epi32(y), last);
+        __m256i k0 = _mm256_min_epi32(_mm256_cvttps_epi32(z), last);
+
+        __m256 s1 = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i0));
+        __m256 s0 = _mm256_sub_ps(one, s1);
+        __m256 t1 = _mm256_sub_ps(y, _mm256_cvtepi32_ps(j0));
+        __m256 t0 = _mm256_sub_ps(one, t1);
+        __m256 u1 = _mm256_sub_ps(z, _mm256_cvtepi32_ps(k0));
+        __m256 u0 = _mm256_sub_ps(one, u1);
+
+        __m256i ox0 = offset(i0, g.ax), ox1 = offset(_mm256_add_epi32(i0, next), g.ax);
+        __m256i oy0 = offset(j0, g.ay), oy1 = offset(_mm256_add_epi32(j0, next), g.ay);
+        __m256i oz0 = offset(k0, g.az), oz1 = offset(_mm256_add_epi32(k0, next), g.az);
+
+        __m256i c000 = _mm256_add_epi32(ox0, _mm256_add_epi32(oy0, oz0));
+        __m256i c001 = _mm256_add_epi32(ox0, _mm256_add_epi32(oy0, oz1));
+        __m256i c010 = _mm256_add_epi32(ox0, _mm256_add_epi32(oy1, oz0));
+        __m256i c011 = _mm256_add_epi32(ox0, _mm256_add_epi32(oy1, oz1));
+        __m256i c100 = _mm256_add_epi32(ox1, _mm256_add_epi32(oy0, oz0));
+        __m256i c101 = _mm256_add_epi32(ox1, _mm256_add_epi32(oy0, oz1));
+        __m256i c110 = _mm256_add_epi32(ox1, _mm256_add_epi32(oy1, oz0));
+        __m256i c111 = _mm256_add_epi32(ox1, _mm256_add_epi32(oy1, oz1));
+
+        // masked lanes back-trace with zero velocity from some x in 0..x1+6, which clamps to
+        // valid cells, so the gathers need no mask
+        for (int f = 0; f < g.count; f++) {
+            const float* d0 = g.d0[f];
+
+            __m256 v000 = _mm256_i32gather_ps(d0, c000, 4);
+            __m256 v001 = _mm256_i32gather_ps(d0, c001, 4);
+            __m256 v010 = _mm256_i32gather_ps(d0, c010, 4);
+            __m256 v011 = _mm256_i32gather_ps(d0, c011, 4);
+            __m256 v100 = _mm256_i32gather_ps(d0, c100, 4);
+            __m256 v101 = _mm256_i32gather_ps(d0, c101, 4);
+            __m256 v110 = _mm256_i32gather_ps(d0, c110, 4);
+            __m256 v111 = _mm256_i32gather_ps(d0, c111, 4);
+
+            __m256 value;
+            if constexpr (limit) {
+                __m256 low = _mm256_min_ps(
+                    _mm256_min_ps(_mm256_min_ps(v000, v001), _mm256_min_ps(v010, v011)),
+                    _mm256_min_ps(_mm256_min_ps(v100, v101), _mm256_min_ps(v110, v111)));
+                __m256 high = _mm256_max_ps(
+                    _mm256_max_ps(_mm256_max_ps(v000, v001), _mm256_max_ps(v010, v011)),
+                    _mm256_max_ps(_mm256_max_ps(v100, v101), _mm256_max_ps(v110, v111)));
+                value = _mm256_maskload_ps(g.d[f] + index, mask);
+                value = _mm256_min_ps(_mm256_max_ps(value, low), high);
+            } else {
+                __m256 lo = lerp(t0, lerp(u0, v000, u1, v001), t1, lerp(u0, v010, u1, v011));
+                __m256 hi = lerp(t0, lerp(u0, v100, u1, v101), t1, lerp(u0, v110, u1, v111));
+                value = lerp(s0, lo, s1, hi);
+            }
+
+            _mm256_maskstore_ps(g.d[f] + index, mask, value);
+        }
+    }
+}
+
+/** 16 cells per iteration with lanes outside x0..x1-1 masked off. A chunk spans two bricks in
+ * the bricked layout, so there the row is read with gathers and written with scatters. limit as
+ * for advect_row_avx2 */
+template <bool limit>
+__attribute__((target("avx512f"))) static void advect_row_avx512(const AdvectGrid& g, int j,
+                                                                  int k, int x0, int x1) {
+    const __m512 dt0 = _mm512_set1_ps(g.dt0);
+    const __m512 lower = _mm512_set1_ps(0.5f);
+    const __m512 upper = _mm512_set1_ps(g.n - 1);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 fj = _mm512_set1_ps(j);
+    const __m512 fk = _mm512_set1_ps(k);
+    const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i last = _mm512_set1_epi32(g.n - 2);
+    const __m512i next = _mm512_set1_epi32(1);
+
+    int row = g.ay(j) + g.az(k);
+    for (int i = x0 & ~15; i < x1; i += 16) {
+        __m512i xi = _mm512_add_epi32(_mm512_set1_epi32(i), lane);
+        __mmask16 mask = _mm512_cmpgt_epi32_mask(xi, _mm512_set1_epi32(x0 - 1)) &
+                         _mm512_cmpgt_epi32_mask(_mm512_set1_epi32(x1), xi);
+        __m512i cells = _mm512_add_epi32(_mm512_set1_epi32(row), offset(xi, g.ax));
+
+        __m512 vx, vy, vz;
+        if (g.bricked) {
+            vx = _mm512_mask_i32gather_ps(zero, mask, cells, g.vx, 4);
+            vy = _mm512_mask_i32gather_ps(zero, mask, cells, g.vy, 4);
+            vz = _mm512_mask_i32gather_ps(zero, mask, cells, g.vz, 4);
+        } else {
+            vx = _mm512_maskz_loadu_ps(mask, g.vx + row + i);
+            vy = _mm512_maskz_loadu_ps(mask, g.vy + row + i);
+            vz = _mm512_maskz_loadu_ps(mask, g.vz + row + i);
+        }
+
+        __m512 x = _mm512_sub_ps(_mm512_cvtepi32_ps(xi), _mm512_mul_ps(dt0, vx));
+        __m512 y = _mm512_sub_ps(fj, _mm512_mul_ps(dt0, vy));
+        __m512 z = _mm512_sub_ps(fk, _mm512_mul_ps(dt0, vz));
+        x = _mm512_min_ps(_mm512_max_ps(x, lower), upper);
+        y = _mm512_min_ps(_mm512_max_ps(y, lower), upper);
+        z = _mm512_min_ps(_mm512_max_ps(z, lower), upper);
+
+        __m512i i0 = _mm512_min_epi32(_mm512_cvttps_epi32(x), last);
+        __m512i j0 = _mm512_min_epi32(_mm512_cvttps_epi32(y), last);
+        __m512i k0 = _mm512_min_epi32(_mm512_cvttps_epi32(z), last);
+
+        __m512 s1 = _mm512_sub_ps(x, _mm512_cvtepi32_ps(i0));
+        __m512 s0 = _mm512_sub_ps(one, s1);
+        __m512 t1 = _mm512_sub_ps(y, _mm512_cvtepi32_ps(j0));
+        __m512 t0 = _mm512_sub_ps(one, t1);
+        __m512 u1 = _mm512_sub_ps(z, _mm512_cvtepi32_ps(k0));
+        __m512 u0 = _mm512_sub_ps(one, u1);
+
+        __m512i ox0 = offset(i0, g.ax), ox1 = offset(_mm512_add_epi32(i0, next), g.ax);
+        __m512i oy0 = offset(j0, g.ay), oy1 = offset(_mm512_add_epi32(j0, next), g.ay);
+        __m512i oz0 = offset(k0, g.az), oz1 = offset(_mm512_add_epi32(k0, next), g.az);
+
+        __m512i c000 = _mm512_add_epi32(ox0, _mm512_add_epi32(oy0, oz0));
+        __m512i c001 = _mm512_add_epi32(ox0, _mm512_add_epi32(oy0, oz1));
+        __m512i c010 = _mm512_add_epi32(ox0, _mm512_add_epi32(oy1, oz0));
+        __m512i c011 = _mm512_add_epi32(ox0, _mm512_add_epi32(oy1, oz1));
+        __m512i c100 = _mm512_add_epi32(ox1, _mm512_add_epi32(oy0, oz0));
+        __m512i c101 = _mm512_add_epi32(ox1, _mm512_add_epi32(oy0, oz1));
+        __m512i c110 = _mm512_add_epi32(ox1, _mm512_add_epi32(oy1, oz0));
+        __m512i c111 = _mm512_add_epi32(ox1, _mm512_add_epi32(oy1, oz1));
+
+        for (int f = 0; f < g.count; f++) {
+            const float* d0 = g.d0[f];
+
+            __m512 v000 = _mm512_mask_i32gather_ps(zero, mask, c000, d0, 4);
+            __m512 v001 = _mm512_mask_i32gather_ps(zero, mask, c001, d0, 4);
+            __m512 v010 = _mm512_mask_i32gather_ps(zero, mask, c010, d0, 4);
+            __m512 v011 = _mm512_mask_i32gather_ps(zero, mask, c011, d0, 4);
+            __m512 v100 = _mm512_mask_i32gather_ps(zero, mask, c100, d0, 4);
+            __m512 v101 = _mm512_mask_i32gather_ps(zero, mask, c101, d0, 4);
+            __m512 v110 = _mm512_mask_i32gather_ps(zero, mask, c110, d0, 4);
+            __m512 v111 = _mm512_mask_i32gather_ps(zero, mask, c111, d0, 4);
+
+            __m512 value;
+            if constexpr (limit) {
+                __m512 low = _mm512_min_ps(
+                    _mm512_min_ps(_mm512_min_ps(v000, v001), _mm512_min_ps(v010, v011)),
+                    _mm512_min_ps(_mm512_min_ps(v100, v101), _mm512_min_ps(v110, v111)));
+                __m512 high = _mm512_max_ps(
+                    _mm512_max_ps(_mm512_max_ps(v000, v001), _mm512_max_ps(v010, v011)),
+                    _mm512_max_ps(_mm512_max_ps(v100, v101), _mm512_max_ps(v110, v111)));
+                value = g.bricked ? _mm512_mask_i32gather_ps(zero, mask, cells, g.d[f], 4)
+                                  : _mm512_maskz_loadu_ps(mask, g.d[f] + row + i);
+                value = _mm512_min_ps(_mm512_max_ps(value, low), high);
+            } else {
+                __m512 lo = lerp(t0, lerp(u0, v000, u1, v001), t1, lerp(u0, v010, u1, v011));
+                __m512 hi = lerp(t0, lerp(u0, v100, u1, v101), t1, lerp(u0, v110, u1, v111));
+                value = lerp(s0, lo, s1, hi);
+            }
+
+            if (g.bricked) _mm512_mask_i32scatter_ps(g.d[f], mask, cells, value, 4);
+            else _mm512_mask_storeu_ps(g.d[f] + row + i, mask, value);
+        }
+    }
+}
+
+#endif
+
+bool advect_kernel_supported(AdvectKernel kernel) {
+    switch (kernel) {
+#ifdef ADVECT_X86
+        case AdvectKernel::AVX2: return __builtin_cpu_supports("avx2");
+        case AdvectKernel::AVX512: return __builtin_cpu_supports("avx512f");
+#endif
+        case AdvectKernel::SCALAR: return true;
+        default: return false;
+    }
+}
+
+AdvectKernel best_advect_kernel(void) {
+    if (advect_kernel_supported(AdvectKernel::AVX512)) return AdvectKernel::AVX512;
+    if (advect_kernel_supported(AdvectKernel::AVX2)) return AdvectKernel::AVX2;
+    return AdvectKernel::SCALAR;
+}
+
+const char* advect_kernel_name(AdvectKernel kernel) {
+    switch (kernel) {
+        case AdvectKernel::AVX2: return "avx2";
+        case AdvectKernel::AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+/** runs row over the interior, or over the tiles if given, once per pass of fields */
+static void for_each_pass(void (*row)(const AdvectGrid&, int, int, int, int),
+                          std::span<const AdvectedField> fields, const Field<real>& vx,
+                          const Field<real>& vy, const Field<real>& vz, float dt0,
+                          const std::vector<TileSpan>* tiles) {
+    AdvectGrid g = {
+        .count = 0,
+        .d = {},
+        .d0 = {},
+        .vx = vx.data(),
+        .vy = vy.data(),
+        .vz = vz.data(),
+        .n = vx.dim(),
+        .ax = vx.axis(0),
+        .ay = vx.axis(1),
+        .az = vx.axis(2),
+        .bricked = vx.get_layout() == FieldLayout::BRICKED,
+        .dt0 = dt0,
+    };
+
+    // longer lists are split into passes of max_fused_advection fields
+    for (size_t first = 0; first < fields.size(); first += max_fused_advection) {
+        g.count = std::min(fields.size() - first, (size_t)max_fused_advection);
+        for (int f = 0; f < g.count; f++) {
+            g.d[f] = fields[first + f].d.data();
+            g.d0[f] = fields[first + f].d0.data();
+        }
+
+        if (tiles) {
+            for_each_tile_row(g.n, *tiles, [&](int j, int k, int x0, int x1) {
+                row(g, j, k, x0, x1);
+            });
+            continue;
+        }
+
+#pragma omp parallel for collapse(2)
+        for (int k = 1; k < g.n - 1; k++)
+            for (int j = 1; j < g.n - 1; j++) row(g, j, k, 1, g.n - 1);
+    }
+}
+
+void advect_interior(AdvectKernel kernel, std::span<const AdvectedField> fields,
+                     const Field<real>& vx, const Field<real>& vy, const Field<real>& vz,
+                     float dt0, const std::vector<TileSpan>* tiles) {
+    void (*row)(const AdvectGrid&, int, int, int, int) = advect_row_scalar;
+#ifdef ADVECT_X86
+    if (advect_kernel_supported(kernel)) {
+        if (kernel == AdvectKernel::AVX512) row = advect_row_avx512<false>;
+        else if (kernel == AdvectKernel::AVX2) row = advect_row_avx2<false>;
+    }
+#endif
+
+    for_each_pass(row, fields, vx, vy, vz, dt0, tiles);
+}
+
+void limit_interior(AdvectKernel kernel, std::span<const AdvectedField> fields,
+                    const Field<real>& vx, const Field<real>& vy, const Field<real>& vz,
+                    float dt0, const std::vector<TileSpan>* tiles) {
+    void (*row)(const AdvectGrid&, int, int, int, int) = limit_row;
+#ifdef ADVECT_X86
+    if (advect_kernel_supported(kernel)) {
+        if (kernel == AdvectKernel::AVX512) row = advect_row_avx512<true>;
+        else if (kernel == AdvectKernel::AVX2) row = advect_row_avx2<true>;
+    }
+#endif
+
+    for_each_pass(row, fields, vx, vy, vz, dt0, tiles);
+}
+
+void advect_interior(AdvectKernel kernel, Field<real>& d, const Field<real>& d0,
+                     const Field<real>& vx, const Field<real>& vy, const Field<real>& vz,
+                     float dt0, const std::vector<TileSpan>* tiles) {
+    AdvectedField field = {FieldType::DENSITY, d, d0};
+    advect_interior(kernel, std::span(&field, 1), vx, vy, vz, dt0, tiles);
+}
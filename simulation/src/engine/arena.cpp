@@ -0,0 +1,54 @@
+#include "../../include/engine/arena.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+static constexpr size_t huge_page = 2 << 20;
+
+Arena::~Arena(void) { free(block); }
+
+void Arena::resize(size_t bytes) {
+    used = 0;
+    if (bytes == capacity) return;
+
+    free(block);
+    block = nullptr;
+    capacity = 0;
+    if (bytes == 0) return;
+
+    // aligned_alloc wants a multiple of the alignment, huge pages want whole 2 MiB pages
+    size_t align = bytes >= huge_page ? huge_page : alignment;
+    size_t rounded = (bytes + align - 1) / align * align;
+    block = static_cast<char*>(aligned_alloc(align, rounded));
+    if (!block) throw std::bad_alloc();
+    capacity = bytes;
+
+#ifdef MADV_HUGEPAGE
+    if (align == huge_page) madvise(block, rounded, MADV_HUGEPAGE);  // only a hint
+#endif
+}
+
+static constexpr size_t chunk = 1 << 20;
+
+void Arena::clear(void) {
+    long chunks = (capacity + chunk - 1) / chunk;
+
+#pragma omp parallel for
+    for (long c = 0; c < chunks; c++)
+        memset(block + c * chunk, 0, std::min(chunk, capacity - c * chunk));
+}
+
+void Arena::copy_from(const char* source) {
+    long chunks = (capacity + chunk - 1) / chunk;
+
+#pragma omp parallel for
+    for (long c = 0; c < chunks; c++)
+        memcpy(block + c * chunk, source + c * chunk, std::min(chunk, capacity - c * chunk));
+}
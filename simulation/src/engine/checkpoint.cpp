@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "../../include/engine/Fluid.hpp"
+
+/* A checkpoint is a header, one record per obstacle and the field arena, copied byte for byte.
+ * The arena starts on a page boundary of the file, so loading maps the file and copies the
+ * fields straight into the arena without parsing them. Fields only load into a Fluid built with
+ * the same storage precision, the grid size and layout are taken from the checkpoint. */
+
+static constexpr char checkpoint_magic[8] = {'F', 'L', 'U', 'I', 'D', 'C', 'K', 'P'};
+static constexpr uint32_t checkpoint_version = 2;
+static constexpr size_t checkpoint_page = 4096;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t real_size;    /** bytes per stored value, sizeof(real) */
+    char precision[16];    /** real_name */
+    int32_t container_size;
+    int32_t layout;        /** FieldLayout */
+    float dt, visc, diffusion, scaling;
+    uint32_t obstacles;    /** CheckpointObstacle records following the header */
+    uint64_t arena_offset; /** page aligned */
+    uint64_t arena_size;
+};
+
+/** obstacles are matched by identifier on load, their models come from the config */
+struct CheckpointObstacle {
+    char identifier[64];
+    float position[3];
+    float scaling[3];
+    uint8_t enabled;
+};
+
+/** 3 cells or more, and few enough that a field of either layout counts them with an int.
+ * Bricked fields are padded to whole bricks */
+static bool valid_container_size(int32_t n) {
+    long long padded = 8 * ((n + 7LL) / 8);
+    return n >= 3 && padded <= INT_MAX / padded / padded;
+}
+
+static std::runtime_error checkpoint_error(const std::string& path, const std::string& what) {
+    return std::runtime_error("Checkpoint " + path + ": " + what);
+}
+
+void Fluid::save_checkpoint(const std::string& path) const {
+    size_t records = sizeof(CheckpointHeader) + obstacles.size() * sizeof(CheckpointObstacle);
+    std::vector<char> head((records + checkpoint_page - 1) / checkpoint_page * checkpoint_page, 0);
+
+    CheckpointHeader header = {};
+    memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.real_size = sizeof(real);
+    strncpy(header.precision, real_name, sizeof(header.precision) - 1);
+    header.container_size = container_size;
+    header.layout = (int32_t)layout;
+    header.dt = dt;
+    header.visc = visc;
+    header.diffusion = diffusion;
+    header.scaling = scaling;
+    header.obstacles = obstacles.size();
+    header.arena_offset = head.size();
+    header.arena_size = arena.size();
+    memcpy(head.data(), &header, sizeof(header));
+
+    for (size_t i = 0; i < obstacles.size(); i++) {
+        const Obstacle& obstacle = *obstacles[i];
+        CheckpointObstacle record = {};
+        strncpy(record.identifier, obstacle.identifier.c_str(), sizeof(record.identifier) - 1);
+        memcpy(record.position, &obstacle.position.x, sizeof(record.position));
+        memcpy(record.scaling, &obstacle.scaling.x, sizeof(record.scaling));
+        record.enabled = obstacle.enabled;
+        memcpy(head.data() + sizeof(header) + i * sizeof(record), &record, sizeof(record));
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw checkpoint_error(path, strerror(errno));
+
+    // one gathered write for the header page and the arena, repeated only if it comes up short
+    iovec parts[2] = {{head.data(), head.size()}, {(void*)arena.data(), arena.size()}};
+    size_t total = head.size() + arena.size(), written = 0;
+    while (written < total) {
+        ssize_t n = writev(fd, parts, 2);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            throw checkpoint_error(path, strerror(errno));
+        }
+        written += n;
+        for (iovec& part : parts) {
+            size_t consumed = std::min((size_t)n, part.iov_len);
+            part.iov_base = (char*)part.iov_base + consumed;
+            part.iov_len -= consumed;
+            n -= consumed;
+        }
+    }
+    close(fd);
+}
+
+void Fluid::load_checkpoint(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw checkpoint_error(path, strerror(errno));
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(CheckpointHeader)) {
+        close(fd);
+        throw checkpoint_error(path, "too short for a checkpoint");
+    }
+
+    size_t size = info.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) throw checkpoint_error(path, strerror(errno));
+    const char* bytes = static_cast<const char*>(map);
+
+    CheckpointHeader header;
+    memcpy(&header, bytes, sizeof(header));
+
+    std::string problem;
+    if (memcmp(header.magic, checkpoint_magic, sizeof(header.magic)))
+        problem = "not a checkpoint";
+    else if (header.version != checkpoint_version)
+        problem = "version " + std::to_string(header.version) + ", expected " +
+                  std::to_string(checkpoint_version);
+    else if (header.real_size != sizeof(real) || strncmp(header.precision, real_name, 16))
+        problem = "fields stored as " +
+                  std::string(header.precision, strnlen(header.precision, 16)) +
+                  ", this build stores " + real_name;
+    else if (header.arena_offset + header.arena_size > size ||
+             sizeof(header) + header.obstacles * sizeof(CheckpointObstacle) > header.arena_offset)
+        problem = "truncated";
+    else if (header.layout != (int32_t)FieldLayout::LINEAR &&
+             header.layout != (int32_t)FieldLayout::BRICKED)
+        problem = "unknown field layout " + std::to_string(header.layout);
+    else if (!valid_container_size(header.container_size))
+        problem = "container size " + std::to_string(header.container_size) + " out of range";
+    else if (header.arena_size != arena_size(header.container_size, (FieldLayout)header.layout))
+        problem = "field storage does not match this build";
+
+    if (!problem.empty()) {
+        munmap(map, size);
+        throw checkpoint_error(path, problem);
+    }
+
+    container_size = header.container_size;
+    layout = (FieldLayout)header.layout;
+    place_fields();
+    arena.copy_from(bytes + header.arena_offset);
+
+    dt = header.dt;
+    h = header.dt;
+    visc = header.visc;
+    diffusion = header.diffusion;
+    scaling = header.scaling;
+
+    // SOLID cells name their obstacle by its index in the saving Fluid, 255 is no obstacle
+    uint8_t owners[256];
+    std::fill(owners, owners + 256, 255);
+
+    for (uint32_t i = 0; i < header.obstacles; i++) {
+        CheckpointObstacle record;
+        memcpy(&record, bytes + sizeof(header) + i * sizeof(record), sizeof(record));
+        std::string identifier(record.identifier, strnlen(record.identifier, 64));
+
+        for (size_t j = 0; j < obstacles.size(); j++) {
+            Obstacle& obstacle = *obstacles[j];
+            if (obstacle.identifier != identifier) continue;
+            obstacle.position = v3(record.position[0], record.position[1], record.position[2]);
+            obstacle.scaling = v3(record.scaling[0], record.scaling[1], record.scaling[2]);
+            obstacle.enabled = record.enabled;
+            if (i < 255 && j < 255) owners[i] = j;
+        }
+    }
+    munmap(map, size);
+    for (uint8_t& o : owner) o = owners[o];
+
+    // the state was saved with the fields, only what is derived from it is rebuilt
+    advect_scratch.clear();
+    placed.clear();  // the next voxelize_moved() voxelizes every obstacle
+    should_voxelize = false;
+    solids_changed = true;
+    tiles_tracked = false;
+    update_mask();
+    mark_solid_tiles();
+}
@@ -0,0 +1,103 @@
+#include "../../include/engine/config.hpp"
+
+#include <raymath.h>
+
+#include <toml++/toml.hpp>
+
+static v3 read_v3(const toml::array* array, v3 fallback) {
+    if (!array) return fallback;
+
+    return v3(array->at(0).value_or(fallback.x), array->at(1).value_or(fallback.y),
+              array->at(2).value_or(fallback.z));
+}
+
+Config load_config(const std::string& path) {
+    Config config;
+
+    auto file = toml::parse_file(path);
+    if (file.empty()) return config;
+
+    auto settings = file["settings"];
+    config.resolution = settings["resolution"].value_or(config.resolution);
+    config.scaling = settings["scaling"].value_or(config.scaling);
+    config.diffusion = settings["diffusion"].value_or(config.diffusion);
+    config.viscosity = settings["viscosity"].value_or(config.viscosity);
+    config.dt = settings["dt"].value_or(config.dt);
+
+    std::string layout = settings["layout"].value_or("linear");
+    config.layout = layout == "bricked" ? FieldLayout::BRICKED : FieldLayout::LINEAR;
+    config.sparse = settings["sparse"].value_or(config.sparse);
+    config.sparse_threshold = settings["sparse_threshold"].value_or(config.sparse_threshold);
+    config.cfl = settings["cfl"].value_or(config.cfl);
+    config.max_substeps = settings["max_substeps"].value_or(config.max_substeps);
+    config.steps_per_second = settings["steps_per_second"].value_or(config.steps_per_second);
+
+    std::string advection = settings["advection"].value_or("semi_lagrangian");
+    if (advection == "maccormack") config.advection = AdvectScheme::MACCORMACK;
+    else if (advection == "bfecc") config.advection = AdvectScheme::BFECC;
+    else config.advection = AdvectScheme::SEMI_LAGRANGIAN;
+
+    config.insert_position = read_v3(settings["insert_position"].as_array(), v3(1.0f));
+    config.insert_velocity = read_v3(settings["insert_velocity"].as_array(), v3(4.0f));
+
+    if (auto obstacles = file["obstacle"].as_array()) {
+        for (const auto& node : *obstacles) {
+            const auto& obstacle_table = *node.as_table();
+
+            config.obstacles.push_back({
+                .position = read_v3(obstacle_table["position"].as_array(), v3(0.0f)),
+                .scaling = read_v3(obstacle_table["scaling"].as_array(), v3(1.0f)),
+                .model = obstacle_table["model"].value_or("No .obj file given in config.toml"),
+                .enabled = obstacle_table["enabled"].value_or(false),
+                .identifier = obstacle_table["identifier"].value_or("no identifier"),
+            });
+        }
+    }
+
+    auto solver = file["solver"];
+    std::string pressure = solver["pressure"].value_or("gauss_seidel");
+    if (pressure == "multigrid") config.solver.pressure = PressureSolver::MULTIGRID;
+    else if (pressure == "pcg") config.solver.pressure = PressureSolver::PCG;
+    else config.solver.pressure = PressureSolver::GAUSS_SEIDEL;
+
+    std::string diffusion = solver["diffusion"].value_or("gauss_seidel");
+    if (diffusion == "pcg") config.solver.diffusion = DiffusionSolver::PCG;
+    else config.solver.diffusion = DiffusionSolver::GAUSS_SEIDEL;
+
+    std::string cycle = solver["cycle"].value_or("V");
+    config.solver.cycle = cycle == "F" ? MultigridCycle::F : MultigridCycle::V;
+
+    std::string preconditioner = solver["preconditioner"].value_or("incomplete_cholesky");
+    config.solver.preconditioner = preconditioner == "jacobi"
+                                       ? Preconditioner::JACOBI
+                                       : Preconditioner::INCOMPLETE_CHOLESKY;
+
+    config.solver.tolerance = solver["tolerance"].value_or(config.solver.tolerance);
+    config.solver.max_cycles = solver["max_cycles"].value_or(config.solver.max_cycles);
+    config.solver.max_iterations = solver["max_iterations"].value_or(config.solver.max_iterations);
+
+    auto record = file["record"];
+    config.record.density_step = record["density_step"].value_or(config.record.density_step);
+    config.record.velocity_step = record["velocity_step"].value_or(config.record.velocity_step);
+    config.record.keyframe_interval =
+        record["keyframe_interval"].value_or(config.record.keyframe_interval);
+    config.record.threads = record["threads"].value_or(config.record.threads);
+
+    auto batch = file["batch"];
+    config.batch.steps = batch["steps"].value_or(config.batch.steps);
+    config.batch.inject = batch["inject"].value_or(config.batch.inject);
+    config.batch.output = batch["output"].value_or(config.batch.output.c_str());
+
+    return config;
+}
+
+std::unique_ptr<Obstacle> make_obstacle(const ObstacleConfig& config, Model model) {
+    std::unique_ptr<Obstacle> obstacle = std::make_unique<Obstacle>(
+        config.position, config.scaling, model, config.enabled, config.identifier);
+
+    obstacle->model.transform =
+        MatrixMultiply(obstacle->model.transform,
+                       MatrixScale(obstacle->scaling.x, obstacle->scaling.y, obstacle->scaling.z));
+
+    return obstacle;
+}
@@ -0,0 +1,422 @@
+#include "../../include/engine/distributed.hpp"
+
+#include <omp.h>
+
+#include <climits>
+#include <cmath>
+#include <stdexcept>
+
+#include "../../include/engine/stencil.hpp"
+#include "../../include/engine/voxelizer.hpp"
+
+/* The sweeps of Fluid with its default settings over the owned planes, on linear storage, with
+ * the cell updates of stencil.hpp. Red-black sweeps only read the other colour, so exchanging
+ * the halo between colours reproduces the single process sweep exactly. voxelize() finds whole
+ * SOLID cells like Fluid does, so the fluid fraction of every cell is 1 */
+
+DistributedFluid::DistributedFluid(MPI_Comm comm, int container_size, float diffusion,
+                                   float viscosity, float dt)
+    : comm(comm),
+      dt(dt),
+      h(dt),
+      visc(viscosity),
+      container_size(container_size),
+      diffusion(diffusion),
+      cfl(0.0f),
+      max_substeps(16),
+      substeps(1) {
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &ranks);
+    if (N < 2 * ranks)
+        throw std::runtime_error("DistributedFluid: " + std::to_string(N) +
+                                 " planes are too few for " + std::to_string(ranks) + " ranks");
+
+    // counted in planes rather than bytes, so messages of several GiB stay within an int
+    MPI_Datatype row;
+    MPI_Type_contiguous(N * sizeof(real), MPI_BYTE, &row);
+    MPI_Type_contiguous(N, row, &plane);
+    MPI_Type_commit(&plane);
+    MPI_Type_free(&row);
+
+    for (int r = 0; r <= ranks; r++) plane_begin.push_back((long)r * N / ranks);
+    z_begin = plane_begin[rank];
+    z_end = plane_begin[rank + 1];
+
+    size_t cells = (size_t)N * N * (z_end - z_begin + 2);
+    for (Slab* f : {&s, &density, &vx, &vy, &vz, &vx0, &vy0, &vz0}) f->assign(cells, 0.0f);
+    mask.assign(cells, 0);
+    owner.assign(cells, NO_OWNER);
+}
+
+DistributedFluid::~DistributedFluid(void) {
+    int finalized;
+    MPI_Finalized(&finalized);
+    if (!finalized) MPI_Type_free(&plane);
+}
+
+/* one plane to and from each neighbour, ranks at the walls have a single neighbour */
+void DistributedFluid::exchange(Slab& f) {
+    int below = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    int above = rank < ranks - 1 ? rank + 1 : MPI_PROC_NULL;
+
+    MPI_Sendrecv(&f[at(0, 0, z_end - 1)], 1, plane, above, 0, &f[at(0, 0, z_begin - 1)], 1, plane,
+                 below, 0, comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(&f[at(0, 0, z_begin)], 1, plane, below, 1, &f[at(0, 0, z_end)], 1, plane, above,
+                 1, comm, MPI_STATUS_IGNORE);
+}
+
+/* Fills window with planes lo..hi of f. Every rank announces the planes it needs and sends the
+ * owners' share of everyone else's, lo > hi asks for none */
+void DistributedFluid::fetch(const Slab& f, int lo, int hi) {
+    std::vector<int> ranges(2 * ranks);
+    int mine[2] = {lo, hi};
+    MPI_Allgather(mine, 2, MPI_INT, ranges.data(), 2, MPI_INT, comm);
+
+    // counts and offsets in planes, the slab starts with the halo plane below z_begin
+    std::vector<int> send_counts(ranks), send_offsets(ranks), receive_counts(ranks),
+        receive_offsets(ranks);
+    for (int r = 0; r < ranks; r++) {
+        int first = std::max(ranges[2 * r], z_begin);
+        int last = std::min(ranges[2 * r + 1] + 1, z_end);
+        send_counts[r] = std::max(0, last - first);
+        send_offsets[r] = last > first ? first - z_begin + 1 : 0;
+
+        first = std::max(lo, plane_begin[r]);
+        last = std::min(hi + 1, plane_begin[r + 1]);
+        receive_counts[r] = std::max(0, last - first);
+        receive_offsets[r] = last > first ? first - lo : 0;
+    }
+
+    window.resize((size_t)N * N * std::max(0, hi - lo + 1));
+    MPI_Alltoallv(f.data(), send_counts.data(), send_offsets.data(), plane, window.data(),
+                  receive_counts.data(), receive_offsets.data(), plane, comm);
+}
+
+void DistributedFluid::add_density(v3 position, float amount) {
+    int x = std::clamp(int(position.x), 0, N - 1), y = std::clamp(int(position.y), 0, N - 1);
+    int z = std::clamp(int(position.z), 0, N - 1);
+    if (z >= z_begin && z < z_end) density[at(x, y, z)] += amount;
+}
+
+void DistributedFluid::add_velocity(v3 position, v3 amount) {
+    int x = std::clamp(int(position.x), 0, N - 1), y = std::clamp(int(position.y), 0, N - 1);
+    int z = std::clamp(int(position.z), 0, N - 1);
+    if (z < z_begin || z >= z_end) return;
+
+    size_t i = at(x, y, z);
+    vx[i] += amount.x;
+    vy[i] += amount.y;
+    vz[i] += amount.z;
+}
+
+/* the neighbour bits of the halo planes are left out, the sweeps only read those of the owned
+ * planes */
+void DistributedFluid::voxelize(const std::vector<std::unique_ptr<Obstacle>>& obstacles) {
+    int first = std::max(0, z_begin - 1), last = std::min(N, z_end + 1);
+    size_t cells = (size_t)(last - first) * N * N;
+    std::vector<uint8_t> solid(cells, 0), id(cells, NO_OWNER);
+    for (size_t i = 0; i < obstacles.size(); i++) {
+        if (!obstacles[i]->enabled) continue;
+        std::vector<uint8_t> hit =
+            voxelize_mesh(obstacles[i]->triangles, obstacles[i]->position, N, first, last);
+        for (size_t c = 0; c < cells; c++) {
+            if (!hit[c]) continue;
+            solid[c] = 1;
+            id[c] = std::min(i, (size_t)NO_OWNER);
+        }
+    }
+    forces.assign(std::min(obstacles.size(), (size_t)NO_OWNER), v3());
+
+#pragma omp parallel for collapse(2)
+    for (int z = first; z < last; z++) {
+        for (int y = 0; y < N; y++) {
+            for (int x = 0; x < N; x++) {
+                size_t c = x + (size_t)N * (y + (size_t)N * (z - first));
+                bool interior = x > 0 && y > 0 && z > first && x < N - 1 && y < N - 1 &&
+                                z < last - 1;
+                mask[at(x, y, z)] = cell_mask(false, interior, [&](int dx, int dy, int dz) {
+                    return solid[c + dx + (ptrdiff_t)N * (dy + (ptrdiff_t)N * dz)] != 0;
+                });
+                owner[at(x, y, z)] = id[c];
+            }
+        }
+    }
+}
+
+v3 DistributedFluid::get_force(int obstacle) const {
+    return obstacle >= 0 && obstacle < (int)forces.size() ? forces[obstacle] : v3();
+}
+
+std::vector<real> DistributedFluid::gather(FieldType type) {
+    const Slab& f = type == FieldType::VX   ? vx
+                    : type == FieldType::VY ? vy
+                    : type == FieldType::VZ ? vz
+                                            : density;
+
+    std::vector<int> counts(ranks), offsets(ranks);
+    for (int r = 0; r < ranks; r++) {
+        counts[r] = plane_begin[r + 1] - plane_begin[r];
+        offsets[r] = plane_begin[r];
+    }
+
+    std::vector<real> whole(rank == 0 ? (size_t)N * N * N : 0);
+    MPI_Gatherv(&f[at(0, 0, z_begin)], counts[rank], plane, whole.data(), counts.data(),
+                offsets.data(), plane, 0, comm);
+    return whole;
+}
+
+void DistributedFluid::step(void) {
+    substeps = 1;
+    if (cfl > 0.0f) {
+        float cells = dt * (N - 2) * max_speed();
+        substeps = std::clamp((int)std::ceil(cells / cfl), 1, std::max(1, max_substeps));
+    }
+
+    std::fill(forces.begin(), forces.end(), v3());
+
+    h = dt / substeps;
+    for (int i = 0; i < substeps; i++) substep();
+
+    // v3 is three floats, summed over the ranks in rank order
+    MPI_Allreduce(MPI_IN_PLACE, forces.data(), 3 * forces.size(), MPI_FLOAT, MPI_SUM, comm);
+}
+
+float DistributedFluid::max_speed(void) {
+    float fastest = 0.0f;
+#pragma omp parallel for collapse(2) reduction(max : fastest)
+    for (int z = interior_begin(); z < interior_end(); z++) {
+        for (int y = 1; y < N - 1; y++) {
+            for (int x = 1; x < N - 1; x++) {
+                size_t i = at(x, y, z);
+                fastest = std::max(fastest, float(vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]));
+            }
+        }
+    }
+
+    MPI_Allreduce(MPI_IN_PLACE, &fastest, 1, MPI_FLOAT, MPI_MAX, comm);
+    return std::sqrt(fastest);
+}
+
+void DistributedFluid::substep(void) {
+    diffuse(FieldType::VX, vx0, vx, visc);
+    diffuse(FieldType::VY, vy0, vy, visc);
+    diffuse(FieldType::VZ, vz0, vz, visc);
+
+    project(vx0, vy0, vz0, vx, vy);
+
+    advect({{FieldType::VX, vx, vx0}, {FieldType::VY, vy, vy0}, {FieldType::VZ, vz, vz0}}, vx0,
+           vy0, vz0);
+
+    project(vx, vy, vz, vx0, vy0, true);
+
+    diffuse(FieldType::DENSITY, s, density, diffusion);
+    advect({{FieldType::DENSITY, density, s}}, vx, vy, vz);
+}
+
+void DistributedFluid::diffuse(FieldType b, Slab& x, Slab& x0, float diff) {
+    float a = h * diff * pow(container_size - 2, 3);
+    lin_solve(b, x, x0, a, 1 + 6 * a);
+}
+
+void DistributedFluid::lin_solve(FieldType b, Slab& f, Slab& f0, float a, float c) {
+    float cRecip = 1.0f / c;
+    size_t sy = N, sz = (size_t)N * N;
+
+    for (int i = 0; i < 4; i++) {
+        for (int color = 0; color < 2; color++) {
+            exchange(f);
+
+#pragma omp parallel for collapse(2)
+            for (int z = interior_begin(); z < interior_end(); z++) {
+                for (int y = 1; y < N - 1; y++) {
+                    real* row = &f[at(0, y, z)];
+                    const real* src = &f0[at(0, y, z)];
+
+                    for (int x = 1 + ((1 + y + z + color) & 1); x < N - 1; x += 2) {
+                        row[x] = relax(src[x], row[x + 1], row[x - 1], row[x + sy], row[x - sy],
+                                       row[x + sz], row[x - sz], a, cRecip);
+                    }
+                }
+            }
+        }
+
+        set_boundaries(b, f);
+    }
+}
+
+void DistributedFluid::project(Slab& velocX, Slab& velocY, Slab& velocZ, Slab& p, Slab& div,
+                               bool measure_forces) {
+    size_t sy = N, sz = (size_t)N * N;
+
+    exchange(velocZ);
+#pragma omp parallel for collapse(2)
+    for (int z = interior_begin(); z < interior_end(); z++) {
+        for (int y = 1; y < N - 1; y++) {
+            for (int x = 1; x < N - 1; x++) {
+                size_t i = at(x, y, z);
+                float d = divergence(velocX[i + 1], velocX[i - 1], velocY[i + sy], velocY[i - sy],
+                                     velocZ[i + sz], velocZ[i - sz], 1.0f, N);
+
+                div[i] = mask[i] & MASK_SOLID ? 0.0f : d;
+                p[i] = 0.0f;
+            }
+        }
+    }
+    set_boundaries(FieldType::DENSITY, div);
+    set_boundaries(FieldType::DENSITY, p);
+
+    lin_solve(FieldType::DENSITY, p, div, 1, 6);
+
+    exchange(p);
+#pragma omp parallel for collapse(2)
+    for (int z = interior_begin(); z < interior_end(); z++) {
+        for (int y = 1; y < N - 1; y++) {
+            for (int x = 1; x < N - 1; x++) {
+                size_t i = at(x, y, z);
+                float gx = subtract_gradient(velocX[i], p[i + 1], p[i - 1], 1.0f, N);
+                float gy = subtract_gradient(velocY[i], p[i + sy], p[i - sy], 1.0f, N);
+                float gz = subtract_gradient(velocZ[i], p[i + sz], p[i - sz], 1.0f, N);
+
+                bool solid = mask[i] & MASK_SOLID;
+                velocX[i] = solid ? 0.0f : gx;
+                velocY[i] = solid ? 0.0f : gy;
+                velocZ[i] = solid ? 0.0f : gz;
+            }
+        }
+    }
+    if (measure_forces) add_forces(p);
+    set_boundaries(FieldType::VX, velocX);
+    set_boundaries(FieldType::VY, velocY);
+    set_boundaries(FieldType::VZ, velocZ);
+}
+
+/* Obstacle forces like Fluid::project measures them, of the fluid cells this rank owns. Their
+ * SOLID neighbours may lie in a halo plane, owner covers those too */
+void DistributedFluid::add_forces(const Slab& p) {
+    int bodies = forces.size();
+    if (bodies == 0) return;
+    std::vector<v3> sums(omp_get_max_threads() * bodies);
+
+#pragma omp parallel for collapse(2)
+    for (int z = interior_begin(); z < interior_end(); z++) {
+        for (int y = 1; y < N - 1; y++) {
+            v3* sum = &sums[omp_get_thread_num() * bodies];
+            for (int x = 1; x < N - 1; x++) {
+                size_t i = at(x, y, z);
+                uint8_t bits = mask[i];
+                if (!(bits & MASK_SOLID_NEIGHBOURS) || bits & MASK_SOLID) continue;
+
+                float pressure = p[i];
+                for_each_solid_face(bits, [&](int dx, int dy, int dz) {
+                    uint8_t j = owner[at(x + dx, y + dy, z + dz)];
+                    if (j < bodies) sum[j] += v3(dx, dy, dz) * pressure;
+                });
+            }
+        }
+    }
+
+    // the step's force is the mean over its substeps
+    float scale = 1.0f / (h * N * N * substeps);
+    for (size_t t = 0; t < sums.size(); t++) forces[t % bodies] += sums[t] * scale;
+}
+
+/* Semi-Lagrangian like advect_cell. The planes the back-traces of this rank reach are fetched
+ * once per field, however far the flow moves in a step */
+void DistributedFluid::advect(std::initializer_list<Advected> fields, Slab& velocX,
+                              Slab& velocY, Slab& velocZ) {
+    float dt0 = h * (N - 2);
+
+    int lo = INT_MAX, hi = INT_MIN;
+#pragma omp parallel for collapse(2) reduction(min : lo) reduction(max : hi)
+    for (int k = interior_begin(); k < interior_end(); k++) {
+        for (int j = 1; j < N - 1; j++) {
+            for (int i = 1; i < N - 1; i++) {
+                int k0 = lower_sample(trace_back(k, velocZ[at(i, j, k)], dt0, N), N);
+                lo = std::min(lo, k0);
+                hi = std::max(hi, k0 + 1);
+            }
+        }
+    }
+
+    for (const Advected& field : fields) {
+        fetch(field.d0, lo, hi);
+        const real* c = window.data() - (size_t)N * N * lo;  // indexed by global plane
+
+#pragma omp parallel for collapse(2)
+        for (int k = interior_begin(); k < interior_end(); k++) {
+            for (int j = 1; j < N - 1; j++) {
+                for (int i = 1; i < N - 1; i++) {
+                    size_t index = at(i, j, k);
+                    Trilinear w = trilinear_at(trace_back(i, velocX[index], dt0, N),
+                                               trace_back(j, velocY[index], dt0, N),
+                                               trace_back(k, velocZ[index], dt0, N), N);
+
+                    const real* corner = c + w.i0 + (size_t)N * (w.j0 + (size_t)N * w.k0);
+                    field.d[index] = interpolate(w, [&](int dx, int dy, int dz) {
+                        return corner[dx + (size_t)N * (dy + (size_t)N * dz)];
+                    });
+                }
+            }
+        }
+
+        set_boundaries(field.type, field.d);
+    }
+}
+
+/* Fluid::set_boundaries over the owned planes, only the outermost ranks hold z walls */
+void DistributedFluid::set_boundaries(FieldType b, Slab& f) {
+    auto wall = [&](size_t ghost, size_t inner, bool flip) {
+        f[ghost] = wall_value(mask[ghost] & MASK_SOLID, f[inner], flip);
+    };
+
+    if (z_begin == 0 || z_end == N) {
+#pragma omp parallel for collapse(2)
+        for (int y = 1; y < N - 1; y++) {
+            for (int x = 1; x < N - 1; x++) {
+                if (z_begin == 0) wall(at(x, y, 0), at(x, y, 1), b == FieldType::VZ);
+                if (z_end == N) wall(at(x, y, N - 1), at(x, y, N - 2), b == FieldType::VZ);
+            }
+        }
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int z = interior_begin(); z < interior_end(); z++) {
+        for (int x = 1; x < N - 1; x++) {
+            wall(at(x, 0, z), at(x, 1, z), b == FieldType::VY);
+            wall(at(x, N - 1, z), at(x, N - 2, z), b == FieldType::VY);
+        }
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int z = interior_begin(); z < interior_end(); z++) {
+        for (int y = 1; y < N - 1; y++) {
+            wall(at(0, y, z), at(1, y, z), b == FieldType::VX);
+            wall(at(N - 1, y, z), at(N - 2, y, z), b == FieldType::VX);
+        }
+    }
+
+    set_corners(f);
+}
+
+/* like Fluid::set_corners, every rank has two planes at least, so the corners and the planes
+ * next to them are on the same rank */
+void DistributedFluid::set_corners(Slab& f) {
+    auto cell = [&](int x, int y, int z) -> real& { return f[at(x, y, z)]; };
+    auto corner = [&](int x, int y, int z, int dx, int dy, int dz) {
+        cell(x, y, z) = corner_value(cell(x + dx, y, z), cell(x, y + dy, z), cell(x, y, z + dz));
+    };
+
+    int m = N - 1;
+    if (z_begin == 0) {
+        corner(0, 0, 0, 1, 1, 1);
+        corner(0, m, 0, 1, -1, 1);
+        corner(m, 0, 0, -1, 1, 1);
+        corner(m, m, 0, -1, -1, 1);
+    }
+    if (z_end == N) {
+        corner(0, 0, m, 1, 1, -1);
+        corner(0, m, m, 1, -1, -1);
+        corner(m, 0, m, -1, 1, -1);
+        corner(m, m, m, -1, -1, -1);
+    }
+}
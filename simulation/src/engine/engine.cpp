@@ -5,7 +5,10 @@
 #include <raymath.h>
 #include <rlgl.h>
 
+#include <cmath>
+#include <fstream>
 #include <memory>
+#include <sstream>
 #include <vector>
 
 Obstacle::Obstacle(v3 position, v3 scaling, Model model, bool enabled, std::string identifier) {
@@ -14,16 +17,41 @@ Obstacle::Obstacle(v3 position, v3 scaling, Model model, bool enabled, std::stri
     this->model = std::move(model);
     this->enabled = enabled;
     this->identifier = identifier;
+    this->force = v3();
 
-    geom = mesh_to_bvh(model);
+    triangles = mesh_triangles(this->model);
+    geom = mesh_to_bvh(this->model);
 }
 
 Obstacle::~Obstacle() { UnloadModel(model); }
 
-std::shared_ptr<fcl::BVHModel<fcl::OBBf>> mesh_to_bvh(const Model& model) {
-    std::shared_ptr<fcl::BVHModel<fcl::OBBf>> bvh = std::make_shared<fcl::BVHModel<fcl::OBBf>>();
+static float dot(v3 a, v3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
 
-    bvh->beginModel();
+float drag(v3 force, v3 flow) {
+    float length = std::sqrt(dot(flow, flow));
+    return length > 0.0f ? dot(force, flow) / length : 0.0f;
+}
+
+float lift(v3 force, v3 flow, v3 up) {
+    float speed = dot(flow, flow);
+    v3 normal = speed > 0.0f ? up - flow * (dot(up, flow) / speed) : up;
+    float length = std::sqrt(dot(normal, normal));
+    return length > 0.0f ? dot(force, normal) / length : 0.0f;
+}
+
+float lift_to_drag(v3 force, v3 flow, v3 up) {
+    float d = drag(force, flow);
+    return d != 0.0f ? lift(force, flow, up) / d : 0.0f;
+}
+
+float Obstacle::drag(v3 flow) const { return ::drag(force, flow); }
+
+float Obstacle::lift(v3 flow, v3 up) const { return ::lift(force, flow, up); }
+
+float Obstacle::lift_to_drag(v3 flow, v3 up) const { return ::lift_to_drag(force, flow, up); }
+
+std::vector<v3> mesh_triangles(const Model& model) {
+    std::vector<v3> corners;
     for (int m = 0; m < model.meshCount; m++) {
         const Mesh& mesh = model.meshes[m];
 
@@ -31,38 +59,102 @@ std::shared_ptr<fcl::BVHModel<fcl::OBBf>> mesh_to_bvh(const Model& model) {
         if (mesh.triangleCount <= 0) throw std::runtime_error("Mesh has no triangles!");
         if (mesh.vertexCount <= 0) throw std::runtime_error("Mesh has no vertices!");
 
-        std::vector<fcl::Vector3f> vertices;
-        for (int i = 0; i < mesh.vertexCount; i++) {
-            float x = mesh.vertices[i * 3];
-            float y = mesh.vertices[i * 3 + 1];
-            float z = mesh.vertices[i * 3 + 2];
-            vertices.emplace_back(x, y, z);
-        }
-
-        std::vector<int> triangles;
+        auto vertex = [&](int i) {
+            return v3(mesh.vertices[i * 3], mesh.vertices[i * 3 + 1], mesh.vertices[i * 3 + 2]);
+        };
 
         if (mesh.indices) {
-            for (int i = 0; i < mesh.triangleCount * 3; i++) {
-                triangles.push_back(mesh.indices[i]);
-            }
+            for (int i = 0; i < mesh.triangleCount * 3; i++)
+                corners.push_back(vertex(mesh.indices[i]));
         } else {
-            for (int i = 0; i < mesh.vertexCount; i++) {
-                triangles.push_back(i);
-            }
-        }
-
-        for (size_t i = 0; i < triangles.size(); i += 3) {
-            int idx1 = triangles[i];
-            int idx2 = triangles[i + 1];
-            int idx3 = triangles[i + 2];
-            bvh->addTriangle(vertices[idx1], vertices[idx2], vertices[idx3]);
+            for (int i = 0; i < mesh.vertexCount / 3 * 3; i++) corners.push_back(vertex(i));
         }
     }
+    return corners;
+}
 
+std::shared_ptr<fcl::BVHModel<fcl::OBBf>> mesh_to_bvh(const Model& model) {
+    std::shared_ptr<fcl::BVHModel<fcl::OBBf>> bvh = std::make_shared<fcl::BVHModel<fcl::OBBf>>();
+    std::vector<v3> corners = mesh_triangles(model);
+
+    bvh->beginModel();
+    for (size_t i = 0; i < corners.size(); i += 3)
+        bvh->addTriangle(corners[i], corners[i + 1], corners[i + 2]);
     bvh->endModel();
     return bvh;
 }
 
+Model load_obj_headless(const char* path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error(std::string("Could not open model ") + path);
+
+    std::vector<float> positions;
+    std::vector<float> vertices;  // unindexed triangle soup, like raylib's own obj loader
+
+    std::string line;
+    int number = 0;
+    auto malformed = [&](const std::string& what) {
+        return std::runtime_error(std::string("Model ") + path + " line " +
+                                  std::to_string(number) + ": " + what);
+    };
+
+    while (std::getline(file, line)) {
+        number++;
+        std::istringstream stream(line);
+        std::string keyword;
+        stream >> keyword;
+
+        if (keyword == "v") {
+            float x, y, z;
+            if (!(stream >> x >> y >> z)) throw malformed("vertex without three coordinates");
+            positions.insert(positions.end(), {x, y, z});
+        } else if (keyword == "f") {
+            // faces are "v", "v/vt", "v//vn" or "v/vt/vn", polygons are triangulated as fans
+            std::vector<long> face;
+            std::string token;
+            long count = positions.size() / 3;
+            while (stream >> token) {
+                std::string digits = token.substr(0, token.find('/'));
+                size_t used = 0;
+                long index = 0;
+                try {
+                    index = std::stol(digits, &used);
+                } catch (const std::logic_error&) {  // invalid_argument and out_of_range
+                }
+                if (used == 0 || used != digits.size())
+                    throw malformed("face vertex \"" + token + "\" is not a number");
+
+                index = index < 0 ? count + index : index - 1;
+                if (index < 0 || index >= count)
+                    throw malformed("face vertex " + digits + " of " + std::to_string(count) +
+                                    " vertices");
+                face.push_back(index);
+            }
+
+            for (size_t i = 1; i + 1 < face.size(); i++) {
+                for (long index : {face[0], face[i], face[i + 1]}) {
+                    vertices.insert(vertices.end(), positions.begin() + index * 3,
+                                    positions.begin() + index * 3 + 3);
+                }
+            }
+        }
+    }
+
+    if (vertices.empty()) throw std::runtime_error(std::string("Model has no faces: ") + path);
+    return model_from_triangles(vertices);
+}
+
+Model model_from_triangles(const std::vector<float>& vertices) {
+    Mesh mesh = {0};
+    mesh.vertexCount = vertices.size() / 3;
+    mesh.triangleCount = mesh.vertexCount / 3;
+    mesh.vertices = (float*)MemAlloc(vertices.size() * sizeof(float));
+    std::copy(vertices.begin(), vertices.end(), mesh.vertices);
+
+    // LoadModelFromMesh only sets up the default material, the mesh is never uploaded
+    return LoadModelFromMesh(mesh);
+}
+
 bool drag_v3(const char* label, v3& v, float speed, float min, float max) {
     return ImGui::DragFloat3(label, &v.x, speed, min, max);
 }
@@ -0,0 +1,432 @@
+#include "../../include/engine/ensemble.hpp"
+
+#include <omp.h>
+
+#include <climits>
+#include <cmath>
+#include <stdexcept>
+
+#include "../../include/engine/advect.hpp"
+#include "../../include/engine/stencil.hpp"
+#include "../../include/engine/voxelizer.hpp"
+
+/* The sweeps of Fluid with its default settings, with one more loop innermost that runs over
+ * the lanes of a cell and the cell updates of stencil.hpp inside it. The lanes of a cell are
+ * contiguous, only the corners advect() interpolates differ from lane to lane and are gathered.
+ * voxelize() finds whole SOLID cells like Fluid does, so the fluid fraction of every cell is 1 */
+
+EnsembleFluid::EnsembleFluid(int container_size, int instances, float diffusion,
+                             float viscosity, float dt)
+    : dt(dt),
+      h(dt),
+      visc(viscosity),
+      lanes(instances),
+      container_size(container_size),
+      diffusion(diffusion),
+      cfl(0.0f),
+      max_substeps(16),
+      substeps(1),
+      advect_kernel(best_advect_kernel()) {
+    size_t values = (size_t)N * N * N * lanes;
+    if (instances < 1 || values > INT_MAX)
+        throw std::runtime_error("EnsembleFluid: " + std::to_string(instances) +
+                                 " instances of " + std::to_string(N) +
+                                 "^3 cells do not fit 32 bit indices");
+
+    arena.resize(8 * Arena::slot<real>(values));
+    for (real** f : {&s, &density, &vx, &vy, &vz, &vx0, &vy0, &vz0})
+        *f = arena.take<real>(values);
+    arena.clear();
+    mask.assign(values, 0);
+    owner.assign(values, NO_OWNER);
+    forces.resize(lanes);
+}
+
+void EnsembleFluid::reset(void) { arena.clear(); }
+
+void EnsembleFluid::check_instance(int instance) const {
+    if (instance < 0 || instance >= lanes)
+        throw std::out_of_range("EnsembleFluid: instance " + std::to_string(instance) +
+                                " of " + std::to_string(lanes));
+}
+
+size_t EnsembleFluid::at(int instance, v3 position) const {
+    check_instance(instance);
+    return at(std::clamp(int(position.x), 0, N - 1), std::clamp(int(position.y), 0, N - 1),
+              std::clamp(int(position.z), 0, N - 1)) +
+           instance;
+}
+
+void EnsembleFluid::add_density(int instance, v3 position, float amount) {
+    density[at(instance, position)] += amount;
+}
+
+void EnsembleFluid::add_velocity(int instance, v3 position, v3 amount) {
+    size_t i = at(instance, position);
+    vx[i] += amount.x;
+    vy[i] += amount.y;
+    vz[i] += amount.z;
+}
+
+float EnsembleFluid::get_density(int instance, v3 position) const {
+    return density[at(instance, position)];
+}
+
+v3 EnsembleFluid::get_velocity(int instance, v3 position) const {
+    size_t i = at(instance, position);
+    return {vx[i], vy[i], vz[i]};
+}
+
+CellType EnsembleFluid::get_state(int instance, v3 position) const {
+    return mask[at(instance, position)] & MASK_SOLID ? CellType::SOLID : CellType::FLUID;
+}
+
+v3 EnsembleFluid::get_force(int instance, int obstacle) const {
+    check_instance(instance);
+    const std::vector<v3>& f = forces[instance];
+    return obstacle >= 0 && obstacle < (int)f.size() ? f[obstacle] : v3();
+}
+
+std::vector<real> EnsembleFluid::get_field(int instance, FieldType type) const {
+    check_instance(instance);
+    const real* f = type == FieldType::VX   ? vx
+                    : type == FieldType::VY ? vy
+                    : type == FieldType::VZ ? vz
+                                            : density;
+
+    std::vector<real> cells((size_t)N * N * N);
+    for (size_t i = 0; i < cells.size(); i++) cells[i] = f[i * lanes + instance];
+    return cells;
+}
+
+void EnsembleFluid::voxelize(int instance,
+                             const std::vector<std::unique_ptr<Obstacle>>& obstacles) {
+    check_instance(instance);
+    size_t cells = (size_t)N * N * N;
+    std::vector<uint8_t> solid(cells, 0), id(cells, NO_OWNER);
+    for (size_t i = 0; i < obstacles.size(); i++) {
+        if (!obstacles[i]->enabled) continue;
+        std::vector<uint8_t> hit =
+            voxelize_mesh(obstacles[i]->triangles, obstacles[i]->position, N, 0, N);
+        for (size_t c = 0; c < cells; c++) {
+            if (!hit[c]) continue;
+            solid[c] = 1;
+            id[c] = std::min(i, (size_t)NO_OWNER);
+        }
+    }
+    forces[instance].assign(std::min(obstacles.size(), (size_t)NO_OWNER), v3());
+
+#pragma omp parallel for collapse(2)
+    for (int z = 0; z < N; z++) {
+        for (int y = 0; y < N; y++) {
+            for (int x = 0; x < N; x++) {
+                size_t c = x + (size_t)N * (y + (size_t)N * z);
+                bool interior = x > 0 && y > 0 && z > 0 && x < N - 1 && y < N - 1 && z < N - 1;
+                mask[at(x, y, z) + instance] =
+                    cell_mask(false, interior, [&](int dx, int dy, int dz) {
+                        return solid[c + dx + (ptrdiff_t)N * (dy + (ptrdiff_t)N * dz)] != 0;
+                    });
+                owner[at(x, y, z) + instance] = id[c];
+            }
+        }
+    }
+}
+
+void EnsembleFluid::step(void) {
+    substeps = 1;
+    if (cfl > 0.0f) {
+        float cells = dt * (N - 2) * max_speed();
+        substeps = std::clamp((int)std::ceil(cells / cfl), 1, std::max(1, max_substeps));
+    }
+
+    for (std::vector<v3>& f : forces) std::fill(f.begin(), f.end(), v3());
+
+    h = dt / substeps;
+    for (int i = 0; i < substeps; i++) substep();
+}
+
+/* largest |v| of the interior over all instances */
+float EnsembleFluid::max_speed(void) {
+    float fastest = 0.0f;
+    int K = lanes;
+#pragma omp parallel for collapse(2) reduction(max : fastest)
+    for (int z = 1; z < N - 1; z++) {
+        for (int y = 1; y < N - 1; y++) {
+            for (int x = 1; x < N - 1; x++) {
+                size_t c = at(x, y, z);
+#pragma omp simd reduction(max : fastest)
+                for (int k = 0; k < K; k++) {
+                    size_t i = c + k;
+                    fastest =
+                        std::max(fastest, float(vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]));
+                }
+            }
+        }
+    }
+    return std::sqrt(fastest);
+}
+
+void EnsembleFluid::substep(void) {
+    diffuse(FieldType::VX, vx0, vx, visc);
+    diffuse(FieldType::VY, vy0, vy, visc);
+    diffuse(FieldType::VZ, vz0, vz, visc);
+
+    project(vx0, vy0, vz0, vx, vy);
+
+    advect(FieldType::VX, vx, vx0, vx0, vy0, vz0);
+    advect(FieldType::VY, vy, vy0, vx0, vy0, vz0);
+    advect(FieldType::VZ, vz, vz0, vx0, vy0, vz0);
+
+    project(vx, vy, vz, vx0, vy0, true);
+
+    diffuse(FieldType::DENSITY, s, density, diffusion);
+    advect(FieldType::DENSITY, density, s, vx, vy, vz);
+}
+
+void EnsembleFluid::diffuse(FieldType b, real* x, real* x0, float diff) {
+    float a = h * diff * pow(container_size - 2, 3);
+    lin_solve(b, x, x0, a, 1 + 6 * a);
+}
+
+/* Red-black Gauss-Seidel like Fluid::lin_solve, a cell of every lane at a time */
+void EnsembleFluid::lin_solve(FieldType b, real* f, const real* f0, float a, float c) {
+    float cRecip = 1.0f / c;
+    size_t sx = lanes, sy = at(0, 1, 0), sz = at(0, 0, 1);
+    int K = lanes;
+
+    for (int i = 0; i < 4; i++) {
+        for (int color = 0; color < 2; color++) {
+#pragma omp parallel for collapse(2)
+            for (int z = 1; z < N - 1; z++) {
+                for (int y = 1; y < N - 1; y++) {
+                    for (int x = 1 + ((1 + y + z + color) & 1); x < N - 1; x += 2) {
+                        real* cell = f + at(x, y, z);
+                        const real* src = f0 + at(x, y, z);
+
+#pragma omp simd
+                        for (int k = 0; k < K; k++) {
+                            cell[k] = relax(src[k], cell[k + sx], cell[k - sx], cell[k + sy],
+                                            cell[k - sy], cell[k + sz], cell[k - sz], a, cRecip);
+                        }
+                    }
+                }
+            }
+        }
+
+        set_boundaries(b, f);
+    }
+}
+
+/* SOLID lanes are written and then zeroed. Selecting between zero and a computed value, as
+ * Fluid::project does, leaves a branch in the lane loop that GCC does not vectorise */
+void EnsembleFluid::project(real* velocX, real* velocY, real* velocZ, real* p, real* div,
+                            bool measure_forces) {
+    size_t sx = lanes, sy = at(0, 1, 0), sz = at(0, 0, 1);
+    const uint8_t* bits = mask.data();
+    int n = N, K = lanes;  // locals, stores through the field pointers could alias members
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < N - 1; z++) {
+        for (int y = 1; y < N - 1; y++) {
+            for (int x = 1; x < N - 1; x++) {
+                size_t c = at(x, y, z);
+
+#pragma omp simd
+                for (int k = 0; k < K; k++) {
+                    size_t i = c + k;
+                    float d = divergence(velocX[i + sx], velocX[i - sx], velocY[i + sy],
+                                         velocY[i - sy], velocZ[i + sz], velocZ[i - sz], 1.0f, n);
+
+                    div[i] = d;
+                    p[i] = 0.0f;
+                    if (bits[i] & MASK_SOLID) div[i] = 0.0f;
+                }
+            }
+        }
+    }
+    set_boundaries(FieldType::DENSITY, div);
+    set_boundaries(FieldType::DENSITY, p);
+
+    lin_solve(FieldType::DENSITY, p, div, 1, 6);
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < N - 1; z++) {
+        for (int y = 1; y < N - 1; y++) {
+            for (int x = 1; x < N - 1; x++) {
+                size_t c = at(x, y, z);
+
+#pragma omp simd
+                for (int k = 0; k < K; k++) {
+                    size_t i = c + k;
+                    float gx = subtract_gradient(velocX[i], p[i + sx], p[i - sx], 1.0f, n);
+                    float gy = subtract_gradient(velocY[i], p[i + sy], p[i - sy], 1.0f, n);
+                    float gz = subtract_gradient(velocZ[i], p[i + sz], p[i - sz], 1.0f, n);
+
+                    velocX[i] = gx;
+                    velocY[i] = gy;
+                    velocZ[i] = gz;
+                    if (bits[i] & MASK_SOLID) velocX[i] = velocY[i] = velocZ[i] = 0.0f;
+                }
+            }
+        }
+    }
+    if (measure_forces) add_forces(p);
+    set_boundaries(FieldType::VX, velocX);
+    set_boundaries(FieldType::VY, velocY);
+    set_boundaries(FieldType::VZ, velocZ);
+}
+
+/* Obstacle forces like Fluid::project measures them: every face between a fluid cell and a
+ * SOLID cell pushes the solid with the fluid cell's pressure, into the solid. Few cells have
+ * SOLID neighbours, so the lanes are visited one by one. Each thread sums into a copy of its
+ * own, the copies are added up once the sweep is done */
+void EnsembleFluid::add_forces(const real* p) {
+    size_t bodies = 0;
+    for (const std::vector<v3>& f : forces) bodies = std::max(bodies, f.size());
+    if (bodies == 0) return;
+
+    int K = lanes;
+    std::vector<v3> sums(omp_get_max_threads() * K * bodies);
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < N - 1; z++) {
+        for (int y = 1; y < N - 1; y++) {
+            v3* sum = &sums[omp_get_thread_num() * K * bodies];
+            for (int x = 1; x < N - 1; x++) {
+                size_t c = at(x, y, z);
+                for (int k = 0; k < K; k++) {
+                    uint8_t bits = mask[c + k];
+                    if (!(bits & MASK_SOLID_NEIGHBOURS) || bits & MASK_SOLID) continue;
+
+                    float pressure = p[c + k];
+                    for_each_solid_face(bits, [&](int dx, int dy, int dz) {
+                        uint8_t j = owner[at(x + dx, y + dy, z + dz) + k];
+                        if (j < forces[k].size()) sum[k * bodies + j] += v3(dx, dy, dz) * pressure;
+                    });
+                }
+            }
+        }
+    }
+
+    // the step's force is the mean over its substeps
+    float scale = 1.0f / (h * N * N * substeps);
+    for (size_t t = 0; t < sums.size(); t++) {
+        size_t k = t / bodies % K, j = t % bodies;
+        if (j < forces[k].size()) forces[k][j] += sums[t] * scale;
+    }
+}
+
+/** what advect() reads and writes, for the row kernels below */
+struct LaneGrid {
+    real* d;
+    const real *d0, *vx, *vy, *vz;
+    int n, lanes;
+    float dt0;
+};
+
+/* Semi-Lagrangian like advect_cell, over the lanes of the cells of row (j, k). Every lane traces
+ * back along its own velocity, so the 8 corners are gathered lane by lane */
+static inline __attribute__((always_inline)) void advect_lanes(const LaneGrid& g, int j, int k) {
+    int n = g.n, K = g.lanes;
+
+    for (int i = 1; i < n - 1; i++) {
+        int c = (i + n * (j + n * k)) * K;
+
+#pragma omp simd
+        for (int l = 0; l < K; l++) {
+            int index = c + l;
+            Trilinear w = trilinear_at(trace_back(i, g.vx[index], g.dt0, n),
+                                       trace_back(j, g.vy[index], g.dt0, n),
+                                       trace_back(k, g.vz[index], g.dt0, n), n);
+
+            int corner = ((w.i0 + n * (w.j0 + n * w.k0)) * K) + l;
+            g.d[index] = interpolate(w, [&](int dx, int dy, int dz) {
+                return g.d0[corner + (dx + n * (dy + n * dz)) * K];
+            });
+        }
+    }
+}
+
+static void advect_lanes_scalar(const LaneGrid& g, int j, int k) { advect_lanes(g, j, k); }
+
+/* the same loop compiled for wider vectors with hardware gathers, picked at runtime like the
+ * kernels of advect_interior. No FMA is enabled, so every lane stays bitwise equal to
+ * advect_cell */
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(FLUID_PRECISION_16)
+#define ENSEMBLE_X86
+__attribute__((target("avx2"))) static void advect_lanes_avx2(const LaneGrid& g, int j, int k) {
+    advect_lanes(g, j, k);
+}
+#endif
+
+void EnsembleFluid::advect(FieldType b, real* d, const real* d0, const real* velocX,
+                           const real* velocY, const real* velocZ) {
+    LaneGrid g = {d, d0, velocX, velocY, velocZ, N, lanes, h * (N - 2)};
+    void (*row)(const LaneGrid&, int, int) = advect_lanes_scalar;
+#ifdef ENSEMBLE_X86
+    if (advect_kernel != AdvectKernel::SCALAR && advect_kernel_supported(AdvectKernel::AVX2))
+        row = advect_lanes_avx2;
+#endif
+
+#pragma omp parallel for collapse(2)
+    for (int k = 1; k < N - 1; k++)
+        for (int j = 1; j < N - 1; j++) row(g, j, k);
+
+    set_boundaries(b, d);
+}
+
+/* Fluid::set_boundaries over all lanes, each lane's ghost cells are zero where its own
+ * obstacles are */
+void EnsembleFluid::set_boundaries(FieldType b, real* f) {
+    const uint8_t* bits = mask.data();
+    int K = lanes;
+    auto wall = [&](size_t ghost, size_t inner, bool flip) {
+#pragma omp simd
+        for (int k = 0; k < K; k++)
+            f[ghost + k] = wall_value(bits[ghost + k] & MASK_SOLID, f[inner + k], flip);
+    };
+
+#pragma omp parallel for collapse(2)
+    for (int y = 1; y < N - 1; y++) {
+        for (int x = 1; x < N - 1; x++) {
+            wall(at(x, y, 0), at(x, y, 1), b == FieldType::VZ);
+            wall(at(x, y, N - 1), at(x, y, N - 2), b == FieldType::VZ);
+        }
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < N - 1; z++) {
+        for (int x = 1; x < N - 1; x++) {
+            wall(at(x, 0, z), at(x, 1, z), b == FieldType::VY);
+            wall(at(x, N - 1, z), at(x, N - 2, z), b == FieldType::VY);
+        }
+    }
+
+#pragma omp parallel for collapse(2)
+    for (int z = 1; z < N - 1; z++) {
+        for (int y = 1; y < N - 1; y++) {
+            wall(at(0, y, z), at(1, y, z), b == FieldType::VX);
+            wall(at(N - 1, y, z), at(N - 2, y, z), b == FieldType::VX);
+        }
+    }
+
+    set_corners(f);
+}
+
+void EnsembleFluid::set_corners(real* f) {
+    int m = N - 1, l = N - 2, K = lanes;
+    auto corner = [&](int x, int y, int z, size_t a, size_t b, size_t c) {
+        real* cell = f + at(x, y, z);
+#pragma omp simd
+        for (int k = 0; k < K; k++) cell[k] = corner_value(f[a + k], f[b + k], f[c + k]);
+    };
+
+    corner(0, 0, 0, at(1, 0, 0), at(0, 1, 0), at(0, 0, 1));
+    corner(0, m, 0, at(1, m, 0), at(0, l, 0), at(0, m, 1));
+    corner(0, 0, m, at(1, 0, m), at(0, 1, m), at(0, 0, l));
+    corner(0, m, m, at(1, m, m), at(0, l, m), at(0, m, l));
+    corner(m, 0, 0, at(l, 0, 0), at(m, 1, 0), at(m, 0, 1));
+    corner(m, m, 0, at(l, m, 0), at(m, l, 0), at(m, m, 1));
+    corner(m, 0, m, at(l, 0, m), at(m, 1, m), at(m, 0, l));
+    corner(m, m, m, at(l, m, m), at(m, l, m), at(m, m, l));
+}
@@ -0,0 +1,452 @@
+#include "../../include/engine/recorder.hpp"
+
+#include <fcntl.h>
+#include <raylib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+/* A recording is a header, the frames one after another and an index of frame offsets at the
+ * end. A frame is a header, a table of its blocks and the blocks, each compressed with raylib's
+ * DEFLATE on its own. A block holds the deltas of block_cells cells, x fastest, as zigzag
+ * varints, first density, then vx, vy and vz, then the state bytes. */
+
+static constexpr char recording_magic[8] = {'F', 'L', 'U', 'I', 'D', 'R', 'E', 'C'};
+static constexpr char frame_magic[4] = {'F', 'R', 'M', 'E'};
+static constexpr char index_magic[4] = {'I', 'N', 'D', 'X'};
+static constexpr uint32_t recording_version = 1;
+
+struct RecordingHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t container_size;
+    int32_t keyframe_interval;
+    int32_t block_cells;
+    float density_step, velocity_step;
+};
+
+struct FrameHeader {
+    char magic[4];
+    uint32_t frame;
+    uint32_t keyframe; /** deltas are against zero rather than the previous frame */
+    uint32_t blocks;   /** BlockEntry records following the header */
+};
+
+struct BlockEntry {
+    uint32_t raw_size;
+    uint32_t compressed_size;
+};
+
+/** last bytes of a finished recording, preceded by the offset of every frame */
+struct RecordingIndex {
+    uint64_t offset; /** of the first frame offset */
+    uint32_t frames;
+    char magic[4];
+};
+
+static std::runtime_error recording_error(const std::string& path, const std::string& what) {
+    return std::runtime_error("Recording " + path + ": " + what);
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+/** NaNs are stored as 0, values beyond the range as its ends. The range leaves room for the
+ * difference of any two values in an int32 */
+static int32_t quantise(float value, float step) {
+    constexpr float limit = (1 << 30) - 1;
+    float q = value / step;
+    if (!(q == q)) return 0;
+    return (int32_t)std::lrint(std::clamp(q, -limit, limit));
+}
+
+static void put_varint(std::vector<uint8_t>& out, int32_t value) {
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    while (zigzag >= 0x80) {
+        out.push_back((uint8_t)(zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    out.push_back((uint8_t)zigzag);
+}
+
+/** false past the end of the block */
+static bool get_varint(const uint8_t*& p, const uint8_t* end, int32_t& value) {
+    uint32_t zigzag = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+        uint8_t byte = *p++;
+        zigzag |= (uint32_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            value = (int32_t)((zigzag >> 1) ^ -(zigzag & 1));
+            return true;
+        }
+    }
+    return false;
+}
+
+Recorder::Recorder(const std::string& path, int container_size, RecordSettings settings)
+    : path(path),
+      settings(settings),
+      container_size(container_size),
+      frames(0),
+      written(0),
+      stopping(false),
+      appending(false),
+      end(0) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw recording_error(path, strerror(errno));
+
+    RecordingHeader header = {};
+    memcpy(header.magic, recording_magic, sizeof(header.magic));
+    header.version = recording_version;
+    header.container_size = container_size;
+    header.keyframe_interval = std::max(1, settings.keyframe_interval);
+    header.block_cells = block_cells;
+    header.density_step = settings.density_step;
+    header.velocity_step = settings.velocity_step;
+    if (!write_all(fd, &header, sizeof(header))) {
+        close(fd);
+        throw recording_error(path, strerror(errno));
+    }
+    end = sizeof(header);
+    this->settings.keyframe_interval = header.keyframe_interval;
+
+    size_t cells = (size_t)container_size * container_size * container_size;
+    for (std::vector<int32_t>& field : previous) field.assign(cells, 0);
+    previous_state.assign(cells, 0);
+
+    int threads = settings.threads;
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+    for (int i = 0; i < threads; i++) pool.emplace_back(&Recorder::compress, this);
+}
+
+Recorder::~Recorder(void) {
+    try {
+        finish();
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+    }
+}
+
+/* Frames of another grid size than the recording's, after the viewer resized the fluid, are
+ * skipped. Quantising and taking the difference runs on the caller's threads, everything after
+ * that on the pool. */
+void Recorder::record(const Fluid& fluid) {
+    if (fd < 0 || fluid.container_size != container_size) return;
+
+    int n = container_size;
+    size_t cells = (size_t)n * n * n;
+    auto frame = std::make_unique<Frame>();
+    frame->index = frames++;
+    frame->keyframe = frame->index % settings.keyframe_interval == 0;
+    for (std::vector<int32_t>& field : frame->delta) field.resize(cells);
+    frame->state.resize(cells);
+
+    const Field<real>* fields[4] = {
+        &fluid.get_field(FieldType::DENSITY), &fluid.get_field(FieldType::VX),
+        &fluid.get_field(FieldType::VY), &fluid.get_field(FieldType::VZ)};
+    float steps[4] = {settings.density_step, settings.velocity_step, settings.velocity_step,
+                      settings.velocity_step};
+    const Field<CellType>& state = fluid.get_state_field();
+    bool keyframe = frame->keyframe;
+
+#pragma omp parallel for collapse(2)
+    for (int z = 0; z < n; z++) {
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                size_t i = x + (size_t)n * (y + (size_t)n * z);
+                int cell = state.index(x, y, z);
+                for (int f = 0; f < 4; f++) {
+                    int32_t q = quantise((*fields[f])[cell], steps[f]);
+                    frame->delta[f][i] = keyframe ? q : q - previous[f][i];
+                    previous[f][i] = q;
+                }
+                uint8_t s = (uint8_t)state[cell];
+                frame->state[i] = keyframe ? s : s ^ previous_state[i];
+                previous_state[i] = s;
+            }
+        }
+    }
+
+    int blocks = (cells + block_cells - 1) / block_cells;
+    frame->blocks.resize(blocks);
+    frame->raw_sizes.resize(blocks);
+    frame->remaining = blocks;
+
+    // a few frames in flight keep the pool busy, more would only pile up memory
+    std::unique_lock guard(lock);
+    space.wait(guard, [&] { return frame->index - written < (int)pool.size() + 2; });
+    for (int b = 0; b < blocks; b++) tasks.push_back({frame.get(), b});
+    pending[frame->index] = std::move(frame);
+    work.notify_all();
+}
+
+void Recorder::compress(void) {
+    std::unique_lock guard(lock);
+    while (true) {
+        work.wait(guard, [&] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) return;
+
+        Task task = tasks.front();
+        tasks.pop_front();
+        guard.unlock();
+        encode(*task.frame, task.block);
+        guard.lock();
+
+        if (--task.frame->remaining > 0 || appending) continue;
+
+        // one thread appends at a time, in frame order, whichever finished the next frame
+        appending = true;
+        while (!pending.empty() && pending.begin()->first == written &&
+               pending.begin()->second->remaining == 0) {
+            std::unique_ptr<Frame> frame = std::move(pending.begin()->second);
+            pending.erase(pending.begin());
+            guard.unlock();
+            append(*frame);
+            guard.lock();
+            written++;
+            space.notify_all();
+        }
+        appending = false;
+    }
+}
+
+void Recorder::encode(Frame& frame, int block) {
+    size_t cells = frame.state.size();
+    size_t first = (size_t)block * block_cells;
+    size_t last = std::min(cells, first + block_cells);
+
+    std::vector<uint8_t> raw;
+    raw.reserve((last - first) * 5);
+    for (const std::vector<int32_t>& field : frame.delta)
+        for (size_t i = first; i < last; i++) put_varint(raw, field[i]);
+    raw.insert(raw.end(), frame.state.begin() + first, frame.state.begin() + last);
+
+    int size = 0;
+    unsigned char* compressed = CompressData(raw.data(), raw.size(), &size);
+    frame.blocks[block].assign(compressed, compressed + size);
+    frame.raw_sizes[block] = raw.size();
+    MemFree(compressed);
+}
+
+/* runs on one pool thread at a time, a failed write is kept for finish() to report */
+void Recorder::append(Frame& frame) {
+    if (!error.empty()) return;
+
+    std::vector<uint8_t> head(sizeof(FrameHeader) + frame.blocks.size() * sizeof(BlockEntry));
+    FrameHeader header;
+    memcpy(header.magic, frame_magic, sizeof(header.magic));
+    header.frame = frame.index;
+    header.keyframe = frame.keyframe;
+    header.blocks = frame.blocks.size();
+    memcpy(head.data(), &header, sizeof(header));
+
+    size_t size = head.size();
+    for (size_t b = 0; b < frame.blocks.size(); b++) {
+        BlockEntry entry = {frame.raw_sizes[b], (uint32_t)frame.blocks[b].size()};
+        memcpy(head.data() + sizeof(header) + b * sizeof(entry), &entry, sizeof(entry));
+        size += frame.blocks[b].size();
+    }
+
+    bool ok = write_all(fd, head.data(), head.size());
+    for (size_t b = 0; ok && b < frame.blocks.size(); b++)
+        ok = write_all(fd, frame.blocks[b].data(), frame.blocks[b].size());
+    if (!ok) {
+        error = strerror(errno);
+        return;
+    }
+
+    offsets.push_back(end);
+    end += size;
+}
+
+void Recorder::finish(void) {
+    if (fd < 0) return;
+
+    {
+        std::unique_lock guard(lock);
+        space.wait(guard, [&] { return written == frames; });
+        stopping = true;
+    }
+    work.notify_all();
+    for (std::thread& thread : pool) thread.join();
+    pool.clear();
+
+    RecordingIndex index = {end, (uint32_t)offsets.size(), {}};
+    memcpy(index.magic, index_magic, sizeof(index.magic));
+    if (error.empty() && (!write_all(fd, offsets.data(), offsets.size() * sizeof(uint64_t)) ||
+                          !write_all(fd, &index, sizeof(index))))
+        error = strerror(errno);
+
+    close(fd);
+    fd = -1;
+    if (!error.empty()) throw recording_error(path, error);
+}
+
+Recording::Recording(const std::string& path) : decoded(-1) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw recording_error(path, strerror(errno));
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(RecordingHeader)) {
+        close(fd);
+        throw recording_error(path, "too short for a recording");
+    }
+
+    size = info.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) throw recording_error(path, strerror(errno));
+    bytes = static_cast<const uint8_t*>(map);
+
+    RecordingHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, recording_magic, sizeof(header.magic)) ||
+        header.version != recording_version || header.block_cells != Recorder::block_cells ||
+        header.container_size <= 0 || header.keyframe_interval <= 0) {
+        munmap(map, size);
+        throw recording_error(path, "not a recording of this version");
+    }
+    container_size = header.container_size;
+    keyframe_interval = header.keyframe_interval;
+    density_step = header.density_step;
+    velocity_step = header.velocity_step;
+
+    RecordingIndex index = {};
+    if (size >= sizeof(header) + sizeof(index))
+        memcpy(&index, bytes + size - sizeof(index), sizeof(index));
+
+    if (!memcmp(index.magic, index_magic, sizeof(index.magic)) &&
+        index.offset + index.frames * sizeof(uint64_t) + sizeof(index) == size) {
+        offsets.resize(index.frames);
+        memcpy(offsets.data(), bytes + index.offset, index.frames * sizeof(uint64_t));
+    } else {
+        // no index, the recorder did not finish: keep every frame that was written whole
+        size_t offset = sizeof(header);
+        FrameHeader frame;
+        while (offset + sizeof(frame) <= size) {
+            memcpy(&frame, bytes + offset, sizeof(frame));
+            size_t length = sizeof(frame) + (size_t)frame.blocks * sizeof(BlockEntry);
+            if (memcmp(frame.magic, frame_magic, sizeof(frame.magic)) || offset + length > size)
+                break;
+            for (uint32_t b = 0; b < frame.blocks; b++) {
+                BlockEntry entry;
+                memcpy(&entry, bytes + offset + sizeof(frame) + b * sizeof(entry), sizeof(entry));
+                length += entry.compressed_size;
+            }
+            if (offset + length > size) break;
+            offsets.push_back(offset);
+            offset += length;
+        }
+    }
+
+    size_t cells = (size_t)container_size * container_size * container_size;
+    for (std::vector<int32_t>& field : current) field.assign(cells, 0);
+    state.assign(cells, 0);
+}
+
+Recording::~Recording(void) { munmap((void*)bytes, size); }
+
+/* applies the deltas of frame to current, the blocks decompress in parallel */
+void Recording::decode(int frame) {
+    const uint8_t* chunk = bytes + offsets[frame];
+    FrameHeader header;
+    memcpy(&header, chunk, sizeof(header));
+
+    std::vector<BlockEntry> entries(header.blocks);
+    std::vector<size_t> starts(header.blocks);
+    size_t start = sizeof(header) + header.blocks * sizeof(BlockEntry);
+    for (uint32_t b = 0; b < header.blocks; b++) {
+        memcpy(&entries[b], chunk + sizeof(header) + b * sizeof(BlockEntry), sizeof(BlockEntry));
+        starts[b] = start;
+        start += entries[b].compressed_size;
+    }
+
+    size_t cells = state.size();
+    bool keyframe = header.keyframe;
+    bool corrupt = false;
+    if (header.blocks != (cells + Recorder::block_cells - 1) / Recorder::block_cells)
+        header.blocks = 0, corrupt = true;
+
+#pragma omp parallel for reduction(|| : corrupt)
+    for (uint32_t b = 0; b < header.blocks; b++) {
+        int raw_size = 0;
+        unsigned char* raw =
+            DecompressData(chunk + starts[b], entries[b].compressed_size, &raw_size);
+        if (!raw || (uint32_t)raw_size != entries[b].raw_size) {
+            corrupt = true;
+            MemFree(raw);
+            continue;
+        }
+
+        size_t first = (size_t)b * Recorder::block_cells;
+        size_t last = std::min(cells, first + Recorder::block_cells);
+        const uint8_t* p = raw;
+        const uint8_t* end = raw + raw_size;
+        for (std::vector<int32_t>& field : current) {
+            for (size_t i = first; i < last; i++) {
+                int32_t delta = 0;
+                corrupt |= !get_varint(p, end, delta);
+                field[i] = keyframe ? delta : field[i] + delta;
+            }
+        }
+        if ((size_t)(end - p) != last - first) {
+            corrupt = true;
+        } else {
+            for (size_t i = first; i < last; i++, p++) state[i] = keyframe ? *p : state[i] ^ *p;
+        }
+        MemFree(raw);
+    }
+
+    if (corrupt) {
+        decoded = -1;
+        throw std::runtime_error("Recording: frame " + std::to_string(frame) + " is corrupt");
+    }
+}
+
+void Recording::read(int frame, Snapshot& snapshot) {
+    frame = std::clamp(frame, 0, get_frames() - 1);
+    if (frame < 0) return;
+
+    int keyframe = frame - frame % keyframe_interval;
+    int first = decoded >= keyframe && decoded <= frame ? decoded + 1 : keyframe;
+    for (int f = first; f <= frame; f++) decode(f);
+    decoded = frame;
+
+    size_t cells = state.size();
+    snapshot.container_size = container_size;
+    snapshot.state.resize(cells);
+    std::vector<float>* fields[4] = {&snapshot.density, &snapshot.vx, &snapshot.vy, &snapshot.vz};
+    float steps[4] = {density_step, velocity_step, velocity_step, velocity_step};
+    for (int f = 0; f < 4; f++) fields[f]->resize(cells);
+
+#pragma omp parallel for
+    for (size_t i = 0; i < cells; i++) {
+        for (int f = 0; f < 4; f++) (*fields[f])[i] = current[f][i] * steps[f];
+        snapshot.state[i] = (CellType)state[i];
+    }
+
+    snapshot.pressure_stats = {0, SolveStats::NOT_MEASURED};
+    snapshot.diffusion_stats = {0, SolveStats::NOT_MEASURED};
+    snapshot.active_tiles = 0;
+    snapshot.substeps = 1;
+    snapshot.steps = frame;
+    snapshot.step_time = 0.0f;
+}
@@ -0,0 +1,101 @@
+#include "../../include/engine/simulation.hpp"
+
+#include <chrono>
+
+int Snapshot::clamped_index(v3 position) const {
+    int n = container_size;
+    int x = std::clamp(int(position.x), 0, n - 1);
+    int y = std::clamp(int(position.y), 0, n - 1);
+    int z = std::clamp(int(position.z), 0, n - 1);
+    return x + n * (y + n * z);
+}
+
+v3 Snapshot::get_velocity(v3 position) const {
+    int i = clamped_index(position);
+    return {vx[i], vy[i], vz[i]};
+}
+
+Simulation::Simulation(Fluid& fluid, float steps_per_second)
+    : fluid(fluid), running(true), rate(steps_per_second) {
+    // the viewer has something to draw before the first step completes
+    capture(snapshots.back(), 0, 0.0f);
+    snapshots.publish();
+
+    thread = std::thread(&Simulation::run, this);
+}
+
+Simulation::~Simulation(void) {
+    running = false;
+    thread.join();
+}
+
+void Simulation::send(Command command) {
+    while (!commands.push(command)) std::this_thread::yield();
+}
+
+/* Commands run between steps, so a step never sees a half applied edit. With a rate set, steps
+ * are spaced 1 / rate apart and a step running late starts the next one right away instead of
+ * trying to catch up. */
+void Simulation::run(void) {
+    using clock = std::chrono::steady_clock;
+
+    auto next = clock::now();
+    long steps = 0;
+    Command command;
+    while (running) {
+        while (commands.pop(command)) command(fluid);
+
+        auto start = clock::now();
+        fluid.step();
+        auto end = clock::now();
+
+        capture(snapshots.back(), ++steps, std::chrono::duration<float>(end - start).count());
+        snapshots.publish();
+
+        float steps_per_second = rate;
+        if (steps_per_second <= 0.0f) continue;
+
+        next += std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(1.0 / steps_per_second));
+        if (next < end) next = end;
+        std::this_thread::sleep_until(next);
+    }
+}
+
+void Simulation::capture(Snapshot& snapshot, long steps, float step_time) {
+    int n = fluid.container_size;
+    size_t cells = (size_t)n * n * n;
+
+    snapshot.container_size = n;
+    for (std::vector<float>* v : {&snapshot.density, &snapshot.vx, &snapshot.vy, &snapshot.vz})
+        v->resize(cells);
+    snapshot.state.resize(cells);
+
+    const Field<real>& density = fluid.get_field(FieldType::DENSITY);
+    const Field<real>& vx = fluid.get_field(FieldType::VX);
+    const Field<real>& vy = fluid.get_field(FieldType::VY);
+    const Field<real>& vz = fluid.get_field(FieldType::VZ);
+    const Field<CellType>& state = fluid.get_state_field();
+
+#pragma omp parallel for collapse(2)
+    for (int z = 0; z < n; z++) {
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                size_t i = x + (size_t)n * (y + (size_t)n * z);
+                int cell = density.index(x, y, z);
+                snapshot.density[i] = density[cell];
+                snapshot.vx[i] = vx[cell];
+                snapshot.vy[i] = vy[cell];
+                snapshot.vz[i] = vz[cell];
+                snapshot.state[i] = state[cell];
+            }
+        }
+    }
+
+    snapshot.pressure_stats = fluid.pressure_stats;
+    snapshot.diffusion_stats = fluid.diffusion_stats;
+    snapshot.active_tiles = fluid.get_active_tiles();
+    snapshot.substeps = fluid.substeps;
+    snapshot.steps = steps;
+    snapshot.step_time = step_time;
+}
@@ -0,0 +1,295 @@
+#include "../../include/engine/voxelizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+/* Both passes work on corners relative to what they test, in plain arrays: x, y, z of the
+ * three corners. The surface pass asks whether a triangle overlaps the open cell, touching a
+ * face is not enough, so a mesh face on a cell boundary does not fatten the obstacle by a cell.
+ * The fill pass casts rays along +x through cell centres and counts where they cross the mesh. */
+
+static float dot(const float a[3], const float b[3]) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/** true if the corners projected onto axis lie outside the cell's projection, axes of zero
+ * length from parallel edges separate nothing */
+static bool separates(const float axis[3], const float corners[3][3]) {
+    float radius = 0.5f * (std::fabs(axis[0]) + std::fabs(axis[1]) + std::fabs(axis[2]));
+    if (radius == 0.0f) return false;
+
+    float p0 = dot(axis, corners[0]), p1 = dot(axis, corners[1]), p2 = dot(axis, corners[2]);
+    return std::min({p0, p1, p2}) >= radius || std::max({p0, p1, p2}) <= -radius;
+}
+
+/** separating axis test of a triangle against the cell [-0.5, 0.5]^3: the 3 cell normals, the
+ * triangle normal and the 9 cross products of cell and triangle edges */
+static bool overlaps_cell(const float corners[3][3]) {
+    float edges[3][3];
+    for (int e = 0; e < 3; e++)
+        for (int k = 0; k < 3; k++) edges[e][k] = corners[(e + 1) % 3][k] - corners[e][k];
+
+    for (int a = 0; a < 3; a++) {
+        float axis[3] = {};
+        axis[a] = 1.0f;
+        if (separates(axis, corners)) return false;
+    }
+
+    float normal[3] = {edges[0][1] * edges[1][2] - edges[0][2] * edges[1][1],
+                       edges[0][2] * edges[1][0] - edges[0][0] * edges[1][2],
+                       edges[0][0] * edges[1][1] - edges[0][1] * edges[1][0]};
+    if (separates(normal, corners)) return false;
+
+    for (int a = 0; a < 3; a++) {
+        for (const float* e : edges) {
+            // cross product of the unit vector along a with e
+            float axis[3] = {};
+            axis[(a + 1) % 3] = -e[(a + 2) % 3];
+            axis[(a + 2) % 3] = e[(a + 1) % 3];
+            if (separates(axis, corners)) return false;
+        }
+    }
+    return true;
+}
+
+/** twice the signed area of (a, b, p) in the y-z plane, positive if p lies left of a -> b */
+static double edge(const double a[2], const double b[2], const double p[2]) {
+    return (b[0] - a[0]) * (p[1] - a[1]) - (b[1] - a[1]) * (p[0] - a[0]);
+}
+
+/** a point on the edge a -> b counts as inside. This is the sign the edge function would take if
+ * the point moved by (e, e^2) for a tiny e, the same for every triangle, so a ray through a
+ * shared edge or corner crosses exactly one of the triangles meeting there */
+static bool inside(double w, const double a[2], const double b[2]) {
+    if (w != 0.0) return w > 0.0;
+    return b[1] < a[1] || (b[1] == a[1] && b[0] > a[0]);
+}
+
+/** x where the ray along +x through (y, z) = p crosses triangle abc, false if it misses. Edge
+ * functions are taken in double, so the shared edge of two triangles gives exactly opposite
+ * values wherever the exact value is zero */
+static bool ray_crossing(const float corners[3][3], const double p[2], float& x) {
+    double a[2] = {corners[0][1], corners[0][2]};
+    double b[2] = {corners[1][1], corners[1][2]};
+    double c[2] = {corners[2][1], corners[2][2]};
+    float xa = corners[0][0], xb = corners[1][0], xc = corners[2][0];
+
+    double area = edge(a, b, c);
+    if (area == 0.0) return false;  // parallel to the ray
+    if (area < 0.0) {
+        std::swap(b, c);
+        std::swap(xb, xc);
+        area = -area;
+    }
+
+    double wa = edge(b, c, p), wb = edge(c, a, p), wc = edge(a, b, p);
+    if (!inside(wa, b, c) || !inside(wb, c, a) || !inside(wc, a, b)) return false;
+
+    x = float((wa * xa + wb * xb + wc * xc) / area);
+    return true;
+}
+
+CellBox CellBox::join(const CellBox& other) const {
+    if (empty()) return other;
+    if (other.empty()) return *this;
+    CellBox joined;
+    for (int k = 0; k < 3; k++) {
+        joined.lo[k] = std::min(lo[k], other.lo[k]);
+        joined.hi[k] = std::max(hi[k], other.hi[k]);
+    }
+    return joined;
+}
+
+CellBox CellBox::intersect(const CellBox& other) const {
+    CellBox common;
+    for (int k = 0; k < 3; k++) {
+        common.lo[k] = std::max(lo[k], other.lo[k]);
+        common.hi[k] = std::min(hi[k], other.hi[k]);
+    }
+    return common;
+}
+
+/** a placement split into whole cells and the fraction of a cell the corners are offset by */
+struct Placement {
+    int whole[3];
+    v3 fraction;
+
+    explicit Placement(v3 position) {
+        float p[3] = {position.x, position.y, position.z};
+        for (int k = 0; k < 3; k++) whole[k] = (int)std::floor(p[k]);
+        fraction = v3(p[0] - whole[0], p[1] - whole[1], p[2] - whole[2]);
+    }
+};
+
+/** cells a placed mesh may overlap, those whose centre lies within half a cell of its bounds */
+static CellBox mesh_bounds(const std::vector<v3>& triangles, Placement placement) {
+    CellBox box;
+    if (triangles.empty()) return box;
+
+    v3 low = triangles[0], high = triangles[0];
+    for (const v3& corner : triangles) {
+        low = v3(std::min(low.x, corner.x), std::min(low.y, corner.y), std::min(low.z, corner.z));
+        high = v3(std::max(high.x, corner.x), std::max(high.y, corner.y),
+                  std::max(high.z, corner.z));
+    }
+    low += placement.fraction;
+    high += placement.fraction;
+
+    float l[3] = {low.x, low.y, low.z}, h[3] = {high.x, high.y, high.z};
+    for (int k = 0; k < 3; k++) {
+        box.lo[k] = placement.whole[k] + (int)std::floor(l[k] - 0.5f) + 1;
+        box.hi[k] = placement.whole[k] + (int)std::ceil(h[k] + 0.5f);
+    }
+    return box;
+}
+
+/** solid cells of the mesh within box, x fastest. Works on coordinates relative to the whole
+ * cells of the placement, so the result only depends on its fraction */
+static std::vector<uint8_t> voxelize_box(const std::vector<v3>& triangles, v3 position,
+                                         const CellBox& box) {
+    std::vector<uint8_t> cells((size_t)box.dim(0) * box.dim(1) * box.dim(2), 0);
+    int count = triangles.size() / 3;
+    if (box.empty() || count == 0) return cells;
+
+    Placement placement(position);
+    int lo[3], hi[3];  // the box relative to the placement
+    for (int k = 0; k < 3; k++) {
+        lo[k] = box.lo[k] - placement.whole[k];
+        hi[k] = box.hi[k] - placement.whole[k];
+    }
+    int nx = box.dim(0), ny = box.dim(1);
+
+    auto placed = [&](int t, float corners[3][3]) {
+        for (int k = 0; k < 3; k++) {
+            v3 corner = triangles[3 * t + k] + placement.fraction;
+            corners[k][0] = corner.x;
+            corners[k][1] = corner.y;
+            corners[k][2] = corner.z;
+        }
+    };
+    auto cell = [&](int x, int y, int z) -> uint8_t& {
+        return cells[(x - lo[0]) + (size_t)nx * ((y - lo[1]) + (size_t)ny * (z - lo[2]))];
+    };
+
+    // Surface: cells whose centre lies within half a cell of the triangle's bounds
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int t = 0; t < count; t++) {
+        float corners[3][3];
+        placed(t, corners);
+
+        int first[3], last[3];
+        for (int k = 0; k < 3; k++) {
+            float low = std::min({corners[0][k], corners[1][k], corners[2][k]});
+            float high = std::max({corners[0][k], corners[1][k], corners[2][k]});
+            first[k] = std::max(lo[k], (int)std::floor(low - 0.5f) + 1);
+            last[k] = std::min(hi[k] - 1, (int)std::ceil(high + 0.5f) - 1);
+        }
+
+        for (int z = first[2]; z <= last[2]; z++) {
+            for (int y = first[1]; y <= last[1]; y++) {
+                for (int x = first[0]; x <= last[0]; x++) {
+                    float relative[3][3];
+                    for (int k = 0; k < 3; k++) {
+                        relative[k][0] = corners[k][0] - x;
+                        relative[k][1] = corners[k][1] - y;
+                        relative[k][2] = corners[k][2] - z;
+                    }
+                    if (!overlaps_cell(relative)) continue;
+#pragma omp atomic write
+                    cell(x, y, z) = 1;
+                }
+            }
+        }
+    }
+
+    // Interior: triangles are binned by the rows whose centre line their y-z bounds contain
+    std::vector<std::vector<int>> rows((size_t)ny * box.dim(2));
+    for (int t = 0; t < count; t++) {
+        float corners[3][3];
+        placed(t, corners);
+
+        float y0 = std::min({corners[0][1], corners[1][1], corners[2][1]});
+        float y1 = std::max({corners[0][1], corners[1][1], corners[2][1]});
+        float z0 = std::min({corners[0][2], corners[1][2], corners[2][2]});
+        float z1 = std::max({corners[0][2], corners[1][2], corners[2][2]});
+        int z_low = std::max(lo[2], (int)std::ceil(z0));
+        int z_high = std::min(hi[2] - 1, (int)std::floor(z1));
+        int y_low = std::max(lo[1], (int)std::ceil(y0));
+        int y_high = std::min(hi[1] - 1, (int)std::floor(y1));
+        for (int z = z_low; z <= z_high; z++)
+            for (int y = y_low; y <= y_high; y++)
+                rows[(y - lo[1]) + (size_t)ny * (z - lo[2])].push_back(t);
+    }
+
+#pragma omp parallel for schedule(dynamic, 16)
+    for (size_t r = 0; r < rows.size(); r++) {
+        if (rows[r].empty()) continue;
+        int y = lo[1] + r % ny, z = lo[2] + r / ny;
+        double p[2] = {(double)y, (double)z};
+
+        std::vector<float> crossings;
+        for (int t : rows[r]) {
+            float corners[3][3], x;
+            placed(t, corners);
+            if (ray_crossing(corners, p, x)) crossings.push_back(x);
+        }
+        if (crossings.size() % 2) continue;  // open mesh, inside and outside are unknown
+        std::sort(crossings.begin(), crossings.end());
+
+        // cells whose centre lies strictly between an entry and the following exit
+        for (size_t i = 0; i < crossings.size(); i += 2) {
+            int first = std::max(lo[0], (int)std::floor(crossings[i]) + 1);
+            int last = std::min(hi[0] - 1, (int)std::ceil(crossings[i + 1]) - 1);
+            for (int x = first; x <= last; x++) cell(x, y, z) = 1;
+        }
+    }
+
+    return cells;
+}
+
+std::vector<uint8_t> voxelize_mesh(const std::vector<v3>& triangles, v3 position, int n,
+                                   int z_begin, int z_end) {
+    CellBox planes;
+    planes.lo[2] = z_begin;
+    planes.hi[0] = planes.hi[1] = n;
+    planes.hi[2] = z_end;
+    return voxelize_box(triangles, position, planes);
+}
+
+Occupancy voxelize_placed(const std::vector<v3>& triangles, v3 position, int n,
+                          const Occupancy* previous) {
+    CellBox grid;
+    grid.hi[0] = grid.hi[1] = grid.hi[2] = n;
+
+    Placement placement(position);
+    Occupancy occupancy;
+    occupancy.box = mesh_bounds(triangles, placement).intersect(grid);
+    occupancy.position = position;
+    if (occupancy.box.empty()) return occupancy;
+
+    if (previous) {
+        Placement before(previous->position);
+        int shift[3];
+        CellBox moved = previous->box;
+        for (int k = 0; k < 3; k++) {
+            shift[k] = placement.whole[k] - before.whole[k];
+            moved.lo[k] += shift[k];
+            moved.hi[k] += shift[k];
+        }
+
+        const CellBox& box = occupancy.box;
+        if (placement.fraction == before.fraction && moved.holds(box)) {
+            occupancy.cells.resize((size_t)box.dim(0) * box.dim(1) * box.dim(2));
+            size_t i = 0;
+            for (int z = box.lo[2]; z < box.hi[2]; z++)
+                for (int y = box.lo[1]; y < box.hi[1]; y++)
+                    for (int x = box.lo[0]; x < box.hi[0]; x++)
+                        occupancy.cells[i++] =
+                            previous->solid(x - shift[0], y - shift[1], z - shift[2]);
+            return occupancy;
+        }
+    }
+
+    occupancy.cells = voxelize_box(triangles, position, occupancy.box);
+    return occupancy;
+}
@@ -9,13 +9,18 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
+#include <memory>
 #include <toml++/toml.hpp>
 #include <vector>
 
 #include "../include/engine/Fluid.hpp"
+#include "../include/engine/config.hpp"
 #include "../include/engine/engine.hpp"
+#include "../include/engine/recorder.hpp"
+#include "../include/engine/simulation.hpp"
 
 int main(int argc, char* argv[]) {
     srand(time(nullptr));
@@ -49,60 +54,89 @@ int main(int argc, char* argv[]) {
     } settings;
 
     /* Parse config file */
-    Fluid* fluid = nullptr;
+    Config config;
     try {
-        auto config = toml::parse_file("config.toml");
-        if (!config.empty()) {
-            fluid = new Fluid(config["settings"]["resolution"].value_or(24),
-                              config["settings"]["scaling"].value_or(1.0f),
-                              config["settings"]["diffusion"].value_or(0.0f),
-                              config["settings"]["viscosity"].value_or(0.000001f),
-                              config["settings"]["dt"].value_or(1.0f));
-
-            const auto& insert_position = *config["settings"]["insert_position"].as_array();
-            settings.insert_position =
-                v3(insert_position[0].value_or(1.0f), insert_position[1].value_or(1.0f),
-                   insert_position[2].value_or(1.0f));
-
-            const auto& insert_velocity = *config["settings"]["insert_velocity"].as_array();
-            settings.insert_velocity =
-                v3(insert_velocity[0].value_or(4.0f), insert_velocity[1].value_or(4.0f),
-                   insert_velocity[2].value_or(4.0f));
-
-            for (const auto& node : *config["obstacle"].as_array()) {
-                const auto& obstacle_table = *node.as_table();
-
-                const auto& position_array = *obstacle_table["position"].as_array();
-                v3 position(position_array[0].value_or(0.0f), position_array[1].value_or(0.0f),
-                            position_array[2].value_or(0.0f));
-
-                // Check if "scaling" is a valid array
-                v3 scaling(1.0f, 1.0f, 1.0f);  // Default scaling values
-                if (auto scaling_array = obstacle_table["scaling"].as_array()) {
-                    scaling = v3(scaling_array->at(0).value_or(1.0f),
-                                 scaling_array->at(1).value_or(1.0f),
-                                 scaling_array->at(2).value_or(1.0f));
-                }
-
-                std::unique_ptr<Obstacle> obstacle = std::make_unique<Obstacle>(
-                    position, scaling,
-                    LoadModel(
-                        obstacle_table["model"].value_or("No .obj file given in config.toml")),
-                    obstacle_table["enabled"].value_or(false),
-                    obstacle_table["identifier"].value_or("no identifier"));
-
-                obstacle->model.transform = MatrixMultiply(
-                    obstacle->model.transform,
-                    MatrixScale(obstacle->scaling.x, obstacle->scaling.y, obstacle->scaling.z));
-
-                fluid->add_obstacle(std::move(obstacle));
-            }
-        }
+        config = load_config("config.toml");
     } catch (const toml::parse_error& err) {
         std::cerr << "Failed to parse config file: " << err.what() << std::endl;
     }
 
-    v3 container_size(fluid->container_size * fluid->scaling);
+    Fluid* fluid = new Fluid(config.resolution, config.scaling, config.diffusion,
+                             config.viscosity, config.dt, config.layout);
+    fluid->solver = config.solver;
+    fluid->sparse = config.sparse;
+    fluid->sparse_threshold = config.sparse_threshold;
+    fluid->cfl = config.cfl;
+    fluid->max_substeps = config.max_substeps;
+    fluid->advect_scheme = config.advection;
+    settings.insert_position = config.insert_position;
+    settings.insert_velocity = config.insert_velocity;
+
+    for (const auto& obstacle : config.obstacles)
+        fluid->add_obstacle(make_obstacle(obstacle, LoadModel(obstacle.model.c_str())));
+
+    // -r file resumes from a checkpoint saved with F5, before the settings below are copied.
+    // -p file plays a recording of paper-batch -w back instead of simulating
+    std::unique_ptr<Recording> recording;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        try {
+            if (!strcmp(argv[i], "-r")) fluid->load_checkpoint(argv[i + 1]);
+            if (!strcmp(argv[i], "-p")) recording = std::make_unique<Recording>(argv[i + 1]);
+        } catch (const std::runtime_error& err) {
+            std::cerr << err.what() << std::endl;
+        }
+    }
+
+    // The fluid is stepped on its own thread from here on. The viewer edits copies of its
+    // settings and sends every change as a command, obstacles are drawn from the copies too
+    struct {
+        int container_size;
+        float scaling;
+        float diffusion;
+        PressureSolver pressure;
+        DiffusionSolver diffusion_solver;
+        AdvectScheme advection;
+        bool sparse;
+        float cfl;
+        float rate;
+    } sim = {
+        .container_size = recording ? recording->get_container_size() : fluid->container_size,
+        .scaling = fluid->scaling,
+        .diffusion = fluid->diffusion,
+        .pressure = fluid->solver.pressure,
+        .diffusion_solver = fluid->solver.diffusion,
+        .advection = fluid->advect_scheme,
+        .sparse = fluid->sparse,
+        .cfl = fluid->cfl,
+        .rate = config.steps_per_second,
+    };
+
+    struct ObstacleEdit {
+        v3 position;
+        v3 scaling;
+        bool enabled;
+    };
+    std::vector<ObstacleEdit> obstacle_edits;
+    for (auto& obstacle : fluid->obstacles)
+        obstacle_edits.push_back({obstacle->position, obstacle->scaling, obstacle->enabled});
+    bool should_voxelize = false;
+
+    std::unique_ptr<Simulation> simulation;
+    if (!recording) simulation = std::make_unique<Simulation>(*fluid, sim.rate);
+    auto send = [&](Command command) {
+        if (simulation) simulation->send(std::move(command));
+    };
+
+    // frames of the recording are shown at sim.rate per second, or one per drawn frame at 0
+    struct {
+        Snapshot snapshot;
+        int frame = 0;     /** frame to show */
+        int shown = -1;    /** frame held in snapshot */
+        float due = 0.0f;  /** fraction of the next frame that has elapsed */
+        bool paused = false;
+    } playback;
+
+    v3 container_size(sim.container_size * sim.scaling);
     v3 container_center(container_size * 0.5f);
 
     bool cursor = false;
@@ -120,15 +154,27 @@ int main(int argc, char* argv[]) {
         if (!cursor) {
             if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) || IsMouseButtonDown(MOUSE_BUTTON_RIGHT)) {
                 float amount = IsMouseButtonDown(MOUSE_BUTTON_LEFT) ? 100 : 200;
-                fluid->add_density(settings.insert_position, amount);
-                fluid->add_velocity(settings.insert_position, settings.insert_velocity);
+                send([amount, position = settings.insert_position,
+                      velocity = settings.insert_velocity](Fluid& f) {
+                    f.add_density(position, amount);
+                    f.add_velocity(position, velocity);
+                });
             }
 
             UpdateCamera(&camera, settings.camera_free ? CAMERA_FREE : CAMERA_THIRD_PERSON);
         }
 
         if (IsKeyPressed(KEY_F)) ToggleFullscreen();
-        if (IsKeyPressed(KEY_R)) fluid->reset();
+        if (IsKeyPressed(KEY_R)) send([](Fluid& f) { f.reset(); });
+        if (IsKeyPressed(KEY_F5)) {
+            send([](Fluid& f) {
+                try {
+                    f.save_checkpoint("checkpoint.fluid");
+                } catch (const std::runtime_error& err) {
+                    std::cerr << err.what() << std::endl;
+                }
+            });
+        }
         if (IsKeyPressed(KEY_ESCAPE)) {
             if (cursor) {
                 DisableCursor();
@@ -141,8 +187,27 @@ int main(int argc, char* argv[]) {
             cursor = !cursor;
         }
 
-        /* Update sim */
-        fluid->step();
+        if (recording && recording->get_frames() > 0) {
+            if (IsKeyPressed(KEY_SPACE)) playback.paused = !playback.paused;
+            if (!playback.paused) {
+                playback.due += sim.rate > 0.0f ? GetFrameTime() * sim.rate : 1.0f;
+                playback.frame = (playback.frame + (int)playback.due) % recording->get_frames();
+                playback.due -= (int)playback.due;
+            }
+
+            try {
+                if (playback.frame != playback.shown)
+                    recording->read(playback.frame, playback.snapshot);
+            } catch (const std::runtime_error& err) {
+                std::cerr << err.what() << std::endl;
+                playback.paused = true;
+            }
+            playback.shown = playback.frame;
+        }
+
+        /* Newest completed step, the simulation thread keeps stepping while it is drawn */
+        const Snapshot& snapshot = recording ? playback.snapshot : simulation->latest();
+        float scaling = sim.scaling;
 
         /* Begin Drawing */
         BeginDrawing();
@@ -152,22 +217,21 @@ int main(int argc, char* argv[]) {
 
         // Sort cell by distance to camera. This is important for backface rendering
         std::vector<Cell> cells;
-        for (float z = 0.0f; z < fluid->container_size; z++) {
-            for (float y = 0.0f; y < fluid->container_size; y++) {
-                for (float x = 0.0f; x < fluid->container_size; x++) {
+        for (float z = 0.0f; z < snapshot.container_size; z++) {
+            for (float y = 0.0f; y < snapshot.container_size; y++) {
+                for (float x = 0.0f; x < snapshot.container_size; x++) {
                     v3 position(x, y, z);
 
                     if (settings.show_cell_borders) {
-                        DrawCubeWiresV(position * fluid->scaling + fluid->scaling / 2,
-                                       v3(fluid->scaling), RED);
+                        DrawCubeWiresV(position * scaling + scaling / 2, v3(scaling), RED);
                     }
 
                     // Skip cubes with very low density
-                    if (fluid->get_density(position) > 0.01f || settings.render_low_density ||
-                        fluid->get_state(position) != CellType::FLUID) {
+                    if (snapshot.get_density(position) > 0.01f || settings.render_low_density ||
+                        snapshot.get_state(position) != CellType::FLUID) {
                         v3 cell_position = position;
-                        cell_position *= v3(fluid->scaling);
-                        cell_position += fluid->scaling / 2;
+                        cell_position *= v3(scaling);
+                        cell_position += scaling / 2;
 
                         float dx = cell_position.x - camera.position.x;
                         float dy = cell_position.y - camera.position.y;
@@ -186,16 +250,15 @@ int main(int argc, char* argv[]) {
         DrawLine3D(v3(0, 0, 0), v3(4, 0, 0), RED);
         DrawLine3D(v3(0, 0, 0), v3(0, 4, 0), GREEN);
         DrawLine3D(v3(0, 0, 0), v3(0, 0, 4), BLUE);
-        DrawCubeV(settings.insert_position + v3(fluid->scaling) / 2, v3(fluid->scaling),
-                  {255, 0, 0, 100});
+        DrawCubeV(settings.insert_position + v3(scaling) / 2, v3(scaling), {255, 0, 0, 100});
 
         /* Render obstacles */
         BeginBlendMode(BLEND_ALPHA);
         if (settings.show_models) {
-            for (auto& obstacle : fluid->obstacles) {
-                if (obstacle->enabled)
-                    DrawModel(obstacle->model, obstacle->position * fluid->scaling, fluid->scaling,
-                              WHITE);
+            for (size_t i = 0; i < fluid->obstacles.size(); i++) {
+                if (obstacle_edits[i].enabled)
+                    DrawModel(fluid->obstacles[i]->model, obstacle_edits[i].position * scaling,
+                              scaling, WHITE);
             }
         }
 
@@ -203,16 +266,16 @@ int main(int argc, char* argv[]) {
         for (const Cell& cell : cells) {
             v3 position = cell.position;
 
-            float density = fluid->get_density(position);
-            CellType state = fluid->get_state(position);
+            float density = snapshot.get_density(position);
+            CellType state = snapshot.get_state(position);
 
             switch (state) {
                 case CellType::SOLID:
-                    if (settings.show_bounds_solid) DrawCubeV(position, v3(fluid->scaling), BLUE);
+                    if (settings.show_bounds_solid) DrawCubeV(position, v3(scaling), BLUE);
                     break;
                 case CellType::CUT_CELL:
                     if (settings.show_bounds_cut_cell)
-                        DrawCubeV(position, v3(fluid->scaling), GREEN);
+                        DrawCubeV(position, v3(scaling), GREEN);
                     break;
                 case CellType::FLUID: {
                     // get color of cube
@@ -221,17 +284,18 @@ int main(int argc, char* argv[]) {
                     Color c = ColorFromHSV(hue, 1.0f, 1.0f);
                     if (settings.show_vel_arrows) {
                         Color color = {c.r, c.g, c.b, 255};
-                        DrawCylinderEx(position, position + (fluid->get_velocity(position) * 100),
+                        DrawCylinderEx(position,
+                                       position + (snapshot.get_velocity(position) * 100),
                                        density / 100.f, density / 100.f, 10, color);
                     } else {
                         Color color = {c.r, c.g, c.b, static_cast<uint8_t>(norm * 255)};
-                        DrawCubeV(position, v3(fluid->scaling), color);
+                        DrawCubeV(position, v3(scaling), color);
                     }
                     break;
                 }
                 case CellType::UNDEFINED:
                     TraceLog(LOG_WARNING, "Voxelization failed, undefined cells!");
-                    DrawCubeV(position, v3(fluid->scaling), RED);
+                    DrawCubeV(position, v3(scaling), RED);
                     break;
             }
         }
@@ -241,7 +305,7 @@ int main(int argc, char* argv[]) {
         EndMode3D();
 
         DrawFPS(10, 10);
-        if (fluid->should_voxelize) DrawText("Voxelizing...", 10, 30, 20, WHITE);
+        if (should_voxelize) DrawText("Voxelizing...", 10, 30, 20, WHITE);
 
         bool should_reset = false;
         bool should_rescale = false;
@@ -267,47 +331,80 @@ int main(int argc, char* argv[]) {
 
             ImGui::SliderFloat("camera FOV", &camera.fovy, 30.0f, 160.0f);
 
-            ImGui::SliderFloat("fluid diffusion", &fluid->diffusion, 0.0f, 0.0001f);
-
-            int old_container_size = fluid->container_size;
-            ImGui::SliderInt("container size", &fluid->container_size, 1, 64);
-            should_reset = old_container_size != fluid->container_size;
+            if (ImGui::SliderFloat("fluid diffusion", &sim.diffusion, 0.0f, 0.0001f))
+                send([diffusion = sim.diffusion](Fluid& f) { f.diffusion = diffusion; });
+
+            const char* pressure_solvers[] = {"Gauss-Seidel", "Multigrid", "PCG"};
+            if (ImGui::Combo("pressure solver", (int*)&sim.pressure, pressure_solvers, 3))
+                send([pressure = sim.pressure](Fluid& f) { f.solver.pressure = pressure; });
+            const char* advect_schemes[] = {"Semi-Lagrangian", "MacCormack", "BFECC"};
+            if (ImGui::Combo("advection", (int*)&sim.advection, advect_schemes, 3))
+                send([advection = sim.advection](Fluid& f) { f.advect_scheme = advection; });
+            const char* diffusion_solvers[] = {"Gauss-Seidel", "PCG"};
+            if (ImGui::Combo("diffusion solver", (int*)&sim.diffusion_solver, diffusion_solvers,
+                             2))
+                send([solver = sim.diffusion_solver](Fluid& f) { f.solver.diffusion = solver; });
+            for (auto [name, stats] : {std::pair{"pressure", snapshot.pressure_stats},
+                                       std::pair{"diffusion", snapshot.diffusion_stats}}) {
+                if (stats.measured())
+                    ImGui::Text("%s: %d iterations, residual %.2e", name, stats.iterations,
+                                stats.residual);
+                else
+                    ImGui::Text("%s: %d iterations, residual not measured", name,
+                                stats.iterations);
+            }
+            if (ImGui::Checkbox("sparse tiles", &sim.sparse))
+                send([sparse = sim.sparse](Fluid& f) { f.sparse = sparse; });
+            if (sim.sparse) ImGui::Text("%d active tiles", snapshot.active_tiles);
+            if (ImGui::SliderFloat("target CFL (0 = fixed dt)", &sim.cfl, 0.0f, 8.0f))
+                send([cfl = sim.cfl](Fluid& f) { f.cfl = cfl; });
+            ImGui::Text("%d substeps", snapshot.substeps);
+
+            if (ImGui::SliderFloat("steps per second (0 = unlimited)", &sim.rate, 0.0f, 240.0f) &&
+                simulation)
+                simulation->set_rate(sim.rate);
+            if (recording) {
+                ImGui::SliderInt("frame", &playback.frame, 0, recording->get_frames() - 1);
+                ImGui::Checkbox("paused (space)", &playback.paused);
+            } else {
+                ImGui::Text("step %ld, %.1f ms per step", snapshot.steps,
+                            snapshot.step_time * 1e3f);
+            }
 
-            int old_scaling = fluid->scaling;
-            ImGui::SliderFloat("container scaling", &fluid->scaling, 0.1f, 10.0f);
-            should_rescale = old_scaling != fluid->scaling;
+            should_reset = ImGui::SliderInt("container size", &sim.container_size, 1, 64);
+            should_rescale = ImGui::SliderFloat("container scaling", &sim.scaling, 0.1f, 10.0f);
 
-            drag_v3("insert position", settings.insert_position, 1.0f, 1.0f,
-                    fluid->container_size);
+            drag_v3("insert position", settings.insert_position, 1.0f, 1.0f, sim.container_size);
             drag_v3("insert velocity", settings.insert_velocity, 0.1f, -10.0f, 10.0f);
 
-            for (int i = 0; i < fluid->obstacles.size(); i++) {
-                auto& obstacle = fluid->obstacles[i];
-                bool was_enabled = obstacle->enabled;
-                v3 old_pos = obstacle->position;
-                v3 old_scaling = obstacle->scaling;
-                if (obstacle->enabled) {
+            for (size_t i = 0; i < obstacle_edits.size(); i++) {
+                auto& obstacle = fluid->obstacles[i];  // only its model is touched here
+                ObstacleEdit& edit = obstacle_edits[i];
+                bool was_enabled = edit.enabled;
+                v3 old_pos = edit.position;
+                v3 old_scaling = edit.scaling;
+                if (edit.enabled) {
                     ImGui::PushID(i);
-                    ImGui::Checkbox("##", &obstacle->enabled);
+                    ImGui::Checkbox("##", &edit.enabled);
                     ImGui::PopID();
 
                     ImGui::SameLine();
-                    drag_v3(TextFormat("%s position", obstacle->identifier.c_str()),
-                            obstacle->position, 0.1f, 1.0f, fluid->container_size);
+                    drag_v3(TextFormat("%s position", obstacle->identifier.c_str()), edit.position,
+                            0.1f, 1.0f, sim.container_size);
 
-                    drag_v3(TextFormat("%s transform", obstacle->identifier.c_str()),
-                            obstacle->scaling, 0.1f, 0.1f, 10.0f);
+                    drag_v3(TextFormat("%s transform", obstacle->identifier.c_str()), edit.scaling,
+                            0.1f, 0.1f, 10.0f);
                 } else {
                     ImGui::Checkbox(TextFormat("%s enabled", obstacle->identifier.c_str()),
-                                    &obstacle->enabled);
+                                    &edit.enabled);
                 }
 
-                if (old_pos != obstacle->position || was_enabled != obstacle->enabled ||
-                    old_scaling != obstacle->scaling) {
-                    if (old_scaling != obstacle->scaling)
-                        obstacle->model.transform = MatrixScale(
-                            obstacle->scaling.x, obstacle->scaling.y, obstacle->scaling.z);
-                    fluid->should_voxelize = true;
+                if (old_pos != edit.position || was_enabled != edit.enabled ||
+                    old_scaling != edit.scaling) {
+                    if (old_scaling != edit.scaling)
+                        obstacle->model.transform =
+                            MatrixScale(edit.scaling.x, edit.scaling.y, edit.scaling.z);
+                    should_voxelize = true;
                 }
             }
 
@@ -321,17 +418,35 @@ int main(int argc, char* argv[]) {
             rlImGuiEnd();
         }
 
-        if (fluid->should_voxelize && IsMouseButtonUp(MOUSE_BUTTON_LEFT)) fluid->voxelize_all();
+        if (should_voxelize && IsMouseButtonUp(MOUSE_BUTTON_LEFT)) {
+            send([edits = obstacle_edits](Fluid& f) {
+                for (size_t i = 0; i < edits.size(); i++) {
+                    f.obstacles[i]->position = edits[i].position;
+                    f.obstacles[i]->scaling = edits[i].scaling;
+                    f.obstacles[i]->enabled = edits[i].enabled;
+                }
+                f.voxelize_moved();
+            });
+            should_voxelize = false;
+        }
 
         if (should_reset || should_rescale) {
-            container_size = v3(fluid->container_size * fluid->scaling);
+            container_size = v3(sim.container_size * sim.scaling);
             container_center = v3(container_size * 0.5f);
-            if (should_reset) fluid->reset();
+            if (should_reset) {
+                send([n = sim.container_size](Fluid& f) {
+                    f.container_size = n;
+                    f.reset();
+                });
+            }
+            if (should_rescale)
+                send([scaling = sim.scaling](Fluid& f) { f.scaling = scaling; });
         }
 
         EndDrawing();
     }
 
+    simulation.reset();  // joins the simulation thread before the fluid goes away
     delete fluid;
     rlImGuiShutdown();
     CloseWindow();